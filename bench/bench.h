@@ -0,0 +1,72 @@
+/*
+ * Benchmark loop
+ *
+ * Runs a case in growing batches until it took at least the minimum time,
+ * then prints the time per operation and, when the case says how many
+ * bytes an operation handles, the throughput. No framework to install,
+ * numbers are comparable between runs on the same gateway.
+ */
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+/* Keeps the compiler from dropping a result */
+template <typename T>
+inline void benchKeep(const T &value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct bench_options
+{
+    double seconds; // minimum run time per case
+    const char *filter; // only cases whose name contains this
+};
+
+inline bench_options benchOptions(int argc, char **argv)
+{
+    bench_options options = {0.5, NULL};
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--time") == 0 && i + 1 < argc)
+            options.seconds = atof(argv[++i]);
+        else
+            options.filter = argv[i];
+    }
+    printf("%-40s %12s %12s %10s\n", "case", "iterations", "ns/op", "MB/s");
+    return options;
+}
+
+template <typename F>
+void bench(const bench_options &options, const char *name, size_t bytes, F op)
+{
+    if (options.filter && strstr(name, options.filter) == NULL)
+        return;
+    typedef std::chrono::steady_clock clock;
+    op(); // warm up
+    size_t iterations = 0;
+    size_t batch = 1;
+    double elapsed = 0.0;
+    while (elapsed < options.seconds)
+    {
+        clock::time_point start = clock::now();
+        for (size_t i = 0; i < batch; i++)
+            op();
+        elapsed += std::chrono::duration<double>(clock::now() - start).count();
+        iterations += batch;
+        if (batch < (1u << 20))
+            batch *= 2;
+    }
+    double ns = elapsed * 1e9 / iterations;
+    if (bytes)
+        printf("%-40s %12zu %12.1f %10.1f\n", name, iterations, ns, bytes * 1e3 / ns);
+    else
+        printf("%-40s %12zu %12.1f %10s\n", name, iterations, ns, "-");
+}
+
+#endif /* BENCH_H_ */
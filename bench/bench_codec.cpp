@@ -0,0 +1,208 @@
+/*
+ * SMA-net codec benchmarks
+ *
+ * Frames are built with the codec itself from a spot value response laid
+ * out like the inverter sends it, plus escape-heavy worst cases where every
+ * content byte needs escaping. Reading runs over an in-memory transport :
+ * the frames are placed in the session receive buffer, so no socket is
+ * touched.
+ *
+ *   bench_codec [--time <seconds>] [<name filter>]
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <Log.h>
+#include "in_bluetooth.h"
+#include "in_smadata2plus.h"
+#include "bench.h"
+#include "frames.h"
+
+Log logger;
+
+static const struct smadata2_query *findQuery(const char *name)
+{
+    const struct smadata2_query *query;
+    unsigned int pos = 0;
+    while ((query = in_smadata2plus_next_query(&pos, 0)) != NULL)
+    {
+        if (strcmp(query->q_name, name) == 0)
+            return query;
+    }
+    fprintf(stderr, "no query %s\n", name);
+    exit(1);
+}
+
+/* AC spot values : 12 records of lri, timestamp, value and padding */
+static void acResponse(const struct smadata2_query *query, struct smadata2_l2_packet *p2)
+{
+    in_smadata2plus_level2_clear(p2);
+    p2->ctrl1 = query->r_ctrl1;
+    p2->ctrl2 = query->r_ctrl2;
+    p2->content_length = 460;
+    uint32_t seed = 12345;
+    for (int i = 0; i < p2->content_length; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        p2->content[i] = seed >> 16;
+    }
+    for (int i = 0; i < query->value_count; i++)
+    {
+        const struct smadata2_value &value = query->values[i];
+        uint32_t timestamp = 1700000000 + i;
+        uint32_t v = 2300 + i * 7;
+        memcpy(p2->content + value.r_timestamp_pos, &timestamp, 4);
+        memcpy(p2->content + value.r_value_pos, &v, 4);
+    }
+}
+
+/* Counters, looked up by lri : 4 records of 16 bytes */
+static void countersResponse(const struct smadata2_query *query, struct smadata2_l2_packet *p2)
+{
+    in_smadata2plus_level2_clear(p2);
+    p2->ctrl1 = 9 + 16;
+    p2->ctrl2 = query->r_ctrl2;
+    uint32_t first = 0, last = 3;
+    memcpy(p2->content + 4, &first, 4);
+    memcpy(p2->content + 8, &last, 4);
+    int pos = SMADATA2PLUS_SPOT_RECORD_POS;
+    for (int i = 0; i < query->value_count && i < 4; i++, pos += 16)
+    {
+        uint32_t lri = query->values[i].lri | 0x01;
+        uint32_t timestamp = 1700000000;
+        uint64_t v = 123456789ULL * (i + 1);
+        memcpy(p2->content + pos, &lri, 4);
+        memcpy(p2->content + pos + 4, &timestamp, 4);
+        memcpy(p2->content + pos + 8, &v, 8);
+    }
+    p2->content_length = pos;
+}
+
+int main(int argc, char **argv)
+{
+    bench_options options = benchOptions(argc, argv);
+    static struct bluetooth_inverter inv;
+    inv.socket_fd = -1;
+    static struct smadata2_l1_packet p1;
+    static struct smadata2_l2_packet p2, ac, counters, worst;
+    static unsigned char buffer[2 * BUFSIZ], scratch[2 * BUFSIZ];
+
+    const struct smadata2_query *acQuery = findQuery("ac");
+    const struct smadata2_query *countersQuery = findQuery("counters");
+    acResponse(acQuery, &ac);
+    countersResponse(countersQuery, &counters);
+    worst = ac;
+    memset(worst.content, SMADATA2PLUS_STARTBYTE, worst.content_length);
+
+    /* checksum */
+    bench(options, "fcs16/ac_content", ac.content_length, [&]
+          {
+              unsigned char cs[2];
+              in_smadata2plus_level2_tryfcs16(ac.content, ac.content_length, cs);
+              benchKeep(cs);
+          });
+
+    /* escaping, in place */
+    bench(options, "add_escapes/typical", ac.content_length, [&]
+          {
+              int len = ac.content_length;
+              memcpy(scratch, ac.content, len);
+              in_smadata2plus_level2_add_escapes(scratch, &len);
+              benchKeep(len);
+          });
+    bench(options, "add_escapes/worst", worst.content_length, [&]
+          {
+              int len = worst.content_length;
+              memcpy(scratch, worst.content, len);
+              in_smadata2plus_level2_add_escapes(scratch, &len);
+              benchKeep(len);
+          });
+    int escapedLen = worst.content_length;
+    memcpy(buffer, worst.content, escapedLen);
+    in_smadata2plus_level2_add_escapes(buffer, &escapedLen);
+    bench(options, "strip_escapes/worst", escapedLen, [&]
+          {
+              int len = escapedLen;
+              memcpy(scratch, buffer, len);
+              in_smadata2plus_level2_strip_escapes(scratch, &len);
+              benchKeep(len);
+          });
+
+    /* L2 generation */
+    in_smadata2plus_query_packet(acQuery, &p2);
+    bench(options, "level2_packet_gen/query", 0, [&]
+          {
+              inv.l2_packet_send_count = 1;
+              benchKeep(in_smadata2plus_level2_packet_gen(&inv, buffer, &p2));
+          });
+    bench(options, "query_frame/cached", 0, [&]
+          {
+              benchKeep(in_smadata2plus_query_frame(&inv, acQuery, buffer));
+          });
+    bench(options, "level2_packet_gen/ac_response", ac.content_length, [&]
+          {
+              inv.l2_packet_send_count = 1;
+              benchKeep(in_smadata2plus_level2_packet_gen(&inv, buffer, &ac));
+          });
+    bench(options, "level2_packet_gen/worst", worst.content_length, [&]
+          {
+              inv.l2_packet_send_count = 1;
+              benchKeep(in_smadata2plus_level2_packet_gen(&inv, buffer, &worst));
+          });
+
+    /* L2 reading, the reader unescapes in place */
+    int acLen = in_smadata2plus_level2_packet_gen(&inv, buffer, &ac);
+    std::vector<unsigned char> acL2(buffer, buffer + acLen);
+    int worstLen = in_smadata2plus_level2_packet_gen(&inv, buffer, &worst);
+    std::vector<unsigned char> worstL2(buffer, buffer + worstLen);
+    bench(options, "level2_packet_read/ac_response", acLen, [&]
+          {
+              memcpy(scratch, acL2.data(), acLen);
+              benchKeep(in_smadata2plus_level2_packet_read(scratch, acLen, &p2));
+          });
+    bench(options, "level2_packet_read/worst", worstLen, [&]
+          {
+              memcpy(scratch, worstL2.data(), worstLen);
+              benchKeep(in_smadata2plus_level2_packet_read(scratch, worstLen, &p2));
+          });
+
+    /* L1 reading from the receive buffer, whole and in fragments */
+    struct
+    {
+        const char *name;
+        std::vector<unsigned char> frames;
+    } streams[] = {
+        {"level1_packet_read/ac_response", level1Frames(acL2.data(), acLen, BUFSIZ)},
+        {"level1_packet_read/ac_fragmented", level1Frames(acL2.data(), acLen, 128)},
+        {"level1_packet_read/worst_fragmented", level1Frames(worstL2.data(), worstLen, 128)},
+    };
+    for (auto &stream : streams)
+    {
+        memcpy(inv.buffer, stream.frames.data(), stream.frames.size());
+        inv.buffer_len = stream.frames.size();
+        bench(options, stream.name, stream.frames.size(), [&]
+              {
+                  inv.buffer_position = 0;
+                  p1.cmd_code = 0;
+                  benchKeep(in_smadata2plus_level1_packet_read(&inv, &p1, &p2));
+              });
+    }
+
+    /* value decoding */
+    std::vector<vec_data> samples;
+    samples.reserve(SMADATA2PLUS_REG_COUNT);
+    bench(options, "parse_values/ac", 0, [&]
+          {
+              samples.clear();
+              in_smadata2plus_parse_values(&p1, &ac, acQuery, samples, NULL);
+              benchKeep(samples.size());
+          });
+    bench(options, "parse_values/counters_by_lri", 0, [&]
+          {
+              samples.clear();
+              in_smadata2plus_parse_values(&p1, &counters, countersQuery, samples, NULL);
+              benchKeep(samples.size());
+          });
+    return 0;
+}
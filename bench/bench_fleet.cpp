@@ -0,0 +1,330 @@
+/*
+ * Fleet load test
+ *
+ * How many inverters can one gateway poll ? For every fleet size the
+ * simulated inverters and a Redis stand-in run in one process, the
+ * gateway in another : the poll scheduler, coroutine sessions, publisher
+ * thread and Redis sink as sma2redis wires them in "coroutine" mode, with
+ * the simulated inverters as devices. Only the gateway process is
+ * measured.
+ *
+ *   bench_fleet --devices 1,10,50,100 --period 10000 --cycles 3 --latency 30 --tick 250
+ *
+ * cycle is the time from the first session start to the last session end
+ * of a polling cycle, averaged and worst over the cycles. A fleet fits
+ * while cycle stays below the period and nothing is skipped or missed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <limero.h>
+#include "in_smadata2plus.h"
+#include "scheduler.h"
+#include "session.h"
+#include "series.h"
+#include "out_redis.h"
+#include "publisher.h"
+#include "inverter_sim.h"
+#include "resp_stub.h"
+
+Log logger;
+
+struct fleet_options
+{
+    std::vector<int> devices;
+    int cycles;
+    uint32_t period;  // msec
+    uint32_t timeout; // msec per response
+    uint32_t tick;    // msec
+    size_t workers;   // decode workers, 0 = decode on the loop thread
+    bool publisher;   // publish from a thread of its own
+    int latency;      // msec
+    int jitter;       // msec
+    int fragment;     // L2 bytes per L1 frame
+};
+
+/* What the gateway process measured, sent back through a pipe */
+struct fleet_result
+{
+    double cycle_avg; // msec
+    double cycle_max;
+    double p50; // session latency, msec
+    double p99;
+    uint32_t sessions;
+    uint32_t failures;
+    uint32_t skipped;
+    uint32_t missed;
+    uint32_t dropped; // polls the publisher ring had no room for
+    double cpu; // percent of one core
+    long rss;   // max resident KB
+};
+
+static fleet_options fleetOptions(int argc, char **argv)
+{
+    fleet_options o = {{1, 10, 50}, 3, 10000, 5000, 250, 0, true, 30, 20, 110};
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        const char *arg = argv[i], *value = argv[i + 1];
+        if (strcmp(arg, "--devices") == 0)
+        {
+            o.devices.clear();
+            for (const char *p = value; *p; p = strchr(p, ',') ? strchr(p, ',') + 1 : "")
+                o.devices.push_back(atoi(p));
+        }
+        else if (strcmp(arg, "--cycles") == 0)
+            o.cycles = atoi(value);
+        else if (strcmp(arg, "--period") == 0)
+            o.period = atoi(value);
+        else if (strcmp(arg, "--timeout") == 0)
+            o.timeout = atoi(value);
+        else if (strcmp(arg, "--tick") == 0)
+            o.tick = atoi(value);
+        else if (strcmp(arg, "--workers") == 0)
+            o.workers = atoi(value);
+        else if (strcmp(arg, "--publisher") == 0)
+            o.publisher = strcmp(value, "thread") == 0;
+        else if (strcmp(arg, "--latency") == 0)
+            o.latency = atoi(value);
+        else if (strcmp(arg, "--jitter") == 0)
+            o.jitter = atoi(value);
+        else if (strcmp(arg, "--fragment") == 0)
+            o.fragment = atoi(value);
+        else
+        {
+            fprintf(stderr, "unknown option %s\n", arg);
+            exit(1);
+        }
+    }
+    return o;
+}
+
+static double percentile(std::vector<double> &values, double p)
+{
+    if (values.empty())
+        return 0.0;
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, (size_t)(p * values.size()))];
+}
+
+static double cpuSeconds()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/* Inverters and Redis stand-in until the parent closes the command pipe */
+static void runSimulator(const sim_config &config, int in, int out)
+{
+    InverterSim sim(config);
+    RespStub redis;
+    int port = sim.start() && redis.start() ? redis.port() : 0;
+    if (write(out, &port, sizeof(port)) != sizeof(port) || port == 0)
+        _exit(1);
+    char c;
+    while (read(in, &c, 1) > 0)
+        ;
+    uint64_t commands = redis.commands();
+    if (write(out, &commands, sizeof(commands)) != sizeof(commands))
+        _exit(1);
+    _exit(0);
+}
+
+/* Per device state, as device_context in sma2redis */
+struct fleet_device
+{
+    SeriesCatalog catalog;
+    std::vector<vec_data> samples;
+    smadata2_stats stats[SMADATA2PLUS_REG_COUNT];
+    unsigned int polls;
+    bool inFlight;
+};
+
+struct fleet_cycle
+{
+    uint64_t first; // first session start
+    uint64_t last;  // last session end
+    int done;
+};
+
+static void runGateway(const fleet_options &o, const sim_config &sim, int port, int out)
+{
+    Thread workerThread("worker");
+    Thread publisherThread("publisher");
+    Json config;
+    config["redis"]["host"] = "127.0.0.1";
+    config["redis"]["port"] = port;
+    config["publisher"]["enabled"] = o.publisher;
+    RedisSink redis(config["redis"].as<JsonObject>());
+    if (!redis.connect())
+        _exit(1);
+    publisher_config publishing = publisherConfig(config["publisher"].as<JsonObject>());
+    Publisher publisher(publishing.enabled ? publisherThread : workerThread, redis, publishing);
+
+    PollScheduler scheduler(workerThread, o.period, 0, 0, o.tick);
+    SessionLoop loop(workerThread, o.tick, o.timeout, o.workers);
+    std::vector<fleet_device> devices(sim.inverters);
+    std::vector<fleet_cycle> cycles(o.cycles, fleet_cycle{0, 0, 0});
+    std::vector<double> latency;
+    uint32_t failures = 0;
+    uint64_t start = Sys::millis();
+
+    for (int i = 0; i < sim.inverters; i++)
+    {
+        devices[i].catalog.intern(std::to_string(2100000000 + i));
+        devices[i].polls = 0;
+        devices[i].inFlight = false;
+        scheduler.add(InverterSim::address(sim, i));
+    }
+    scheduler.handler([&](poll_slot &slot)
+                      {
+                          int i = atoi(strrchr(slot.device.c_str(), '.') + 1);
+                          fleet_device *dev = &devices[i];
+                          if (dev->inFlight)
+                              return false;
+                          dev->inFlight = true;
+                          uint64_t started = Sys::millis();
+                          uint64_t deadline = slot.base_due + scheduler.deadline();
+                          poll_slot *polled = &slot;
+                          size_t cycle = (started - start) / o.period;
+                          if (cycle < cycles.size() && cycles[cycle].first == 0)
+                              cycles[cycle].first = started;
+                          loop.start(slot.device, "0000", dev->polls++, dev->stats, NULL, {},
+                                     [&, dev, cycle, started, deadline, polled](bool ok,
+                                                                                std::vector<vec_data> &samples,
+                                                                                std::vector<session_download> &,
+                                                                                const struct bluetooth_inverter &)
+                                     {
+                                         dev->inFlight = false;
+                                         scheduler.finished(*polled, started, deadline);
+                                         if (cycle >= cycles.size())
+                                             return;
+                                         uint64_t now = Sys::millis();
+                                         cycles[cycle].last = std::max(cycles[cycle].last, now);
+                                         cycles[cycle].done++;
+                                         latency.push_back(now - started);
+                                         if (!ok)
+                                         {
+                                             failures++;
+                                             return;
+                                         }
+                                         dev->samples.swap(samples);
+                                         publisher.samples(dev->catalog, dev->samples);
+                                     });
+                          return true;
+                      });
+
+    /* the last cycle ends within the period plus a session timeout */
+    double cpuStart = cpuSeconds();
+    TimerSource done(workerThread, o.period * o.cycles + o.timeout + 1000, false, "fleet");
+    done >> [&](const TimerMsg &)
+    {
+        fleet_result r = {0.0, 0.0, 0.0, 0.0, (uint32_t)latency.size(), failures, 0, 0,
+                          publisher.dropped(), 0.0, 0};
+        int measured = 0;
+        for (auto &c : cycles)
+        {
+            if (c.done == 0)
+                continue;
+            double ms = c.last - c.first;
+            r.cycle_avg += ms;
+            r.cycle_max = std::max(r.cycle_max, ms);
+            measured++;
+        }
+        if (measured)
+            r.cycle_avg /= measured;
+        for (auto &slot : scheduler.slots())
+        {
+            r.skipped += slot.skipped;
+            r.missed += slot.missed;
+        }
+        r.p50 = percentile(latency, 0.50);
+        r.p99 = percentile(latency, 0.99);
+        r.cpu = 100.0 * (cpuSeconds() - cpuStart) * 1000.0 / (Sys::millis() - start);
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        r.rss = ru.ru_maxrss;
+        if (write(out, &r, sizeof(r)) != sizeof(r))
+            _exit(1);
+        _exit(0);
+    };
+    done.start();
+    scheduler.start();
+    publisher.start();
+    if (publishing.enabled)
+        publisherThread.start();
+    workerThread.run();
+}
+
+int main(int argc, char **argv)
+{
+    fleet_options o = fleetOptions(argc, argv);
+    printf("period=%u ms tick=%u ms latency=%d+%d ms workers=%u publisher=%s\n", o.period, o.tick,
+           o.latency, o.jitter, (unsigned)o.workers, o.publisher ? "thread" : "inline");
+    printf("%8s %10s %10s %9s %9s %9s %6s %8s %6s %6s %6s %10s\n", "devices", "cycle ms", "max ms",
+           "p50 ms", "p99 ms", "sessions", "fail", "skip/mis", "drop", "cpu %", "rss MB", "redis cmd");
+    fflush(stdout);
+
+    for (int n : o.devices)
+    {
+        sim_config sim = {std::to_string(getpid() % 100000), n, o.latency, o.jitter, o.fragment};
+        int toSim[2], fromSim[2], fromGateway[2];
+        if (pipe(toSim) < 0 || pipe(fromSim) < 0)
+            return 1;
+
+        pid_t simulator = fork();
+        if (simulator == 0)
+        {
+            close(toSim[1]);
+            runSimulator(sim, toSim[0], fromSim[1]);
+        }
+        close(toSim[0]);
+        close(fromSim[1]);
+        int port = 0;
+        if (read(fromSim[0], &port, sizeof(port)) != sizeof(port) || port == 0)
+        {
+            fprintf(stderr, "simulator failed to start\n");
+            return 1;
+        }
+
+        if (pipe(fromGateway) < 0)
+            return 1;
+        pid_t gateway = fork();
+        if (gateway == 0)
+        {
+            close(toSim[1]);
+            runGateway(o, sim, port, fromGateway[1]);
+            _exit(1);
+        }
+        close(fromGateway[1]);
+        fleet_result r;
+        bool ok = read(fromGateway[0], &r, sizeof(r)) == sizeof(r);
+        waitpid(gateway, NULL, 0);
+        close(fromGateway[0]);
+
+        close(toSim[1]);
+        uint64_t commands = 0;
+        if (read(fromSim[0], &commands, sizeof(commands)) != sizeof(commands))
+            fprintf(stderr, "simulator didn't report\n");
+        waitpid(simulator, NULL, 0);
+        close(fromSim[0]);
+
+        if (!ok)
+        {
+            printf("%8d gateway failed\n", n);
+            continue;
+        }
+        printf("%8d %10.0f %10.0f %9.0f %9.0f %9u %6u %4u/%-3u %6u %6.1f %6.1f %10llu\n", n, r.cycle_avg,
+               r.cycle_max, r.p50, r.p99, r.sessions, r.failures, r.skipped, r.missed, r.dropped, r.cpu,
+               r.rss / 1024.0, (unsigned long long)commands);
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,39 @@
+/*
+ * Frame helpers shared by the benchmarks
+ */
+
+#ifndef FRAMES_H_
+#define FRAMES_H_
+
+#include <string.h>
+#include <vector>
+#include "in_smadata2plus.h"
+
+/* L1 frames from src to dest around an L2 stream, split over fragments of
+ * at most chunk bytes. Addresses as they appear on the wire */
+inline std::vector<unsigned char> level1Frames(const unsigned char *l2, int len, int chunk,
+                                               int cmd = SMADATA2PLUS_L1_CMDCODE_LEVEL2,
+                                               const unsigned char *src = NULL)
+{
+    static const unsigned char defaultSrc[6] = {0x24, 0x32, 0x1d, 0x25, 0x80, 0x00};
+    std::vector<unsigned char> out;
+    int done = 0;
+    do
+    {
+        int part = len - done < chunk ? len - done : chunk;
+        int length = SMADATA2PLUS_L1_HEADER_LEN + part;
+        int code = done + part < len ? SMADATA2PLUS_L1_CMDCODE_FRAGMENT : cmd;
+        unsigned char header[SMADATA2PLUS_L1_HEADER_LEN] = {
+            SMADATA2PLUS_STARTBYTE, (unsigned char)(length & 0xff), (unsigned char)(length >> 8), 0,
+            0, 0, 0, 0, 0, 0, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+            (unsigned char)(code & 0xff), (unsigned char)(code >> 8)};
+        header[3] = header[0] ^ header[1] ^ header[2];
+        memcpy(header + 4, src ? src : defaultSrc, 6);
+        out.insert(out.end(), header, header + sizeof(header));
+        out.insert(out.end(), l2 + done, l2 + done + part);
+        done += part;
+    } while (done < len);
+    return out;
+}
+
+#endif /* FRAMES_H_ */
@@ -0,0 +1,352 @@
+/*
+ * Simulated inverters
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <Log.h>
+#include "in_smadata2plus.h"
+#include "inverter_sim.h"
+#include "frames.h"
+
+static const unsigned short SIM_SUSYID = 0x0080; // SB 8000TL/10000TL
+static const uint32_t SIM_SERIAL = 2100000000;
+
+static uint64_t nowMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+InverterSim::InverterSim(const sim_config &config)
+    : _config(config), _stop(false), _random(getpid())
+{
+}
+
+InverterSim::~InverterSim()
+{
+    _stop = true;
+    if (_thread.joinable())
+        _thread.join();
+    for (int fd : _listeners)
+        close(fd);
+    for (auto &c : _connections)
+        close(c->rx->socket_fd);
+}
+
+/* Keep the name short, the address has to fit bluetooth_inverter.macaddr */
+std::string InverterSim::address(const sim_config &config, int inverter)
+{
+    return "unix:@" + config.name + "." + std::to_string(inverter);
+}
+
+bool InverterSim::start()
+{
+    for (int i = 0; i < _config.inverters; i++)
+    {
+        std::string path = address(_config, i).substr(5);
+        struct sockaddr_un addr = {0};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        addr.sun_path[0] = 0;
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&addr, offsetof(struct sockaddr_un, sun_path) + path.size()) < 0 ||
+            listen(fd, 4) < 0)
+        {
+            WARN("[Sim] cannot listen on %s: %s", path.c_str(), strerror(errno));
+            return false;
+        }
+        _listeners.push_back(fd);
+    }
+    _thread = std::thread(&InverterSim::run, this);
+    return true;
+}
+
+/* Address of an inverter as the session reads it from an L2 reply :
+ * susyid and serial, byte reversed */
+void InverterSim::address(int inverter, unsigned char *src) const
+{
+    uint32_t serial = SIM_SERIAL + inverter;
+    unsigned char addr[6] = {(unsigned char)(SIM_SUSYID & 0xff), (unsigned char)(SIM_SUSYID >> 8)};
+    memcpy(addr + 2, &serial, 4);
+    for (int i = 0; i < 6; i++)
+        src[i] = addr[5 - i];
+}
+
+void InverterSim::reply(connection &c, int cmd, const unsigned char *content, int len)
+{
+    unsigned char src[6];
+    address(c.inverter, src);
+    int delay = _config.latency;
+    if (_config.jitter > 0)
+    {
+        _random = _random * 1103515245 + 12345;
+        delay += (_random >> 16) % _config.jitter;
+    }
+    frame f = {nowMs() + delay, level1Frames(content, len, _config.fragment, cmd, src)};
+    /* answers keep their order */
+    if (!c.out.empty() && c.out.back().due > f.due)
+        f.due = c.out.back().due;
+    c.out.push_back(f);
+}
+
+/* p2 as the session will read it. level2_packet_gen writes a one byte
+ * packet counter where the reader skips a two byte packet id, the first
+ * content byte stands in for its high byte */
+void InverterSim::replyLevel2(connection &c, struct smadata2_l2_packet &p2)
+{
+    unsigned char buffer[2 * BUFSIZ];
+    memmove(p2.content + 1, p2.content, p2.content_length++);
+    p2.content[0] = 0x80;
+    address(c.inverter, p2.src);
+    int len = in_smadata2plus_level2_packet_gen(c.rx.get(), buffer, &p2);
+    reply(c, SMADATA2PLUS_L1_CMDCODE_LEVEL2, buffer, len);
+}
+
+/* A plausible raw value of a register, just above its minimum */
+static int64_t simValue(int id, int inverter)
+{
+    const struct smadata2_register_def &reg = SMADATA2PLUS_REGISTERS[id];
+    double value = reg.min + (reg.max - reg.min) * (10 + inverter % 10) / 1000.0;
+    return (int64_t)(value / reg.factor);
+}
+
+/* Spot values come as records of 28 bytes (40 for status tags) : lri,
+ * timestamp, value. Values at a fixed position sit in the first records,
+ * values looked up by lri follow */
+void InverterSim::answerQuery(connection &c, const struct smadata2_query *query)
+{
+    struct smadata2_l2_packet p2;
+    in_smadata2plus_level2_clear(&p2);
+    uint32_t timestamp = time(NULL);
+    int size = query->values[0].r_value_len == SMADATA2PLUS_VALUE_STATUS ? 40 : 28;
+
+    uint32_t count = 0;
+    for (int i = 0; i < query->value_count; i++)
+    {
+        const struct smadata2_value &value = query->values[i];
+        if (!value.lri && (uint32_t)(value.r_value_pos - SMADATA2PLUS_SPOT_RECORD_POS) / size + 1 > count)
+            count = (value.r_value_pos - SMADATA2PLUS_SPOT_RECORD_POS) / size + 1;
+    }
+    memset(p2.content, 0, SMADATA2PLUS_SPOT_RECORD_POS + size * (count + query->value_count));
+
+    for (int i = 0; i < query->value_count; i++)
+    {
+        const struct smadata2_value &value = query->values[i];
+        int64_t raw = simValue(value.id, c.inverter);
+        if (!value.lri)
+        {
+            memcpy(p2.content + value.r_timestamp_pos, &timestamp, 4);
+            memcpy(p2.content + value.r_value_pos, &raw, 4);
+            continue;
+        }
+        int pos = SMADATA2PLUS_SPOT_RECORD_POS + size * count++;
+        uint32_t code = value.lri | (value.lri_class ? value.lri_class : 1);
+        memcpy(p2.content + pos, &code, 4);
+        memcpy(p2.content + pos + 4, &timestamp, 4);
+        if (size == 40)
+        {
+            uint32_t tags[2] = {0x01000133, SMADATA2PLUS_STATUS_END};
+            memcpy(p2.content + pos + 8, tags, sizeof(tags));
+        }
+        else
+        {
+            memcpy(p2.content + pos + 8, &raw, value.r_value_len == 8 ? 8 : 4);
+        }
+    }
+
+    uint32_t first = 0, last = count - 1;
+    memcpy(p2.content + 4, &first, 4);
+    memcpy(p2.content + 8, &last, 4);
+    p2.content_length = SMADATA2PLUS_SPOT_RECORD_POS + size * count;
+    p2.ctrl1 = 9 + size * count / 4;
+    p2.ctrl2 = query->r_ctrl2;
+    replyLevel2(c, p2);
+}
+
+/* Archive and event log records from..to : day records every 5 minutes,
+ * month records every day and an event every hour, at most 200. They come
+ * in packets of 20 records, fragment counts down to 0 on the last one */
+void InverterSim::answerArchive(connection &c, uint32_t command, uint32_t from, uint32_t to)
+{
+    int len = in_smadata2plus_archive_record_len(command);
+    uint32_t step = command == SMADATA2PLUS_ARCHIVE_DAY ? 300 : command == SMADATA2PLUS_ARCHIVE_MONTH ? 86400 : 3600;
+    std::vector<uint32_t> times;
+    for (uint32_t t = from - from % step + step; t <= to && times.size() < 200; t += step)
+        times.push_back(t);
+
+    size_t packets = times.empty() ? 1 : (times.size() + 19) / 20;
+    for (size_t k = 0; k < packets; k++)
+    {
+        struct smadata2_l2_packet p2;
+        in_smadata2plus_level2_clear(&p2);
+        memcpy(p2.content, &command, 4);
+        int count = 0;
+        for (size_t i = k * 20; i < times.size() && i < (k + 1) * 20; i++, count++)
+        {
+            unsigned char *r = p2.content + SMADATA2PLUS_ARCHIVE_RECORD_POS + count * len;
+            memcpy(r, &times[i], 4);
+            if (len == SMADATA2PLUS_ARCHIVE_RECORD_LEN)
+            {
+                int64_t wh = (int64_t)(c.inverter + 1) * 1000000 + times[i] / 300 * 10;
+                memcpy(r + 4, &wh, 8);
+                continue;
+            }
+            uint16_t entry = times[i] / 3600, code = 100 + entry % 10;
+            uint32_t serial = SIM_SERIAL + c.inverter;
+            memcpy(r + 4, &entry, 2);
+            memcpy(r + 6, &SIM_SUSYID, 2);
+            memcpy(r + 8, &serial, 4);
+            memcpy(r + 12, &code, 2);
+        }
+        p2.content_length = SMADATA2PLUS_ARCHIVE_RECORD_POS + count * len;
+        p2.ctrl1 = 9 + p2.content_length / 4;
+        p2.ctrl2 = 0xe0;
+        p2.fragment = packets - 1 - k;
+        replyLevel2(c, p2);
+    }
+}
+
+/* Answer every complete frame in the receive buffer */
+void InverterSim::handle(connection &c)
+{
+    struct smadata2_l1_packet p1;
+    struct smadata2_l2_packet p2;
+    static const unsigned char level1_10[] = {0x00, 0x04, 0x70, 0x00, 0x01};
+    static const unsigned char level1_5[] = {0x00, 0x04, 0x70, 0x00, 0x01, 0x00};
+
+    while (in_smadata2plus_level1_complete(c.rx.get()))
+    {
+        memset(&p2, 0, sizeof(p2));
+        p1.cmd_code = 0;
+        int cmd = in_smadata2plus_level1_packet_read(c.rx.get(), &p1, &p2);
+        if (cmd == SMADATA2PLUS_L1_CMDCODE_BROADCAST)
+        {
+            reply(c, SMADATA2PLUS_L1_CMDCODE_10, level1_10, sizeof(level1_10));
+            reply(c, SMADATA2PLUS_L1_CMDCODE_5, level1_5, sizeof(level1_5));
+            continue;
+        }
+        if (cmd != SMADATA2PLUS_L1_CMDCODE_LEVEL2)
+            continue;
+        if (p2.ctrl1 == 0x08)
+            continue; // second init packet isn't answered
+        if (p2.ctrl1 == 0x0e)
+        {
+            p2.ctrl2 = 0xd0;
+            replyLevel2(c, p2); // login, the request echoed
+            continue;
+        }
+        /* the request as read lacks the first content byte, see replyLevel2 */
+        const struct smadata2_query *query = NULL;
+        for (unsigned int i = 0; i < in_smadata2plus_query_count(); i++)
+        {
+            const struct smadata2_query *q = in_smadata2plus_query(i);
+            if (p2.content_length == q->q_content_length - 1 &&
+                memcmp(p2.content, q->q_content + 1, p2.content_length) == 0)
+                query = q;
+        }
+        if (query)
+        {
+            answerQuery(c, query);
+            continue;
+        }
+        uint32_t words[3];
+        memcpy(words, p2.content, sizeof(words));
+        if (p2.content_length == sizeof(words) &&
+            (words[0] == SMADATA2PLUS_ARCHIVE_DAY || words[0] == SMADATA2PLUS_ARCHIVE_MONTH ||
+             words[0] == SMADATA2PLUS_EVENTS_USER || words[0] == SMADATA2PLUS_EVENTS_INSTALLER))
+        {
+            answerArchive(c, words[0], words[1], words[2]);
+            continue;
+        }
+        /* first init packet : the reply carries our address */
+        p2.ctrl2 = 0xd0;
+        replyLevel2(c, p2);
+    }
+}
+
+void InverterSim::run()
+{
+    static const unsigned char broadcast[] = {0x00, 0x04, 0x70, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00};
+    std::vector<struct pollfd> fds;
+    while (!_stop)
+    {
+        uint64_t now = nowMs();
+        int timeout = 50;
+        fds.clear();
+        for (int fd : _listeners)
+            fds.push_back({fd, POLLIN, 0});
+        for (auto &c : _connections)
+        {
+            short events = POLLIN;
+            if (!c->out.empty() && c->out.front().due <= now)
+                events |= POLLOUT;
+            else if (!c->out.empty() && (int)(c->out.front().due - now) < timeout)
+                timeout = c->out.front().due - now;
+            fds.push_back({c->rx->socket_fd, events, 0});
+        }
+        if (poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR)
+            break;
+
+        for (size_t i = 0; i < _listeners.size(); i++)
+        {
+            if (!(fds[i].revents & POLLIN))
+                continue;
+            int fd = accept4(_listeners[i], NULL, NULL, SOCK_NONBLOCK);
+            if (fd < 0)
+                continue;
+            std::unique_ptr<connection> c(new connection());
+            c->inverter = i;
+            c->rx.reset(new bluetooth_inverter());
+            c->rx->socket_fd = fd;
+            c->rx->l2_packet_send_count = 1;
+            snprintf(c->rx->macaddr, sizeof(c->rx->macaddr), "sim %d", (int)i);
+            reply(*c, SMADATA2PLUS_L1_CMDCODE_BROADCAST, broadcast, sizeof(broadcast));
+            _connections.push_back(std::move(c));
+        }
+
+        now = nowMs();
+        for (size_t i = 0; i < _connections.size();)
+        {
+            connection &c = *_connections[i];
+            size_t slot = _listeners.size() + i;
+            bool closed = false;
+            if (slot < fds.size() && (fds[slot].revents & (POLLIN | POLLHUP | POLLERR)))
+            {
+                closed = in_bluetooth_receive(c.rx.get()) < 0;
+                if (!closed)
+                    handle(c);
+            }
+            while (!closed && !c.out.empty() && c.out.front().due <= now)
+            {
+                frame &f = c.out.front();
+                ssize_t n = send(c.rx->socket_fd, f.bytes.data(), f.bytes.size(), MSG_NOSIGNAL);
+                if (n < 0 && errno == EAGAIN)
+                    break;
+                if (n < 0)
+                {
+                    closed = true;
+                    break;
+                }
+                f.bytes.erase(f.bytes.begin(), f.bytes.begin() + n);
+                if (f.bytes.empty())
+                    c.out.pop_front();
+            }
+            if (closed)
+            {
+                close(c.rx->socket_fd);
+                _connections.erase(_connections.begin() + i);
+                fds.erase(fds.begin() + slot);
+                continue;
+            }
+            i++;
+        }
+    }
+}
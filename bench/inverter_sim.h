@@ -0,0 +1,70 @@
+/*
+ * Simulated inverters
+ *
+ * Each inverter listens on an abstract unix socket (the session connects
+ * to "unix:@<name>" instead of an RFCOMM address) and answers the
+ * handshake, login, every spot value query of SMADATA2PLUS_QUERIES and
+ * the archive and event log queries the way an inverter does. Answers leave after the configured radio
+ * latency, large ones split into L1 fragments. All inverters are served
+ * by one thread.
+ */
+
+#ifndef INVERTER_SIM_H_
+#define INVERTER_SIM_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "in_bluetooth.h"
+
+struct sim_config
+{
+    std::string name; // socket names are @<name>.<inverter>
+    int inverters;
+    int latency;  // msec before an answer leaves
+    int jitter;   // msec added at random
+    int fragment; // max L2 bytes per L1 frame
+};
+
+class InverterSim
+{
+public:
+    InverterSim(const sim_config &config);
+    ~InverterSim();
+    bool start();
+    static std::string address(const sim_config &config, int inverter);
+
+private:
+    struct frame
+    {
+        uint64_t due;
+        std::vector<unsigned char> bytes;
+    };
+    struct connection
+    {
+        int inverter;
+        std::unique_ptr<struct bluetooth_inverter> rx; // receive buffer
+        std::deque<frame> out;
+    };
+
+    void run();
+    void handle(connection &c);
+    void reply(connection &c, int cmd, const unsigned char *content, int len);
+    void replyLevel2(connection &c, struct smadata2_l2_packet &p2);
+    void answerQuery(connection &c, const struct smadata2_query *query);
+    void answerArchive(connection &c, uint32_t command, uint32_t from, uint32_t to);
+    void address(int inverter, unsigned char *src) const;
+
+    sim_config _config;
+    std::vector<int> _listeners;
+    std::vector<std::unique_ptr<connection>> _connections;
+    std::atomic<bool> _stop;
+    uint32_t _random;
+    std::thread _thread;
+};
+
+#endif /* INVERTER_SIM_H_ */
@@ -0,0 +1,135 @@
+/*
+ * Redis stand-in
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <Log.h>
+#include "resp_stub.h"
+
+RespStub::RespStub() : _listener(-1), _port(0), _stop(false), _commands(0) {}
+
+RespStub::~RespStub()
+{
+    _stop = true;
+    if (_thread.joinable())
+        _thread.join();
+    for (auto &c : _clients)
+        close(c.fd);
+    if (_listener >= 0)
+        close(_listener);
+}
+
+/* Listen on an ephemeral port of the loopback interface */
+bool RespStub::start()
+{
+    struct sockaddr_in addr = {0};
+    socklen_t len = sizeof(addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    _listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (_listener < 0 || bind(_listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(_listener, 16) < 0 || getsockname(_listener, (struct sockaddr *)&addr, &len) < 0)
+    {
+        WARN("[Stub] cannot listen: %s", strerror(errno));
+        return false;
+    }
+    _port = ntohs(addr.sin_port);
+    _thread = std::thread(&RespStub::run, this);
+    return true;
+}
+
+/* Count the complete commands in the input, an array of bulk strings
+ * each, and drop them. Returns the number of commands */
+size_t RespStub::parse(client &c)
+{
+    size_t pos = 0, count = 0;
+    while (pos < c.in.size())
+    {
+        size_t p = pos;
+        if (c.in[p] != '*')
+            return count; // inline commands aren't sent by hiredis
+        size_t eol = c.in.find("\r\n", p);
+        if (eol == std::string::npos)
+            break;
+        long items = atol(c.in.c_str() + p + 1);
+        p = eol + 2;
+        bool complete = true;
+        for (long i = 0; i < items && complete; i++)
+        {
+            eol = c.in.find("\r\n", p);
+            if (eol == std::string::npos || c.in[p] != '$')
+            {
+                complete = false;
+                break;
+            }
+            size_t len = atol(c.in.c_str() + p + 1);
+            p = eol + 2 + len + 2;
+            complete = p <= c.in.size();
+        }
+        if (!complete)
+            break;
+        pos = p;
+        count++;
+    }
+    c.in.erase(0, pos);
+    return count;
+}
+
+void RespStub::run()
+{
+    std::vector<struct pollfd> fds;
+    std::string replies;
+    char buffer[65536];
+    while (!_stop)
+    {
+        fds.clear();
+        fds.push_back({_listener, POLLIN, 0});
+        for (auto &c : _clients)
+            fds.push_back({c.fd, POLLIN, 0});
+        if (poll(fds.data(), fds.size(), 50) <= 0)
+            continue;
+
+        for (size_t i = _clients.size(); i > 0; i--)
+        {
+            if (!fds[i].revents)
+                continue;
+            client &c = _clients[i - 1];
+            ssize_t n = read(c.fd, buffer, sizeof(buffer));
+            if (n <= 0)
+            {
+                if (n < 0 && errno == EAGAIN)
+                    continue;
+                close(c.fd);
+                _clients.erase(_clients.begin() + i - 1);
+                continue;
+            }
+            c.in.append(buffer, n);
+            size_t count = parse(c);
+            _commands += count;
+            replies.clear();
+            for (size_t r = 0; r < count; r++)
+                replies.append("+OK\r\n", 5);
+            /* replies are tiny, a blocking write keeps this simple */
+            for (size_t done = 0; done < replies.size();)
+            {
+                ssize_t w = send(c.fd, replies.data() + done, replies.size() - done, MSG_NOSIGNAL);
+                if (w < 0 && errno != EAGAIN)
+                    break;
+                if (w > 0)
+                    done += w;
+            }
+        }
+        if (fds[0].revents & POLLIN)
+        {
+            int fd = accept4(_listener, NULL, NULL, SOCK_NONBLOCK);
+            if (fd >= 0)
+                _clients.push_back({fd, std::string()});
+        }
+    }
+}
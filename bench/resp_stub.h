@@ -0,0 +1,45 @@
+/*
+ * Redis stand-in
+ *
+ * Accepts RESP commands on a local port and answers every one with +OK,
+ * so the sink runs its real encoding, pipelining and reply reads without
+ * a Redis server whose own cost would show up in the numbers.
+ */
+
+#ifndef RESP_STUB_H_
+#define RESP_STUB_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+class RespStub
+{
+public:
+    RespStub();
+    ~RespStub();
+    bool start();
+    int port() const { return _port; }
+    uint64_t commands() const { return _commands.load(std::memory_order_relaxed); }
+
+private:
+    struct client
+    {
+        int fd;
+        std::string in;
+    };
+
+    void run();
+    size_t parse(client &c);
+
+    int _listener;
+    int _port;
+    std::vector<client> _clients;
+    std::atomic<bool> _stop;
+    std::atomic<uint64_t> _commands;
+    std::thread _thread;
+};
+
+#endif /* RESP_STUB_H_ */
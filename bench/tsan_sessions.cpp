@@ -0,0 +1,99 @@
+/*
+ * Session race check
+ *
+ * Keeps the coroutine sessions of several simulated inverters in flight
+ * at once with decode workers, so the protocol code runs concurrently for
+ * different inverters on different threads. Every session downloads an
+ * archive and an event log range too. Built with -fsanitize=thread
+ * (cmake -DBUILD_TSAN=ON) any state still shared between sessions shows
+ * up as a data race report.
+ *
+ *   tsan_sessions --devices 8 --workers 4 --rounds 20
+ *
+ * Exits with 1 when a session failed. ThreadSanitizer exits with 66 when
+ * it reported a race.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <limero.h>
+#include "in_smadata2plus.h"
+#include "session.h"
+#include "inverter_sim.h"
+
+Log logger;
+
+struct race_device
+{
+    std::vector<smadata2_stats> stats;
+    int rounds;    // sessions done
+    bool inFlight;
+};
+
+int main(int argc, char **argv)
+{
+    int devices = 8, workers = 4, rounds = 20;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        if (strcmp(argv[i], "--devices") == 0)
+            devices = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--workers") == 0)
+            workers = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--rounds") == 0)
+            rounds = atoi(argv[i + 1]);
+        else
+        {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    /* socket names have to fit the 17 characters of a device address */
+    sim_config sim = {"r" + std::to_string(getpid() % 100000), devices, 5, 5, 110};
+    InverterSim inverters(sim);
+    if (!inverters.start())
+        return 1;
+
+    Thread thread("sessions");
+    SessionLoop loop(thread, 5, 2000, workers, 2000, 0);
+    std::vector<race_device> fleet(devices, race_device{std::vector<smadata2_stats>(SMADATA2PLUS_REG_COUNT), 0, false});
+    int finished = 0, failures = 0;
+
+    /* every device polled again as soon as its session ended */
+    TimerSource timer(thread, 10, true, "race");
+    timer >> [&](const TimerMsg &)
+    {
+        for (int i = 0; i < devices; i++)
+        {
+            race_device *dev = &fleet[i];
+            if (dev->inFlight || dev->rounds == rounds)
+                continue;
+            dev->inFlight = true;
+            time_t now = time(NULL);
+            std::vector<session_download> downloads = {{SMADATA2PLUS_ARCHIVE_DAY, now - 86400, now, -1, {}, {}},
+                                                       {SMADATA2PLUS_EVENTS_USER, now - 86400, now, -1, {}, {}}};
+            loop.start(InverterSim::address(sim, i), "0000", dev->rounds, dev->stats.data(), NULL, downloads,
+                       [&, dev](bool ok, std::vector<vec_data> &samples, std::vector<session_download> &downloads,
+                                const struct bluetooth_inverter &)
+                       {
+                           dev->inFlight = false;
+                           if (!ok || samples.empty() || downloads[0].records.empty() || downloads[1].events.empty())
+                               failures++;
+                           if (++dev->rounds == rounds && ++finished == devices)
+                           {
+                               printf("%d sessions on %d workers, %d failed\n", devices * rounds, workers,
+                                      failures);
+                               exit(failures ? 1 : 0);
+                           }
+                       });
+        }
+    };
+    timer.start();
+    thread.run();
+    return 0;
+}
@@ -0,0 +1,38 @@
+/*
+ * Fuzz target : L1 framing
+ *
+ * The input is placed in the receive buffer as a session would receive it
+ * and packets are read as long as one is complete, L2 packets included.
+ * Reading must stay inside the buffer whatever the lengths say.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <Log.h>
+#include "in_bluetooth.h"
+#include "in_smadata2plus.h"
+
+Log logger;
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static struct bluetooth_inverter inv;
+    static struct smadata2_l1_packet p1;
+    static struct smadata2_l2_packet p2;
+
+    if (size > sizeof(inv.buffer))
+        return 0;
+    memcpy(inv.buffer, data, size);
+    inv.buffer_len = size;
+    inv.buffer_position = 0;
+    inv.socket_fd = -1;
+    p1.cmd_code = 0;
+
+    while (in_smadata2plus_level1_complete(&inv))
+    {
+        in_smadata2plus_level1_packet_read(&inv, &p1, &p2);
+        if (inv.buffer_position > inv.buffer_len)
+            __builtin_trap();
+    }
+    return 0;
+}
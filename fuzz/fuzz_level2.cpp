@@ -0,0 +1,34 @@
+/*
+ * Fuzz target : L2 unescape and frame check sequence
+ *
+ * The input is read as an L2 packet, then escaped and unescaped again,
+ * which has to give the input back.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <Log.h>
+#include "in_bluetooth.h"
+#include "in_smadata2plus.h"
+
+Log logger;
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static unsigned char buffer[2 * BUFSIZ];
+    static struct smadata2_l2_packet p2;
+
+    if (size > BUFSIZ)
+        return 0;
+    int len = size;
+    memcpy(buffer, data, size);
+    in_smadata2plus_level2_packet_read(buffer, len, &p2);
+
+    /* escaping round trip, the first byte is the start byte and is kept */
+    memcpy(buffer, data, size);
+    in_smadata2plus_level2_add_escapes(buffer, &len);
+    in_smadata2plus_level2_strip_escapes(buffer, &len);
+    if (len != (int)size || memcmp(buffer, data, size) != 0)
+        __builtin_trap();
+    return 0;
+}
@@ -0,0 +1,38 @@
+/*
+ * Fuzz target : value decoding
+ *
+ * The first byte picks the query, the second is ctrl1, the rest is the
+ * content of the response. Decoded values go through validation as well.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <Log.h>
+#include "in_bluetooth.h"
+#include "in_smadata2plus.h"
+
+Log logger;
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static struct smadata2_l1_packet p1;
+    static struct smadata2_l2_packet p2;
+    static struct smadata2_stats stats[SMADATA2PLUS_REG_COUNT];
+    static std::vector<vec_data> samples;
+
+    if (size < 2 || size - 2 > sizeof(p2.content))
+        return 0;
+    const struct smadata2_query *query = in_smadata2plus_query(data[0] % in_smadata2plus_query_count());
+
+    in_smadata2plus_level2_clear(&p2);
+    p2.ctrl1 = data[1];
+    p2.ctrl2 = query->r_ctrl2;
+    p2.content_length = size - 2;
+    memcpy(p2.content, data + 2, size - 2);
+
+    samples.clear();
+    in_smadata2plus_parse_values(&p1, &p2, query, samples, stats);
+    in_smadata2plus_validate_values(samples, NULL, stats);
+    return 0;
+}
@@ -0,0 +1,33 @@
+/*
+ * Runs a fuzz target over files, for compilers without libFuzzer : crash
+ * reproducers and corpora are replayed under the sanitizers.
+ *
+ *   fuzz_level1 <file>...
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int main(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        FILE *f = fopen(argv[i], "rb");
+        if (f == NULL)
+        {
+            perror(argv[i]);
+            return 1;
+        }
+        std::vector<uint8_t> data;
+        uint8_t chunk[4096];
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+            data.insert(data.end(), chunk, chunk + n);
+        fclose(f);
+        LLVMFuzzerTestOneInput(data.data(), data.size());
+    }
+    return 0;
+}
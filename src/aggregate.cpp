@@ -0,0 +1,140 @@
+/*
+ * Local aggregation window
+ *
+ *   "aggregate": {
+ *       "window": 300000,
+ *       "max_gap": 600,
+ *       "stats": [ "avg", "min", "max", "last", "integral" ]
+ *   }
+ *
+ * "avg" goes to the register series itself, the others to
+ * sma:<serial>:<name>:<stat>. Status registers get their last value
+ * instead of the average. The integral is the trapezoidal integral
+ * over the inverter timestamps in unit * h, e.g. Wh for power registers.
+ */
+
+#include <string.h>
+#include <string>
+#include "aggregate.h"
+#include "in_smadata2plus.h"
+
+aggregate_config aggregateConfig(JsonObject cfg)
+{
+    aggregate_config config;
+    config.window = cfg["window"] | 0;
+    config.max_gap = cfg["max_gap"] | 600;
+    config.stats = 0;
+    for (auto stat : cfg["stats"].as<JsonArray>())
+    {
+        std::string name = stat.as<std::string>();
+        if (name == "avg")
+            name = SERIES_STAT_NAMES[SERIES_VALUE];
+        for (int i = 0; i < SERIES_STAT_COUNT; i++)
+        {
+            if (name == SERIES_STAT_NAMES[i])
+                config.stats |= 1 << i;
+        }
+    }
+    if (config.stats == 0)
+        config.stats = 1 << SERIES_VALUE;
+    return config;
+}
+
+AggregateWindow::AggregateWindow() : _config({0, 0, 0}), _start(0), _end(0) {}
+
+void AggregateWindow::init(const aggregate_config &config, uint64_t now)
+{
+    _config = config;
+    _count.assign(SMADATA2PLUS_REG_COUNT, 0);
+    _min.assign(SMADATA2PLUS_REG_COUNT, 0);
+    _max.assign(SMADATA2PLUS_REG_COUNT, 0);
+    _last.assign(SMADATA2PLUS_REG_COUNT, 0);
+    _sum.assign(SMADATA2PLUS_REG_COUNT, 0.0);
+    _integral.assign(SMADATA2PLUS_REG_COUNT, 0.0);
+    _prevTime.assign(SMADATA2PLUS_REG_COUNT, 0);
+    _prevValue.assign(SMADATA2PLUS_REG_COUNT, 0.0);
+    _integrate.assign(SMADATA2PLUS_REG_COUNT, false);
+    _numeric.assign(SMADATA2PLUS_REG_COUNT, true);
+    for (int id = 0; id < SMADATA2PLUS_REG_COUNT; id++)
+    {
+        _integrate[id] = strcmp(SMADATA2PLUS_REGISTERS[id].cls, "power") == 0;
+        _numeric[id] = strcmp(SMADATA2PLUS_REGISTERS[id].cls, "status") != 0;
+    }
+    reset(now);
+}
+
+/* Start a new window, aligned on a multiple of the window length */
+void AggregateWindow::reset(uint64_t now)
+{
+    _start = now - now % _config.window;
+    _end = _start + _config.window;
+    for (int id = 0; id < SMADATA2PLUS_REG_COUNT; id++)
+    {
+        _count[id] = 0;
+        _sum[id] = 0.0;
+        _integral[id] = 0.0;
+    }
+}
+
+void AggregateWindow::add(const std::vector<vec_data> &data)
+{
+    for (auto &sample : data)
+    {
+        int id = sample.id;
+        long long raw = sample.value;
+        double value = in_smadata2plus_value(sample);
+
+        if (_count[id] == 0 || raw < _min[id])
+            _min[id] = raw;
+        if (_count[id] == 0 || raw > _max[id])
+            _max[id] = raw;
+        _last[id] = raw;
+        _sum[id] += value;
+        _count[id]++;
+
+        int dt = sample.timestamp - _prevTime[id];
+        if (_integrate[id] && _prevTime[id] && dt > 0 && (uint32_t)dt <= _config.max_gap)
+            _integral[id] += (value + _prevValue[id]) / 2.0 * dt / 3600.0;
+        _prevTime[id] = sample.timestamp;
+        _prevValue[id] = value;
+    }
+}
+
+bool AggregateWindow::empty() const
+{
+    for (int id = 0; id < SMADATA2PLUS_REG_COUNT; id++)
+    {
+        if (_count[id])
+            return false;
+    }
+    return true;
+}
+
+bool AggregateWindow::has(int id, int stat) const
+{
+    if (_count[id] == 0 || !(_config.stats & (1 << stat)))
+        return false;
+    if (!_numeric[id])
+        return stat == SERIES_VALUE || stat == SERIES_LAST;
+    return stat != SERIES_INTEGRAL || _integrate[id];
+}
+
+double AggregateWindow::value(int id, int stat) const
+{
+    double factor = SMADATA2PLUS_REGISTERS[id].factor;
+    switch (stat)
+    {
+    case SERIES_MIN:
+        return _min[id] * factor;
+    case SERIES_MAX:
+        return _max[id] * factor;
+    case SERIES_LAST:
+        return _last[id] * factor;
+    case SERIES_INTEGRAL:
+        return _integral[id];
+    default:
+        if (!_numeric[id])
+            return _last[id] * factor;
+        return _sum[id] / _count[id];
+    }
+}
@@ -0,0 +1,64 @@
+/*
+ * Local aggregation window
+ *
+ * Instead of publishing every raw sample, keep running statistics per
+ * register over a fixed window and publish only those when the window
+ * closes. The statistics are kept as a struct of arrays indexed by
+ * register id, so adding a poll is a linear pass over a few small arrays.
+ * Status registers are tags, not quantities : they only get their last
+ * value, in the value series and in "last".
+ */
+
+#ifndef AGGREGATE_H_
+#define AGGREGATE_H_
+
+#include <stdint.h>
+#include <vector>
+#include <limero.h>
+#include "in_bluetooth.h"
+#include "series.h"
+
+struct aggregate_config
+{
+    uint32_t window;  // msec, 0 = publish raw samples
+    uint32_t max_gap; // sec, samples further apart are not integrated
+    uint32_t stats;   // bit mask of series_stat
+};
+
+aggregate_config aggregateConfig(JsonObject cfg);
+
+class AggregateWindow
+{
+public:
+    AggregateWindow();
+    void init(const aggregate_config &config, uint64_t now);
+    void add(const std::vector<vec_data> &data);
+    bool due(uint64_t now) const { return now >= _end; }
+    bool empty() const;
+    void reset(uint64_t now);
+
+    uint64_t start() const { return _start; }
+    uint64_t end() const { return _end; }
+    bool has(int id, int stat) const;
+    double value(int id, int stat) const;
+
+private:
+    aggregate_config _config;
+    uint64_t _start;
+    uint64_t _end;
+
+    /* running statistics, indexed by register id */
+    std::vector<uint32_t> _count;
+    std::vector<long long> _min;
+    std::vector<long long> _max;
+    std::vector<long long> _last;
+    std::vector<double> _sum;
+    std::vector<double> _integral;
+    /* previous sample for the integral, kept across windows */
+    std::vector<int> _prevTime;
+    std::vector<double> _prevValue;
+    std::vector<char> _integrate;
+    std::vector<char> _numeric;
+};
+
+#endif /* AGGREGATE_H_ */
@@ -0,0 +1,69 @@
+/*
+ * Archive cursor
+ *
+ * File format, one line : "<day> <month> <events> <entry>\n", unix time
+ * and the running number of the newest event. Cursors written before
+ * events were read have no <events>, before entries were kept no <entry> :
+ * the events of that second count as stored.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <Log.h>
+#include "archive.h"
+
+/*
+ *   "archive": { "enabled": true, "interval": 3600000, "max_days": 30,
+ *                "batch": 1000, "cursor_dir": "/var/lib/sma2redis" }
+ */
+archive_config archiveConfig(JsonObject cfg)
+{
+    archive_config config;
+    config.enabled = cfg["enabled"] | false;
+    config.interval = cfg["interval"] | 3600000;
+    config.max_days = cfg["max_days"] | 30;
+    config.batch = cfg["batch"] | 1000;
+    config.cursor_dir = cfg["cursor_dir"] | ".";
+    return config;
+}
+
+ArchiveCursor::ArchiveCursor(const std::string &dir) : _dir(dir) {}
+
+/* A missing or broken cursor starts from 0, the caller limits how far back */
+archive_cursor ArchiveCursor::load(const std::string &serial) const
+{
+    archive_cursor cursor = {0, 0, 0, 0xffff};
+    FILE *f = fopen(path(serial).c_str(), "r");
+    if (f == NULL)
+        return cursor;
+    if (fscanf(f, "%d %d %d %d", &cursor.day, &cursor.month, &cursor.events, &cursor.entry) < 2)
+    {
+        WARN("[Archive] %s unreadable, starting over", path(serial).c_str());
+        cursor.day = cursor.month = cursor.events = 0;
+    }
+    fclose(f);
+    return cursor;
+}
+
+bool ArchiveCursor::save(const std::string &serial, const archive_cursor &cursor) const
+{
+    std::string file = path(serial);
+    std::string tmp = file + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (f == NULL)
+    {
+        WARN("[Archive] cannot write %s", tmp.c_str());
+        return false;
+    }
+    bool ok = fprintf(f, "%d %d %d %d\n", cursor.day, cursor.month, cursor.events, cursor.entry) > 0;
+    ok = fflush(f) == 0 && ok;
+    ok = fsync(fileno(f)) == 0 && ok;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), file.c_str()) != 0)
+    {
+        WARN("[Archive] cannot update %s", file.c_str());
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,50 @@
+/*
+ * Archive cursor
+ *
+ * Remembers per inverter the timestamp of the newest archive record that
+ * was stored in Redis, so a session only downloads the records after it.
+ * The cursor lives in <cursor_dir>/<serial>.cursor and is replaced with a
+ * rename, a crash leaves either the old or the new cursor.
+ */
+
+#ifndef ARCHIVE_H_
+#define ARCHIVE_H_
+
+#include <stdint.h>
+#include <string>
+#include <limero.h>
+
+struct archive_config
+{
+    bool enabled;
+    uint32_t interval;      // msec between two downloads of a device
+    uint32_t max_days;      // how far back a device without cursor starts
+    uint32_t batch;         // samples per TS.MADD
+    std::string cursor_dir; // where the cursors are kept
+};
+
+archive_config archiveConfig(JsonObject cfg);
+
+struct archive_cursor
+{
+    int day;   // newest 5 minute record stored
+    int month; // newest daily record stored
+    int events; // newest event log entry stored
+    int entry;  // its running number, the log has several per second
+};
+
+class ArchiveCursor
+{
+public:
+    ArchiveCursor(const std::string &dir = ".");
+    void dir(const std::string &dir) { _dir = dir; }
+    archive_cursor load(const std::string &serial) const;
+    bool save(const std::string &serial, const archive_cursor &cursor) const;
+
+private:
+    std::string path(const std::string &serial) const { return _dir + "/" + serial + ".cursor"; }
+
+    std::string _dir;
+};
+
+#endif /* ARCHIVE_H_ */
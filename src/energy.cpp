@@ -0,0 +1,208 @@
+/*
+ * Energy integration
+ *
+ * State file format, one line per power register :
+ * "<register> <time> <power> <day energy>\n", time in unix time, power in W,
+ * energy in Wh.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <Log.h>
+#include "energy.h"
+#include "in_smadata2plus.h"
+
+/* power register and the counters derived from it, -1 when there is none */
+struct energy_series
+{
+    int power;
+    int day;
+    int total;
+};
+
+static const energy_series ENERGY_SERIES[] = {
+    {SMADATA2PLUS_REG_POWER_AC, SMADATA2PLUS_REG_ENERGY_AC_DAY, SMADATA2PLUS_REG_ENERGY_AC_TOTAL},
+    {SMADATA2PLUS_REG_POWER_AC_L1, SMADATA2PLUS_REG_ENERGY_AC_L1_DAY, -1},
+    {SMADATA2PLUS_REG_POWER_AC_L2, SMADATA2PLUS_REG_ENERGY_AC_L2_DAY, -1},
+    {SMADATA2PLUS_REG_POWER_AC_L3, SMADATA2PLUS_REG_ENERGY_AC_L3_DAY, -1},
+    {SMADATA2PLUS_REG_POWER_DC_1, SMADATA2PLUS_REG_ENERGY_DC_1_DAY, -1},
+    {SMADATA2PLUS_REG_POWER_DC_2, SMADATA2PLUS_REG_ENERGY_DC_2_DAY, -1},
+};
+
+#define ENERGY_SERIES_COUNT (sizeof(ENERGY_SERIES) / sizeof(ENERGY_SERIES[0]))
+
+EnergyIntegrator::EnergyIntegrator()
+    : _anchored(false), _maxGap(600), _tolerance(50.0), _gaps(0), _corrections(0), _saveInterval(300),
+      _savedAt(0), _counters(ENERGY_SERIES_COUNT, {false, 0, 0.0, 0.0, 0.0, -1}) {}
+
+static int dayOfYear(int timestamp)
+{
+    time_t t = timestamp;
+    struct tm tm;
+    localtime_r(&t, &tm);
+    return tm.tm_yday;
+}
+
+/* Keep the day counters in path, saved at most every interval sec */
+void EnergyIntegrator::persist(const std::string &path, uint32_t interval)
+{
+    _path = path;
+    _saveInterval = interval;
+    load();
+}
+
+/* A missing or broken state file starts the day counters from 0 */
+void EnergyIntegrator::load()
+{
+    FILE *f = fopen(_path.c_str(), "r");
+    if (f == NULL)
+        return;
+    char name[64];
+    int time;
+    double power, energy;
+    while (fscanf(f, "%63s %d %lf %lf", name, &time, &power, &energy) == 4)
+    {
+        for (size_t s = 0; s < ENERGY_SERIES_COUNT; s++)
+        {
+            if (strcmp(SMADATA2PLUS_REGISTERS[ENERGY_SERIES[s].power].name, name) != 0)
+                continue;
+            counter &c = _counters[s];
+            c = {true, time, power, energy, 0.0, dayOfYear(time)};
+            if (time > _savedAt)
+                _savedAt = time;
+        }
+    }
+    if (!feof(f))
+        WARN("[Energy] %s unreadable, starting over", _path.c_str());
+    fclose(f);
+}
+
+bool EnergyIntegrator::save() const
+{
+    std::string tmp = _path + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (f == NULL)
+    {
+        WARN("[Energy] cannot write %s", tmp.c_str());
+        return false;
+    }
+    bool ok = true;
+    for (size_t s = 0; s < ENERGY_SERIES_COUNT; s++)
+    {
+        const counter &c = _counters[s];
+        if (c.valid)
+            ok = fprintf(f, "%s %d %f %f\n", SMADATA2PLUS_REGISTERS[ENERGY_SERIES[s].power].name, c.time, c.power,
+                         c.total - c.dayStart) > 0 && ok;
+    }
+    ok = fflush(f) == 0 && ok;
+    ok = fsync(fileno(f)) == 0 && ok;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), _path.c_str()) != 0)
+    {
+        WARN("[Energy] cannot update %s", _path.c_str());
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+/* An integral kept between the inverter's counter and counter + tolerance,
+ * the counter itself may lag the integral */
+double EnergyIntegrator::bound(double integral, double counter)
+{
+    if (integral >= counter && integral <= counter + _tolerance)
+        return integral;
+    double bounded = integral < counter ? counter : counter + _tolerance;
+    DEBUG("[Energy] corrected drift of %f Wh", bounded - integral);
+    _corrections++;
+    return bounded;
+}
+
+/* Integrate the power samples of a poll and append the energy counters */
+void EnergyIntegrator::update(std::vector<vec_data> &data)
+{
+    const vec_data *yieldTotal = NULL;
+    const vec_data *yieldDay = NULL;
+    size_t count = data.size();
+    int latest = 0;
+
+    /* no reallocation while appending, the pointers below stay valid */
+    data.reserve(SMADATA2PLUS_REG_COUNT);
+    for (size_t i = 0; i < count; i++)
+    {
+        if (data[i].id == SMADATA2PLUS_REG_YIELD_TOTAL)
+            yieldTotal = &data[i];
+        else if (data[i].id == SMADATA2PLUS_REG_YIELD_DAY)
+            yieldDay = &data[i];
+    }
+
+    for (size_t s = 0; s < ENERGY_SERIES_COUNT; s++)
+    {
+        counter &c = _counters[s];
+        const vec_data *sample = NULL;
+        for (size_t i = 0; i < count; i++)
+        {
+            if (data[i].id == ENERGY_SERIES[s].power)
+                sample = &data[i];
+        }
+        if (sample == NULL)
+            continue;
+
+        double power = in_smadata2plus_value(*sample);
+        int dt = sample->timestamp - c.time;
+        if (c.valid && dt > 0 && (uint32_t)dt <= _maxGap)
+        {
+            c.total += (power + c.power) / 2.0 * dt / 3600.0;
+        }
+        else if (c.valid && dt > 0)
+        {
+            _gaps++;
+            WARN("[Energy] %s gap of %d sec not integrated", SMADATA2PLUS_REGISTERS[ENERGY_SERIES[s].power].name, dt);
+        }
+        c.valid = true;
+        c.time = sample->timestamp;
+        c.power = power;
+        if (c.time > latest)
+            latest = c.time;
+
+        int day = dayOfYear(sample->timestamp);
+        if (day != c.day)
+        {
+            c.dayStart = c.total;
+            c.day = day;
+        }
+
+        /* raw yield_total and yield_day are in Wh */
+        if (ENERGY_SERIES[s].total >= 0)
+        {
+            bool counters = yieldTotal != NULL && yieldDay != NULL;
+            if (!_anchored && !counters)
+                continue;
+            if (!_anchored)
+            {
+                c.total = (double)yieldTotal->value;
+                c.dayStart = c.total - (double)yieldDay->value;
+                _anchored = true;
+            }
+            else if (counters)
+            {
+                c.total = bound(c.total, (double)yieldTotal->value);
+                c.dayStart = c.total - bound(c.total - c.dayStart, (double)yieldDay->value);
+            }
+            vec_data totalCounter = {ENERGY_SERIES[s].total, llround(c.total * 1000.0), c.time};
+            data.push_back(totalCounter);
+        }
+
+        vec_data dayCounter = {ENERGY_SERIES[s].day, llround((c.total - c.dayStart) * 1000.0), c.time};
+        data.push_back(dayCounter);
+    }
+
+    if (!_path.empty() && latest >= _savedAt + (int)_saveInterval)
+    {
+        save();
+        _savedAt = latest;
+    }
+}
@@ -0,0 +1,65 @@
+/*
+ * Energy integration
+ *
+ * Integrates the power registers into running energy counters per day and
+ * in total, so dashboards don't have to integrate months of power samples.
+ * The integral is trapezoidal over the inverter timestamps. Gaps longer
+ * than max_gap are not integrated.
+ *
+ * The AC counters are anchored to the inverter's own yield_day and
+ * yield_total: each is kept within tolerance Wh above its register, which
+ * bounds drift and covers the energy produced during gaps. They are only
+ * published once anchored. The inverter has no counters per phase or per
+ * string, so those only get a day counter, which persist() keeps across
+ * restarts in a state file.
+ */
+
+#ifndef ENERGY_H_
+#define ENERGY_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "in_bluetooth.h"
+
+class EnergyIntegrator
+{
+public:
+    EnergyIntegrator();
+    void config(uint32_t maxGap, double tolerance)
+    {
+        _maxGap = maxGap;
+        _tolerance = tolerance;
+    }
+    void persist(const std::string &path, uint32_t interval);
+    void update(std::vector<vec_data> &data);
+    uint32_t gaps() const { return _gaps; }
+    uint32_t corrections() const { return _corrections; }
+
+private:
+    struct counter
+    {
+        bool valid;
+        int time;        // inverter time of the last power sample
+        double power;    // W
+        double total;    // Wh
+        double dayStart; // total at the start of the day
+        int day;         // day of year of the last sample
+    };
+
+    double bound(double integral, double counter);
+    void load();
+    bool save() const;
+
+    bool _anchored;
+    uint32_t _maxGap;
+    double _tolerance;
+    uint32_t _gaps;
+    uint32_t _corrections;
+    std::string _path;      // state file, empty when not persisted
+    uint32_t _saveInterval; // sec of inverter time between saves
+    int _savedAt;
+    std::vector<counter> _counters; // by ENERGY_SERIES entry
+};
+
+#endif /* ENERGY_H_ */
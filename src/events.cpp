@@ -0,0 +1,91 @@
+/*
+ * Event log
+ */
+
+#include <Log.h>
+#include "events.h"
+
+/*
+ *   "events": { "enabled": true, "interval": 21600000, "max_days": 90, "capacity": 1024 }
+ */
+events_config eventsConfig(JsonObject cfg)
+{
+    events_config config;
+    config.enabled = cfg["enabled"] | false;
+    config.interval = cfg["interval"] | 21600000;
+    config.max_days = cfg["max_days"] | 90;
+    config.capacity = cfg["capacity"] | 1024;
+    return config;
+}
+
+EventIndex::EventIndex(size_t capacity) : _next(0)
+{
+    this->capacity(capacity);
+}
+
+/* Clears the index */
+void EventIndex::capacity(size_t capacity)
+{
+    _ring.assign(capacity ? capacity : 1, indexed_event());
+    _next = 0;
+    _byCode.clear();
+    _byInverter.assign(_serials.size(), std::deque<uint64_t>());
+}
+
+int EventIndex::inverter(const std::string &serial) const
+{
+    for (size_t i = 0; i < _serials.size(); i++)
+    {
+        if (_serials[i] == serial)
+            return i;
+    }
+    return -1;
+}
+
+/* The oldest event is overwritten when the ring is full, it is always the
+ * front of its code and inverter list */
+void EventIndex::add(const std::string &serial, const smadata2_event_record &event)
+{
+    int inv = inverter(serial);
+    if (inv < 0)
+    {
+        inv = _serials.size();
+        _serials.push_back(serial);
+        _byInverter.push_back(std::deque<uint64_t>());
+    }
+
+    if (_next >= _ring.size())
+    {
+        const indexed_event &old = at(_next - _ring.size());
+        std::deque<uint64_t> &codes = _byCode[old.event.code];
+        codes.pop_front();
+        if (codes.empty())
+            _byCode.erase(old.event.code);
+        _byInverter[old.inverter].pop_front();
+    }
+
+    _ring[_next % _ring.size()] = {(uint16_t)inv, event};
+    _byCode[event.code].push_back(_next);
+    _byInverter[inv].push_back(_next);
+    _next++;
+}
+
+size_t EventIndex::count(uint16_t code) const
+{
+    auto it = _byCode.find(code);
+    return it == _byCode.end() ? 0 : it->second.size();
+}
+
+size_t EventIndex::count(const std::string &serial, uint16_t code) const
+{
+    int inv = inverter(serial);
+    size_t n = 0;
+    if (inv < 0)
+        return 0;
+    for (uint64_t seq : _byInverter[inv])
+    {
+        if (at(seq).event.code == code)
+            n++;
+    }
+    return n;
+}
@@ -0,0 +1,58 @@
+/*
+ * Event log
+ *
+ * The inverter event log is read incrementally from the last event time
+ * and entry number kept in the archive cursor, and published as entries
+ * of the stream sma:<serial>:events. Recent events are also kept in a
+ * bounded index by fault code and inverter, which counts how often a fault
+ * came back without querying Redis.
+ */
+
+#ifndef EVENTS_H_
+#define EVENTS_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <limero.h>
+#include "in_bluetooth.h"
+
+struct events_config
+{
+    bool enabled;
+    uint32_t interval; // msec between two event log reads of a device
+    uint32_t max_days; // how far back a device without cursor starts
+    uint32_t capacity; // events kept in the index
+};
+
+events_config eventsConfig(JsonObject cfg);
+
+class EventIndex
+{
+public:
+    EventIndex(size_t capacity = 1024);
+    void capacity(size_t capacity);
+    void add(const std::string &serial, const smadata2_event_record &event);
+    size_t count(uint16_t code) const;
+    size_t count(const std::string &serial, uint16_t code) const;
+
+private:
+    struct indexed_event
+    {
+        uint16_t inverter;
+        smadata2_event_record event;
+    };
+
+    const indexed_event &at(uint64_t seq) const { return _ring[seq % _ring.size()]; }
+    int inverter(const std::string &serial) const;
+
+    std::vector<indexed_event> _ring;
+    uint64_t _next; // sequence number of the next event
+    std::vector<std::string> _serials;
+    std::unordered_map<uint16_t, std::deque<uint64_t>> _byCode; // sequence numbers, oldest first
+    std::vector<std::deque<uint64_t>> _byInverter;
+};
+
+#endif /* EVENTS_H_ */
@@ -0,0 +1,91 @@
+/*
+ * Send-on-change filter
+ *
+ * Configuration in sma2redis.json :
+ *
+ *   "filter": {
+ *       "default": { "abs": 0, "rel": 0, "heartbeat": 900000 },
+ *       "series": { "yield_total": { "abs": 0.01, "heartbeat": 3600000 } }
+ *   }
+ *
+ * With abs and rel both 0 every change is sent. Without a "filter" section
+ * all samples pass. A series that sets abs but not rel gets rel 0, not the
+ * default rel, so a fixed step is not widened by the size of a counter.
+ */
+
+#include <math.h>
+#include "filter.h"
+#include "in_smadata2plus.h"
+
+static deadband readDeadband(JsonVariant v, const deadband &def)
+{
+    deadband db;
+    db.abs = v["abs"] | def.abs;
+    db.rel = v["rel"] | (v["abs"].isNull() ? def.rel : 0.0);
+    db.heartbeat = v["heartbeat"] | def.heartbeat;
+    return db;
+}
+
+DeadbandFilter::DeadbandFilter()
+    : _enabled(false), _rules(SMADATA2PLUS_REG_COUNT, {0.0, 0.0, 0}), _passed(0), _suppressed(0) {}
+
+void DeadbandFilter::config(JsonObject cfg)
+{
+    if (cfg.isNull())
+        return;
+    _enabled = true;
+    deadband def = readDeadband(cfg["default"], _rules[0]);
+    _rules.assign(SMADATA2PLUS_REG_COUNT, def);
+    for (auto kv : cfg["series"].as<JsonObject>())
+    {
+        int id = in_smadata2plus_register_id(kv.key().c_str());
+        if (id < 0)
+        {
+            WARN("[Filter] unknown series '%s' ignored", kv.key().c_str());
+            continue;
+        }
+        _rules[id] = readDeadband(kv.value(), def);
+    }
+    INFO("[Filter] abs=%f rel=%f heartbeat=%u ms", def.abs, def.rel, def.heartbeat);
+}
+
+/* Remove the samples that don't need to be sent, keep the order of the rest */
+void DeadbandFilter::apply(const std::string &serial, std::vector<vec_data> &data, uint64_t now)
+{
+    if (!_enabled)
+        return;
+    std::vector<last_sent> &last = _last[serial];
+    if (last.empty())
+        last.assign(SMADATA2PLUS_REG_COUNT, {false, 0.0, 0});
+
+    size_t out = 0;
+    for (size_t i = 0; i < data.size(); i++)
+    {
+        const deadband &db = _rules[data[i].id];
+        last_sent &prev = last[data[i].id];
+        double value = in_smadata2plus_value(data[i]);
+
+        bool send = true;
+        if (prev.valid)
+        {
+            double delta = fabs(value - prev.value);
+            double band = fmax(db.abs, db.rel * fabs(prev.value));
+            bool changed = band > 0.0 ? delta > band : delta != 0.0;
+            bool silent = db.heartbeat && now - prev.time >= db.heartbeat;
+            send = changed || silent;
+        }
+
+        if (!send)
+        {
+            _suppressed++;
+            continue;
+        }
+        prev = {true, value, now};
+        _passed++;
+        if (out != i)
+            data[out] = data[i];
+        out++;
+    }
+    DEBUG("[Filter] %s sent %u of %u samples", serial.c_str(), (unsigned)out, (unsigned)data.size());
+    data.resize(out);
+}
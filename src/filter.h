@@ -0,0 +1,51 @@
+/*
+ * Send-on-change filter
+ *
+ * Sits between in_smadata2plus_get_values and the Redis sink and drops
+ * samples that didn't move outside their deadband since the last value that
+ * was sent. A heartbeat forces a sample out after max silence so a flat
+ * series is still distinguishable from a dead one.
+ */
+
+#ifndef FILTER_H_
+#define FILTER_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <limero.h>
+#include "in_bluetooth.h"
+
+struct deadband
+{
+    double abs;         // absolute change needed to send
+    double rel;         // change relative to the last sent value
+    uint32_t heartbeat; // max msec between two samples, 0 = never
+};
+
+class DeadbandFilter
+{
+public:
+    DeadbandFilter();
+    void config(JsonObject cfg);
+    void apply(const std::string &serial, std::vector<vec_data> &data, uint64_t now);
+    uint32_t passed() const { return _passed; }
+    uint32_t suppressed() const { return _suppressed; }
+
+private:
+    struct last_sent
+    {
+        bool valid;
+        double value;
+        uint64_t time;
+    };
+
+    bool _enabled;
+    std::vector<deadband> _rules;                                 // by register id
+    std::unordered_map<std::string, std::vector<last_sent>> _last; // by serial, then register id
+    uint32_t _passed;
+    uint32_t _suppressed;
+};
+
+#endif /* FILTER_H_ */
@@ -24,43 +24,188 @@
  */
 
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/rfcomm.h>
 
 #include "in_bluetooth.h"
 #include "in_smadata2plus.h"
 
-void in_bluetooth_connect(struct bluetooth_inverter * inv) {
+/* Blocking connect, given up after timeout msec instead of the page
+ * timeout of the kernel. Returns 0 when connected, -1 with the socket
+ * closed otherwise */
+int in_bluetooth_connect(struct bluetooth_inverter * inv, int timeout) {
+	struct pollfd pfd = { 0 };
+	int state = in_bluetooth_connect_start(inv);
+
+	if (state == 1) {
+		pfd.fd = inv->socket_fd;
+		pfd.events = POLLOUT;
+		int ready;
+		do {
+			ready = poll(&pfd, 1, timeout);
+		} while (ready < 0 && errno == EINTR);
+		if (ready == 0)
+			WARN("[BT] Connection to inverter %s timed out after %d msec", inv->macaddr, timeout);
+		state = ready > 0 ? in_bluetooth_connect_finish(inv) : -1;
+	}
+	if (state < 0) {
+		if (inv->socket_fd >= 0)
+			close(inv->socket_fd);
+		inv->socket_fd = -1;
+		inv->socket_status = -1;
+		return -1;
+	}
+
+	/* the blocking reads and writes of the handshake follow */
+	fcntl(inv->socket_fd, F_SETFL, fcntl(inv->socket_fd, F_GETFL) & ~O_NONBLOCK);
+	return 0;
+}
+
+/* Resolve the local address once the socket is connected, in the byte
+ * order of the packets, and build the L1 headers of the session from it.
+ * Local sockets have no address, zeros are sent instead */
+static void in_bluetooth_connected(struct bluetooth_inverter * inv) {
+	struct sockaddr_rc mymac = { 0 };
+	socklen_t mymac_size = sizeof(mymac);
+
+	memset(inv->local_addr, 0, sizeof(inv->local_addr));
+	if (strncmp(inv->macaddr, "unix:", 5) != 0 &&
+			getsockname(inv->socket_fd, (struct sockaddr *) &mymac, &mymac_size) == 0) {
+		memcpy(inv->local_addr, &mymac.rc_bdaddr, 6);
+		buffer_reverse(inv->local_addr, 6);
+	}
+
+	char buffer_hex[6 * 3];
+	buffer_hex_dump(buffer_hex, inv->local_addr, 6);
+	DEBUG("[BT] My MAC: %s", buffer_hex);
+
+	in_smadata2plus_level1_templates(inv);
+}
+
+/* Local stream socket instead of RFCOMM, for "unix:<path>" addresses.
+ * A path starting with '@' is in the abstract namespace */
+static int in_bluetooth_connect_unix(struct bluetooth_inverter * inv) {
+	struct sockaddr_un addr = { 0 };
+	const char *path = inv->macaddr + 5;
+
+	inv->socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (inv->socket_fd < 0) {
+		WARN("[BT] No socket for inverter %s: %s", inv->macaddr, strerror(errno));
+		return -1;
+	}
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if (path[0] == '@')
+		addr.sun_path[0] = 0;
+
+	inv->socket_status = connect(inv->socket_fd, (struct sockaddr *) &addr,
+			offsetof(struct sockaddr_un, sun_path) + strlen(path));
+	if (inv->socket_status == 0) {
+		in_bluetooth_connected(inv);
+		return 0;
+	}
+	if (errno == EINPROGRESS || errno == EAGAIN)
+		return 1;
+
+	WARN("[BT] Connection to inverter %s failed: %s", inv->macaddr, strerror(errno));
+	return -1;
+}
+
+/* Start a non blocking connect. Returns 0 when connected, 1 while the
+ * connect is in progress (wait until the socket is writable) or -1 */
+int in_bluetooth_connect_start(struct bluetooth_inverter * inv) {
 	struct sockaddr_rc addr = { 0 };
 
 	inv->l2_packet_send_count = 1;
+	inv->buffer_len = 0;
+	inv->buffer_position = 0;
 
-	inv->socket_fd = 0;
-	// allocate a socket
-	inv->socket_fd = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
+	if (strncmp(inv->macaddr, "unix:", 5) == 0)
+		return in_bluetooth_connect_unix(inv);
+
+	inv->socket_fd = socket(AF_BLUETOOTH, SOCK_STREAM | SOCK_NONBLOCK, BTPROTO_RFCOMM);
+	if (inv->socket_fd < 0) {
+		WARN("[BT] No socket for inverter %s: %s", inv->macaddr, strerror(errno));
+		return -1;
+	}
 
-	// set the connection parameters (who to connect to)
 	addr.rc_family = AF_BLUETOOTH;
 	addr.rc_channel = (uint8_t) 1;
 	str2ba(inv->macaddr, &addr.rc_bdaddr);
 
-	// connect to server
 	inv->socket_status = connect(inv->socket_fd, (struct sockaddr *) &addr,
 			sizeof(addr));
+	if (inv->socket_status == 0) {
+		in_bluetooth_connected(inv);
+		return 0;
+	}
+	if (errno == EINPROGRESS)
+		return 1;
+
+	WARN("[BT] Connection to inverter %s failed: %s", inv->macaddr, strerror(errno));
+	return -1;
+}
 
-	if (inv->socket_status < 0) {
-		WARN("[BT] Connection to inverter %s failed: %s\n", inv->macaddr, strerror(errno));
+/* Outcome of a connect in progress, once the socket is writable */
+int in_bluetooth_connect_finish(struct bluetooth_inverter * inv) {
+	int error = 0;
+	socklen_t len = sizeof(error);
+
+	if (getsockopt(inv->socket_fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+		error = errno;
+	inv->socket_status = error ? -1 : 0;
+	if (error) {
+		WARN("[BT] Connection to inverter %s failed: %s", inv->macaddr, strerror(error));
+		return -1;
 	}
+	in_bluetooth_connected(inv);
+	return 0;
+}
 
+/* Append what the socket has to the receive buffer, without blocking.
+ * Returns the number of bytes read, 0 if there was nothing or -1 when the
+ * connection is gone */
+int in_bluetooth_receive(struct bluetooth_inverter * inv) {
+
+	/* drop what was consumed */
+	if (inv->buffer_position > 0) {
+		memmove(inv->buffer, inv->buffer + inv->buffer_position,
+				inv->buffer_len - inv->buffer_position);
+		inv->buffer_len -= inv->buffer_position;
+		inv->buffer_position = 0;
+	}
+	if (inv->buffer_len >= BUFSIZ) {
+		WARN("[BT] Receive buffer of %s full", inv->macaddr);
+		return -1;
+	}
+
+	int count = read(inv->socket_fd, inv->buffer + inv->buffer_len, BUFSIZ - inv->buffer_len);
+	if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return 0;
+	if (count <= 0) {
+		WARN("[BT] Connection to inverter %s lost: %s", inv->macaddr,
+				count ? strerror(errno) : "closed");
+		return -1;
+	}
+
+	char buffer_hex[count * 3 + 1];
+	buffer_hex_dump(buffer_hex, inv->buffer + inv->buffer_len, count);
+	DEBUG("[BT] Received %d bytes: %s", count, buffer_hex);
+	inv->buffer_len += count;
+	return count;
 }
 
 int in_bluetooth_write(struct bluetooth_inverter * inv, unsigned char * buffer,
 		int len) {
-	char buffer_hex[len * 3];
+	char buffer_hex[len * 3 + 1];
 	int status = write(inv->socket_fd, buffer, len);
 
 	buffer_hex_dump(buffer_hex, buffer, len);
@@ -70,6 +215,8 @@ int in_bluetooth_write(struct bluetooth_inverter * inv, unsigned char * buffer,
 
 }
 
+/* Refill the buffer, waits at most 2 seconds. Returns the bytes read, -1
+ * on a timeout or when the link is closed */
 int in_bluetooth_connect_read(struct bluetooth_inverter * inv) {
 
     char buffer_hex[BUFSIZ * 3];
@@ -80,6 +227,8 @@ int in_bluetooth_connect_read(struct bluetooth_inverter * inv) {
     timeout.tv_sec = maxWait;
     timeout.tv_usec = 0;
 
+    inv->buffer_len = 0;
+    inv->buffer_position = 0;
     do {
         FD_ZERO(&readset);
         FD_SET(inv->socket_fd, &readset);
@@ -93,12 +242,13 @@ int in_bluetooth_connect_read(struct bluetooth_inverter * inv) {
             if (count > 0) {
                 buffer_hex_dump(buffer_hex, inv->buffer, count);
                 DEBUG("[BT] Received %d bytes: %s", count, buffer_hex);
+                inv->buffer_len = count;
+                return count;
             }
-
-            inv->buffer_len = count;
-            inv->buffer_position = 0;
-
-            return count;
+            if (count == 0)
+                WARN("[BT] Connection closed by the inverter");
+            else
+                WARN("[BT] Error on read(): %s", strerror(errno));
         }
     }
     else if (result < 0) {
@@ -106,55 +256,38 @@ int in_bluetooth_connect_read(struct bluetooth_inverter * inv) {
         WARN("Error on select(): %s", strerror(errno));
     } else {
         WARN("No data within %d seconds", maxWait);
-        exit(1);
     }
     return -1;
 }
 
-/* Get my mac address */
+/* Get my mac address, as resolved when the connection was made */
 void in_bluetooth_get_my_address(struct bluetooth_inverter * inv,
 		unsigned char * addr) {
-
-	/* Get my Mac */
-	struct sockaddr_rc mymac = { 0 };
-	//struct sockaddr mymac;
-	unsigned int mymac_size = sizeof(mymac);
-
-	getsockname(inv->socket_fd,(struct sockaddr *) &mymac, &mymac_size);
-
-	/* Copy to Buffer */
-	memcpy(addr, &mymac.rc_bdaddr, 6);
-
-	/* Reverse Buffer */
-	buffer_reverse(addr, 6);
-
-	/* Log my BT MAC */
-	char buffer_hex[6*3];
-
-	buffer_hex_dump(buffer_hex, addr, 6);
-	DEBUG("[BT] My MAC: %s", buffer_hex);
+	memcpy(addr, inv->local_addr, 6);
 }
 
-/* fetch one byte from stream */
-char in_bluetooth_get_byte(struct bluetooth_inverter * inv) {
+/* fetch one byte from stream, -1 when the link timed out or closed */
+int in_bluetooth_get_byte(struct bluetooth_inverter * inv) {
 
 	/* Check if its neccessary to fetch new buffer content */
-	while (inv->buffer_len == 0 || inv->buffer_len <= inv->buffer_position) {
-		in_bluetooth_connect_read(inv);
-	}
+	if (inv->buffer_len <= inv->buffer_position &&
+			in_bluetooth_connect_read(inv) < 0)
+		return -1;
 
 	return inv->buffer[inv->buffer_position++];
 
 }
 
-/* fetch multiple bytes */
-void in_bluetooth_get_bytes(struct bluetooth_inverter * inv,
+/* fetch multiple bytes, -1 when the link timed out or closed */
+int in_bluetooth_get_bytes(struct bluetooth_inverter * inv,
 		unsigned char *buffer, int count) {
 	for (int i = 0; i < count; ++i) {
-		if (buffer == NULL)
-			in_bluetooth_get_byte(inv);
-		else
-			buffer[i] = in_bluetooth_get_byte(inv);
+		int c = in_bluetooth_get_byte(inv);
+		if (c < 0)
+			return -1;
+		if (buffer != NULL)
+			buffer[i] = c;
 	}
+	return count;
 }
 
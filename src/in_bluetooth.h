@@ -27,9 +27,16 @@
 
 using namespace std;
 
+#define SMADATA2_MAX_QUERIES 16
+
+class FlightRecorder;
+
+/* Session with one inverter. Everything the protocol functions change lives
+ * here or in the packets of the caller, the tables are read only, so
+ * sessions can run on different threads */
 struct bluetooth_inverter {
 	char name[32];
-	char macaddr[18];
+	char macaddr[18];	/* or unix:<path> for a local bridge or simulator */
 	unsigned char password[13];
 	int socket_fd;
 	int socket_status;
@@ -37,8 +44,18 @@ struct bluetooth_inverter {
 	int buffer_len;
 	int buffer_position;
 	int l2_packet_send_count;
+	unsigned char local_addr[6];	/* resolved on connect, byte order of the packets */
+	unsigned char l1_request[18];	/* L1 header of the L2 requests, lengths set per packet */
 	unsigned int serial;
-	struct smadata2_model *model;
+	const struct smadata2_model *model;	/* never NULL after connect */
+	struct smadata2_stats *stats;	/* per register counters, may be NULL */
+	/* link errors and timings of the session, times in msec */
+	unsigned int bad_checksum;	/* L1 header checksum mismatches */
+	unsigned int bad_fcs;	/* L2 frame check sequence mismatches */
+	int connect_ms;
+	int handshake_ms;
+	int query_ms[SMADATA2_MAX_QUERIES];	/* round trip by query, -1 = not sent */
+	FlightRecorder *trace;	/* protocol phases, see trace.h, may be NULL */
 };
 
 /* level1 packet */
@@ -62,19 +79,39 @@ struct smadata2_l2_packet {
 	unsigned char c;
 	unsigned char content[BUFSIZ];
 	int content_length;
+	unsigned short error;		/* error code of a response */
+	unsigned short fragment;	/* packets still to follow in a multi packet response */
 };
 
-/* smadata2 value */
-struct smadata2_value {
-	char name[64];
-	char unit[5];
-	float factor;
-	unsigned long value;
+/* smadata2 archive record, total yield at a point in time */
+struct smadata2_archive_record {
+	int timestamp;
+	long long value;	/* Wh */
+};
+
+/* smadata2 event log entry, the fields of the 48 byte record worth keeping */
+struct smadata2_event_record {
 	int timestamp;
+	unsigned int serial;
+	unsigned int group;
+	unsigned int tag;		/* message text id */
+	unsigned int parameter;
+	unsigned int new_value;
+	unsigned int old_value;
+	unsigned short entry;	/* running number in the log */
+	unsigned short susyid;
+	unsigned short code;	/* event / fault code */
+	unsigned short flags;
+};
+
+/* smadata2 value, position of a register in a query response */
+struct smadata2_value {
+	int id;
 	int r_value_pos;
 	int r_value_len;
 	int r_timestamp_pos;
-
+	unsigned int lri;		/* when set the record is looked up by lri, the positions are unused */
+	unsigned int lri_class;	/* string or phase of the lri, 0 = any */
 };
 
 /* smadata2 query */
@@ -90,28 +127,39 @@ struct smadata2_query {
 	unsigned char r_ctrl2;
 	struct smadata2_value values[12];
 	int value_count;
+	int q_every;	/* send every n-th cycle only, 0 = every cycle */
+	int q_phase;	/* cycle within q_every it is sent in */
+	const char *q_name;
 };
 
-/* smadata2 model */
+/* smadata2 model, see sma-models.txt */
 struct smadata2_model {
+	unsigned short susyid;	/* device type code */
 	char name[64];
-	unsigned char code[2];
-	int max_power[4];
-	int model_count;
+	int max_power;			/* W, nominal AC power, 0 = unknown */
+	int phases;				/* AC phases */
+	int strings;			/* DC inputs */
+	unsigned int queries;	/* bit per query position that is sent */
 };
 
-/* This is used by the vector to store all the data that is collected */
+#define SMADATA2_ALL_QUERIES ((1u << SMADATA2_MAX_QUERIES) - 1)
+
+/* This is used by the vector to store all the data that is collected.
+ * Names, units and factor are found in SMADATA2PLUS_REGISTERS[id] */
 struct vec_data {
-	string name;
-	float value;
-	string units;
+	int id;
+	long long value;	/* raw value, multiply by the register factor */
+	int timestamp;		/* inverter time */
 };
 
 
-void in_bluetooth_connect(struct bluetooth_inverter * inv);
+int in_bluetooth_connect(struct bluetooth_inverter * inv, int timeout);
+int in_bluetooth_connect_start(struct bluetooth_inverter * inv);
+int in_bluetooth_connect_finish(struct bluetooth_inverter * inv);
+int in_bluetooth_receive(struct bluetooth_inverter * inv);
 int in_bluetooth_connect_read(struct bluetooth_inverter * inv);
-char in_bluetooth_get_byte(struct bluetooth_inverter * inv);
-void in_bluetooth_get_bytes(struct bluetooth_inverter * inv,
+int in_bluetooth_get_byte(struct bluetooth_inverter * inv);
+int in_bluetooth_get_bytes(struct bluetooth_inverter * inv,
 		unsigned char *buffer, int count);
 int in_bluetooth_write(struct bluetooth_inverter * inv, unsigned char * buffer,
 		int len);
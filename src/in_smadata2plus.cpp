@@ -31,8 +31,10 @@
 #include <time.h>
 #include <ctype.h>
 #include <vector>
+#include <algorithm>
 #include "in_bluetooth.h"
 #include "in_smadata2plus.h"
+#include "trace.h"
 
 /* L1 Stuff */
 unsigned char SMADATA2PLUS_L1_CONTENT_BROADCAST[13] = {0x00, 0x04, 0x70, 0x00,
@@ -73,68 +75,63 @@ static u_int16_t SMADATA2PLUS_L2_FCSTAB[256] = {0x0000, 0x1189, 0x2312, 0x329b,
 												0x0e70, 0x1ff9, 0xf78f, 0xe606, 0xd49d, 0xc514, 0xb1ab, 0xa022, 0x92b9,
 												0x8330, 0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78};
 
-/* Define Models */
-struct smadata2_model SMADATA2MODELS[] = {
-	/* Inverter 1700TL/2100TL */
-	{
-		"%dTL",
-		{0x63, 0x00},
-		{1700, 2100},
-		2,
-	},
-	/* Inverter 3000TL */
-	{
-		"%dTL",
-		{0x71, 0x00},
-		{3000},
-		1,
-	},
-	/* Inverter 3000TLHF */
-	{
-		"%dTLHF",
-		{0x83, 0x00},
-		{3000},
-		1,
-	},
-	/* Inverter 3000TLHF */
-	{
-		"%dTL",
-		{0xe2, 0x00},
-		{3600},
-		1,
-	},
-	/* Inverter 4000TL20/5000TL20 */
-	{
-		"%dTL20",
-		{0x4e, 0x00},
-		{4000, 5000},
-		2,
-	},
-	/* Inverter 4000TL21/5000TL21 */
-	{
-		"%dTL21",
-		{0x8a, 0x00},
-		{4000, 5000},
-		2,
-	},
-	/* Inverter 6000TL/7000TL */
-	{
-		"%dTL",
-		{0x63, 0x00},
-		{6000, 7000},
-		2,
-	},
-	/* Inverter 8000TL/10000TL */
-	{
-		"%dTL",
-		{0x80, 0x00},
-		{8000, 10000},
-		2,
-	},
+/* Define Models, built in until sma-models.txt is loaded : susyid, name,
+ * max power, phases, strings, queries. Models that share a device type
+ * code are told apart by their nominal power */
+static vector<struct smadata2_model> SMADATA2MODELS = {
+	{0x0063, "SB 1700TL", 1700, 1, 1, SMADATA2_ALL_QUERIES},
+	{0x0063, "SB 2100TL", 2100, 1, 1, SMADATA2_ALL_QUERIES},
+	{0x0063, "SB 6000TL", 6000, 1, 2, SMADATA2_ALL_QUERIES},
+	{0x0063, "SB 7000TL", 7000, 1, 2, SMADATA2_ALL_QUERIES},
+	{0x0071, "SB 3000TL", 3000, 1, 1, SMADATA2_ALL_QUERIES},
+	{0x0083, "SB 3000TLHF", 3000, 1, 1, SMADATA2_ALL_QUERIES},
+	{0x00e2, "SB 3600TL", 3600, 1, 2, SMADATA2_ALL_QUERIES},
+	{0x004e, "SB 4000TL20", 4000, 1, 2, SMADATA2_ALL_QUERIES},
+	{0x004e, "SB 5000TL20", 5000, 1, 2, SMADATA2_ALL_QUERIES},
+	{0x008a, "SB 4000TL21", 4000, 1, 2, SMADATA2_ALL_QUERIES},
+	{0x008a, "SB 5000TL21", 5000, 1, 2, SMADATA2_ALL_QUERIES},
+	{0x0080, "SB 8000TL", 8000, 1, 2, SMADATA2_ALL_QUERIES},
+	{0x0080, "SB 10000TL", 10000, 1, 2, SMADATA2_ALL_QUERIES},
 };
 
+/* Models that aren't known keep all registers and the global limits */
+static const struct smadata2_model SMADATA2MODEL_UNKNOWN = {0, "unknown", 0, 3, 2, SMADATA2_ALL_QUERIES};
+
+/* Profile of a device type code that several models share, the union of
+ * theirs, until the nominal power tells which one it is */
+static vector<struct smadata2_model> SMADATA2MODEL_SHARED;
+
+static unordered_map<unsigned short, const struct smadata2_model *> in_smadata2plus_index_models(
+	vector<struct smadata2_model> &models, vector<struct smadata2_model> &shared);
+
+/* Model or shared profile by susyid. Only changed by
+ * in_smadata2plus_load_models, sessions just read it */
+static unordered_map<unsigned short, const struct smadata2_model *> SMADATA2MODEL_INDEX =
+	in_smadata2plus_index_models(SMADATA2MODELS, SMADATA2MODEL_SHARED);
+
+/* Registers of a second or third phase or DC input, dropped when the model
+ * doesn't have it */
+static const struct {
+	int id;
+	int phase;
+	int string;
+} SMADATA2PLUS_REGISTER_PROFILE[] = {
+	{SMADATA2PLUS_REG_POWER_DC_2, 0, 2},
+	{SMADATA2PLUS_REG_VOLTAGE_DC_2, 0, 2},
+	{SMADATA2PLUS_REG_CURRENT_DC_2, 0, 2},
+	{SMADATA2PLUS_REG_POWER_AC_MAX_L2, 2, 0},
+	{SMADATA2PLUS_REG_POWER_AC_MAX_L3, 3, 0},
+	{SMADATA2PLUS_REG_POWER_AC_L2, 2, 0},
+	{SMADATA2PLUS_REG_POWER_AC_L3, 3, 0},
+	{SMADATA2PLUS_REG_VOLTAGE_AC_L2, 2, 0},
+	{SMADATA2PLUS_REG_VOLTAGE_AC_L3, 3, 0},
+	{SMADATA2PLUS_REG_CURRENT_AC_L2, 2, 0},
+	{SMADATA2PLUS_REG_CURRENT_AC_L3, 3, 0},
+};
+
+
 /* Define Value Structs */
-struct smadata2_query SMADATA2PLUS_QUERIES[] = {
+static const struct smadata2_query SMADATA2PLUS_QUERIES[] = {
 	/* Power AC */
 	{
 		0x09, /* Query ctrl1 */
@@ -149,19 +146,18 @@ struct smadata2_query SMADATA2PLUS_QUERIES[] = {
 		0x90, /* Response ctrl2 */
 		{
 			{
-				"power_ac", /* Value name */
-				"W",		/* Unit */
-				1.0,		/* Factor */
-				0L,			/* Actual Value */
-				0,			/* Timestamp */
-				20,			/* Value Pos */
-				3,			/* Value Len */
-				16,			/* Timestamp Pos */
+				SMADATA2PLUS_REG_POWER_AC, /* Register id */
+				20,	/* Value Pos */
+				3,	/* Value Len */
+				16	/* Timestamp Pos */
 			},
 		},
 		1, /* Value Count */
+		0, 0, /* Every, Phase */
+		"power_ac", /* Name, for metrics */
 	},
-	/* Yield in inverterlifetime */
+	/* Counters : total and day yield, operating and feed-in time.
+	 * 0x00260100 - 0x00462FFF in one query, looked up by lri */
 	{
 		0x09, /* Query ctrl1 */
 		0xa0, /* Query ctrl2 */
@@ -169,24 +165,43 @@ struct smadata2_query SMADATA2PLUS_QUERIES[] = {
 		0x00, /* Zero */
 		0x00, /* C */
 		/* Query Content */
-		{0x80, 0x00, 0x02, 0x00, 0x54, 0x00, 0x01, 0x26, 0x00, 0xFF, 0x01, 0x26, 0x00},
+		{0x80, 0x00, 0x02, 0x00, 0x54, 0x00, 0x01, 0x26, 0x00, 0xFF, 0x2F, 0x46, 0x00},
 		13,	  /* Query Content Length */
-		0x0d, /* Response ctrl1 */
+		0x00, /* Response ctrl1, any */
 		0x90, /* Response ctrl2 */
 		{
 			{
-				"yield_total", /* Value name */
-				"kWh",		   /* Unit */
-				0.001,		   /* Factor */
-				0L,			   /* Actual Value */
-				0,			   /* Timestamp */
-				20,			   /* Value Pos */
-				8,			   /* Value Len */
-				16,			   /* Timestamp Pos */
+				SMADATA2PLUS_REG_YIELD_TOTAL, /* Register id */
+				0,	/* Value Pos, by lri */
+				8,	/* Value Len */
+				0,	/* Timestamp Pos, by lri */
+				0x00260100	/* Lri : MeteringTotWhOut */
+			},
+			{
+				SMADATA2PLUS_REG_YIELD_DAY, /* Register id */
+				0,	/* Value Pos, by lri */
+				8,	/* Value Len */
+				0,	/* Timestamp Pos, by lri */
+				0x00262200	/* Lri : MeteringDyWhOut */
+			},
+			{
+				SMADATA2PLUS_REG_OPERATING_TIME, /* Register id */
+				0,	/* Value Pos, by lri */
+				8,	/* Value Len */
+				0,	/* Timestamp Pos, by lri */
+				0x00462E00	/* Lri : MeteringTotOpTms */
+			},
+			{
+				SMADATA2PLUS_REG_FEED_IN_TIME, /* Register id */
+				0,	/* Value Pos, by lri */
+				8,	/* Value Len */
+				0,	/* Timestamp Pos, by lri */
+				0x00462F00	/* Lri : MeteringTotFeedTms */
 			},
 		},
-		1, /* Value Count */
-
+		4, /* Value Count */
+		0, 0, /* Every, Phase */
+		"counters", /* Name, for metrics */
 	},
 	/* DC stuff finally */
 	{
@@ -202,47 +217,49 @@ struct smadata2_query SMADATA2PLUS_QUERIES[] = {
 		0x90, /* Response ctrl2 */
 		{
 			{
-				"power_dc_1", /* Value name */
-				"W",		  /* Unit */
-				1.0,		  /* Factor */
-				0L,			  /* Actual Value */
-				0,			  /* Timestamp */
-				20,			  /* Value Pos */
-				3,			  /* Value Len */
-				16			  /* Timestamp Pos */
+				SMADATA2PLUS_REG_POWER_DC_1, /* Register id */
+				20,	/* Value Pos */
+				3,	/* Value Len */
+				16	/* Timestamp Pos */
 			},
 			{
-				"power_dc_2", /* Value name */
-				"W",		  /* Unit */
-				1.0,		  /* Factor */
-				0L,			  /* Actual Value */
-				0,			  /* Timestamp */
-				48,			  /* Value Pos */
-				3,			  /* Value Len */
-				44			  /* Timestamp Pos */
+				SMADATA2PLUS_REG_POWER_DC_2, /* Register id */
+				48,	/* Value Pos */
+				3,	/* Value Len */
+				44	/* Timestamp Pos */
 			},
 			{
-				"voltage_dc_1", /* Value name */
-				"V",			/* Unit */
-				0.01,			/* Factor */
-				0L,				/* Actual Value */
-				0,				/* Timestamp */
-				76,				/* Value Pos */
-				3,				/* Value Len */
-				72				/* Timestamp Pos */
+				SMADATA2PLUS_REG_VOLTAGE_DC_1, /* Register id */
+				76,	/* Value Pos */
+				3,	/* Value Len */
+				72	/* Timestamp Pos */
 			},
 			{
-				"voltage_dc_2", /* Value name */
-				"V",			/* Unit */
-				0.01,			/* Factor */
-				0L,				/* Actual Value */
-				0,				/* Timestamp */
-				104,			/* Value Pos */
-				3,				/* Value Len */
-				100				/* Timestamp Pos */
+				SMADATA2PLUS_REG_VOLTAGE_DC_2, /* Register id */
+				104,	/* Value Pos */
+				3,	/* Value Len */
+				100	/* Timestamp Pos */
+			},
+			{
+				SMADATA2PLUS_REG_CURRENT_DC_1, /* Register id */
+				0,	/* Value Pos, by lri */
+				4,	/* Value Len */
+				0,	/* Timestamp Pos, by lri */
+				0x00452100,	/* Lri : DcMsAmp */
+				1	/* Lri class : string 1 */
+			},
+			{
+				SMADATA2PLUS_REG_CURRENT_DC_2, /* Register id */
+				0,	/* Value Pos, by lri */
+				4,	/* Value Len */
+				0,	/* Timestamp Pos, by lri */
+				0x00452100,	/* Lri : DcMsAmp */
+				2	/* Lri class : string 2 */
 			},
 		},
-		4, /* Value Count */
+		6, /* Value Count */
+		0, 0, /* Every, Phase */
+		"dc", /* Name, for metrics */
 	},
 	/* AC stuff finally */
 	{
@@ -258,127 +275,165 @@ struct smadata2_query SMADATA2PLUS_QUERIES[] = {
 		0x90, /* Response ctrl2 */
 		{
 			{
-				"power_ac_max_l1", /* Value name */
-				"W",			   /* Unit */
-				1.0,			   /* Factor */
-				0L,				   /* Actual Value */
-				0,				   /* Timestamp */
-				48,				   /* Value Pos */
-				3,				   /* Value Len */
-				44				   /* Timestamp Pos */
+				SMADATA2PLUS_REG_POWER_AC_MAX_L1, /* Register id */
+				48,	/* Value Pos */
+				3,	/* Value Len */
+				44	/* Timestamp Pos */
 			},
 			{
-				"power_ac_max_l2", /* Value name */
-				"W",			   /* Unit */
-				1.0,			   /* Factor */
-				0L,				   /* Actual Value */
-				0,				   /* Timestamp */
-				76,				   /* Value Pos */
-				3,				   /* Value Len */
-				72				   /* Timestamp Pos */
+				SMADATA2PLUS_REG_POWER_AC_MAX_L2, /* Register id */
+				76,	/* Value Pos */
+				3,	/* Value Len */
+				72	/* Timestamp Pos */
 			},
 			{
-				"power_ac_max_l3", /* Value name */
-				"W",			   /* Unit */
-				1.0,			   /* Factor */
-				0L,				   /* Actual Value */
-				0,				   /* Timestamp */
-				104,			   /* Value Pos */
-				3,				   /* Value Len */
-				100				   /* Timestamp Pos */
+				SMADATA2PLUS_REG_POWER_AC_MAX_L3, /* Register id */
+				104,	/* Value Pos */
+				3,	/* Value Len */
+				100	/* Timestamp Pos */
 			},
 			{
-				"power_ac_l1", /* Value name */
-				"W",		   /* Unit */
-				1.0,		   /* Factor */
-				0L,			   /* Actual Value */
-				0,			   /* Timestamp */
-				216,		   /* Value Pos */
-				3,			   /* Value Len */
-				212			   /* Timestamp Pos */
+				SMADATA2PLUS_REG_POWER_AC_L1, /* Register id */
+				216,	/* Value Pos */
+				3,	/* Value Len */
+				212	/* Timestamp Pos */
 			},
 			{
-				"power_ac_l2", /* Value name */
-				"W",		   /* Unit */
-				1.0,		   /* Factor */
-				0L,			   /* Actual Value */
-				0,			   /* Timestamp */
-				244,		   /* Value Pos */
-				3,			   /* Value Len */
-				240			   /* Timestamp Pos */
+				SMADATA2PLUS_REG_POWER_AC_L2, /* Register id */
+				244,	/* Value Pos */
+				3,	/* Value Len */
+				240	/* Timestamp Pos */
 			},
 			{
-				"power_ac_l3", /* Value name */
-				"W",		   /* Unit */
-				1.0,		   /* Factor */
-				0L,			   /* Actual Value */
-				0,			   /* Timestamp */
-				272,		   /* Value Pos */
-				3,			   /* Value Len */
-				268			   /* Timestamp Pos */
+				SMADATA2PLUS_REG_POWER_AC_L3, /* Register id */
+				272,	/* Value Pos */
+				3,	/* Value Len */
+				268	/* Timestamp Pos */
 			},
 			{
-				"voltage_ac_l1", /* Value name */
-				"V",			 /* Unit */
-				0.01,			 /* Factor */
-				0L,				 /* Actual Value */
-				0,				 /* Timestamp */
-				300,			 /* Value Pos */
-				3,				 /* Value Len */
-				296				 /* Timestamp Pos */
+				SMADATA2PLUS_REG_VOLTAGE_AC_L1, /* Register id */
+				300,	/* Value Pos */
+				3,	/* Value Len */
+				296	/* Timestamp Pos */
 			},
 			{
-				"voltage_ac_l2", /* Value name */
-				"V",			 /* Unit */
-				0.01,			 /* Factor */
-				0L,				 /* Actual Value */
-				0,				 /* Timestamp */
-				328,			 /* Value Pos */
-				3,				 /* Value Len */
-				324				 /* Timestamp Pos */
+				SMADATA2PLUS_REG_VOLTAGE_AC_L2, /* Register id */
+				328,	/* Value Pos */
+				3,	/* Value Len */
+				324	/* Timestamp Pos */
 			},
 			{
-				"voltage_ac_l3", /* Value name */
-				"V",			 /* Unit */
-				0.01,			 /* Factor */
-				0L,				 /* Actual Value */
-				0,				 /* Timestamp */
-				356,			 /* Value Pos */
-				3,				 /* Value Len */
-				352				 /* Timestamp Pos */
+				SMADATA2PLUS_REG_VOLTAGE_AC_L3, /* Register id */
+				356,	/* Value Pos */
+				3,	/* Value Len */
+				352	/* Timestamp Pos */
 			},
 			{
-				"current_ac_l1", /* Value name */
-				"A",			 /* Unit */
-				0.001,			 /* Factor */
-				0L,				 /* Actual Value */
-				0,				 /* Timestamp */
-				384,			 /* Value Pos */
-				3,				 /* Value Len */
-				380				 /* Timestamp Pos */
+				SMADATA2PLUS_REG_CURRENT_AC_L1, /* Register id */
+				384,	/* Value Pos */
+				3,	/* Value Len */
+				380	/* Timestamp Pos */
 			},
 			{
-				"current_ac_l2", /* Value name */
-				"A",			 /* Unit */
-				0.001,			 /* Factor */
-				0L,				 /* Actual Value */
-				0,				 /* Timestamp */
-				412,			 /* Value Pos */
-				3,				 /* Value Len */
-				408				 /* Timestamp Pos */
+				SMADATA2PLUS_REG_CURRENT_AC_L2, /* Register id */
+				412,	/* Value Pos */
+				3,	/* Value Len */
+				408	/* Timestamp Pos */
 			},
 			{
-				"current_ac_l3", /* Value name */
-				"A",			 /* Unit */
-				0.001,			 /* Factor */
-				0L,				 /* Actual Value */
-				0,				 /* Timestamp */
-				440,			 /* Value Pos */
-				3,				 /* Value Len */
-				436				 /* Timestamp Pos */
+				SMADATA2PLUS_REG_CURRENT_AC_L3, /* Register id */
+				440,	/* Value Pos */
+				3,	/* Value Len */
+				436	/* Timestamp Pos */
 			},
 		},
 		12, /* Value Count */
+		0, 0, /* Every, Phase */
+		"ac", /* Name, for metrics */
+	},
+	/* The queries below take turns, one of them per cycle : grid frequency
+	 * every other cycle, temperature and status every fourth */
+	/* Grid frequency */
+	{
+		0x09, /* Query ctrl1 */
+		0xa0, /* Query ctrl2 */
+		0x00, /* ArchCD */
+		0x00, /* Zero */
+		0x00, /* C */
+		/* Query Content */
+		{0x80, 0x00, 0x02, 0x00, 0x51, 0x00, 0x57, 0x46, 0x00, 0xFF, 0x57, 0x46, 0x00},
+		13,	  /* Query Content Length */
+		0x00, /* Response ctrl1, any */
+		0x90, /* Response ctrl2 */
+		{
+			{
+				SMADATA2PLUS_REG_FREQUENCY, /* Register id */
+				0,	/* Value Pos, by lri */
+				4,	/* Value Len */
+				0,	/* Timestamp Pos, by lri */
+				0x00465700	/* Lri : GridMsHz */
+			},
+		},
+		1, /* Value Count */
+		2, 0, /* Every, Phase */
+		"frequency", /* Name, for metrics */
+	},
+	/* Temperature */
+	{
+		0x09, /* Query ctrl1 */
+		0xa0, /* Query ctrl2 */
+		0x00, /* ArchCD */
+		0x00, /* Zero */
+		0x00, /* C */
+		/* Query Content */
+		{0x80, 0x00, 0x02, 0x00, 0x52, 0x00, 0x77, 0x23, 0x00, 0xFF, 0x77, 0x23, 0x00},
+		13,	  /* Query Content Length */
+		0x00, /* Response ctrl1, any */
+		0x90, /* Response ctrl2 */
+		{
+			{
+				SMADATA2PLUS_REG_TEMPERATURE, /* Register id */
+				0,	/* Value Pos, by lri */
+				4,	/* Value Len */
+				0,	/* Timestamp Pos, by lri */
+				0x00237700	/* Lri : CoolsysTmpNom */
+			},
+		},
+		1, /* Value Count */
+		4, 1, /* Every, Phase */
+		"temperature", /* Name, for metrics */
+	},
+	/* Status : condition and grid relay, 0x00214800 - 0x004164FF */
+	{
+		0x09, /* Query ctrl1 */
+		0xa0, /* Query ctrl2 */
+		0x00, /* ArchCD */
+		0x00, /* Zero */
+		0x00, /* C */
+		/* Query Content */
+		{0x80, 0x00, 0x02, 0x80, 0x51, 0x00, 0x48, 0x21, 0x00, 0xFF, 0x64, 0x41, 0x00},
+		13,	  /* Query Content Length */
+		0x00, /* Response ctrl1, any */
+		0x90, /* Response ctrl2 */
+		{
+			{
+				SMADATA2PLUS_REG_STATUS, /* Register id */
+				0,	/* Value Pos, by lri */
+				SMADATA2PLUS_VALUE_STATUS,	/* Value Len */
+				0,	/* Timestamp Pos, by lri */
+				0x00214800	/* Lri : OperationHealth */
+			},
+			{
+				SMADATA2PLUS_REG_GRID_RELAY, /* Register id */
+				0,	/* Value Pos, by lri */
+				SMADATA2PLUS_VALUE_STATUS,	/* Value Len */
+				0,	/* Timestamp Pos, by lri */
+				0x00416400	/* Lri : OperationGriSwStt */
+			},
+		},
+		2, /* Value Count */
+		4, 3, /* Every, Phase */
+		"status", /* Name, for metrics */
 	},
 
 	/* 0E A0 FF FF FF FF FF FF 00 01 78 00 $UNKNOWN 00 01 00 00 00 00 $CNT 80 0C 04 FD FF 07 00 00 00 84 03 00 00 $TIME 00 00 00 00 $PASSWORD $CRC 7E $END;*/
@@ -386,6 +441,46 @@ struct smadata2_query SMADATA2PLUS_QUERIES[] = {
 
 /* 7eff03606509a1ffffffffffff000078003f10fb3900000000000009800002005100002000ffff50000e7d339b7e */
 
+/* Define Registers, indexed by register id : name, unit, factor, min, max, class */
+const struct smadata2_register_def SMADATA2PLUS_REGISTERS[SMADATA2PLUS_REG_COUNT] = {
+	{"power_ac", "W", 1.0, 0.0, 30000.0, "power"},
+	{"yield_total", "kWh", 0.001, 0.0, 10000000.0, "energy"},
+	{"power_dc_1", "W", 1.0, 0.0, 30000.0, "power"},
+	{"power_dc_2", "W", 1.0, 0.0, 30000.0, "power"},
+	{"voltage_dc_1", "V", 0.01, 0.0, 1000.0, "voltage"},
+	{"voltage_dc_2", "V", 0.01, 0.0, 1000.0, "voltage"},
+	{"power_ac_max_l1", "W", 1.0, 0.0, 30000.0, "limit"},
+	{"power_ac_max_l2", "W", 1.0, 0.0, 30000.0, "limit"},
+	{"power_ac_max_l3", "W", 1.0, 0.0, 30000.0, "limit"},
+	{"power_ac_l1", "W", 1.0, 0.0, 30000.0, "power"},
+	{"power_ac_l2", "W", 1.0, 0.0, 30000.0, "power"},
+	{"power_ac_l3", "W", 1.0, 0.0, 30000.0, "power"},
+	{"voltage_ac_l1", "V", 0.01, 0.0, 500.0, "voltage"},
+	{"voltage_ac_l2", "V", 0.01, 0.0, 500.0, "voltage"},
+	{"voltage_ac_l3", "V", 0.01, 0.0, 500.0, "voltage"},
+	{"current_ac_l1", "A", 0.001, 0.0, 100.0, "current"},
+	{"current_ac_l2", "A", 0.001, 0.0, 100.0, "current"},
+	{"current_ac_l3", "A", 0.001, 0.0, 100.0, "current"},
+	{"current_dc_1", "A", 0.001, 0.0, 100.0, "current"},
+	{"current_dc_2", "A", 0.001, 0.0, 100.0, "current"},
+	{"frequency", "Hz", 0.01, 45.0, 65.0, "frequency"},
+	{"yield_day", "kWh", 0.001, 0.0, 1000.0, "energy"},
+	{"operating_time", "h", 1.0 / 3600.0, 0.0, 1000000.0, "time"},
+	{"feed_in_time", "h", 1.0 / 3600.0, 0.0, 1000000.0, "time"},
+	{"temperature", "degC", 0.01, -40.0, 120.0, "temperature"},
+	{"status", "", 1.0, 0.0, 16777215.0, "status"},
+	{"grid_relay", "", 1.0, 0.0, 16777215.0, "status"},
+	{"yield_5min", "kWh", 0.001, 0.0, 10000000.0, "energy"},
+	{"yield_daily", "kWh", 0.001, 0.0, 10000000.0, "energy"},
+	{"energy_ac_day", "Wh", 0.001, 0.0, 1000000.0, "energy"},
+	{"energy_ac_total", "Wh", 0.001, 0.0, 1.0e10, "energy"},
+	{"energy_ac_l1_day", "Wh", 0.001, 0.0, 1000000.0, "energy"},
+	{"energy_ac_l2_day", "Wh", 0.001, 0.0, 1000000.0, "energy"},
+	{"energy_ac_l3_day", "Wh", 0.001, 0.0, 1000000.0, "energy"},
+	{"energy_dc_1_day", "Wh", 0.001, 0.0, 1000000.0, "energy"},
+	{"energy_dc_2_day", "Wh", 0.001, 0.0, 1000000.0, "energy"},
+};
+
 /** Level1 functions **/
 
 /* Clear packet struct */
@@ -394,37 +489,123 @@ void in_smadata2plus_level1_clear(struct smadata2_l1_packet *p)
 	memset(p, 0, sizeof(*p));
 }
 
-/* Wait as long until packet with specfic cmdcode is received */
-void in_smadata2plus_level1_cmdcode_wait(struct bluetooth_inverter *inv,
-										 struct smadata2_l1_packet *p, struct smadata2_l2_packet *p2, int cmdcode)
+/* Wait until a packet with specfic cmdcode is received. Returns 0, -1
+ * when the link is lost or no such packet came within
+ * SMADATA2PLUS_WAIT_TIMEOUT */
+int in_smadata2plus_level1_cmdcode_wait(struct bluetooth_inverter *inv,
+										struct smadata2_l1_packet *p, struct smadata2_l2_packet *p2, int cmdcode)
 {
 
 	DEBUG("[L1] Wait for packet cmdcode == %d", cmdcode);
+	int64_t start = inv->trace ? FlightRecorder::now() : 0;
+	int64_t deadline = in_smadata2plus_millis() + SMADATA2PLUS_WAIT_TIMEOUT;
 	int act_cmdcode = in_smadata2plus_level1_packet_read(inv, p, p2);
 	while (act_cmdcode != cmdcode)
 	{
+		if (act_cmdcode == -2)
+			return -1;
+		if (in_smadata2plus_millis() >= deadline)
+		{
+			WARN("[L1] No packet with cmdcode %d within %d ms", cmdcode, SMADATA2PLUS_WAIT_TIMEOUT);
+			return -1;
+		}
 		act_cmdcode = in_smadata2plus_level1_packet_read(inv, p, p2);
 	}
+	if (inv->trace)
+		inv->trace->add(in_smadata2plus_wait_name(cmdcode), start, FlightRecorder::now());
 	DEBUG("[L1] Got packet cmdcode == %d", cmdcode);
+	return 0;
+}
+
+/* Trace phase of waiting for cmdcode */
+const char *in_smadata2plus_wait_name(int cmdcode)
+{
+	switch (cmdcode)
+	{
+	case SMADATA2PLUS_L1_CMDCODE_LEVEL2:
+		return "wait_level2";
+	case SMADATA2PLUS_L1_CMDCODE_BROADCAST:
+		return "wait_broadcast";
+	case SMADATA2PLUS_L1_CMDCODE_5:
+		return "wait_cmd5";
+	case SMADATA2PLUS_L1_CMDCODE_10:
+		return "wait_cmd10";
+	case SMADATA2PLUS_L1_CMDCODE_12:
+		return "wait_cmd12";
+	default:
+		return "wait";
+	}
+}
+
+/* A header the reader accepts : checksum matches and the length fits the
+ * receive buffer. The reader resyncs on the next start byte otherwise */
+static bool in_smadata2plus_level1_header_valid(const unsigned char *header)
+{
+	int length = header[1] + header[2] * 256;
+
+	return header[3] == (SMADATA2PLUS_STARTBYTE ^ header[1] ^ header[2]) &&
+		   length >= SMADATA2PLUS_L1_HEADER_LEN && length <= BUFSIZ;
 }
 
-/* Debug print l1 struct */
+/* True when the receive buffer holds a complete packet, including all its
+ * fragments, so in_smadata2plus_level1_packet_read won't block */
+bool in_smadata2plus_level1_complete(struct bluetooth_inverter *inv)
+{
+	int pos = inv->buffer_position;
+
+	while (pos < inv->buffer_len)
+	{
+		/* bytes before a start byte are skipped by the reader too */
+		if (inv->buffer[pos] != SMADATA2PLUS_STARTBYTE)
+		{
+			pos++;
+			continue;
+		}
+		if (pos + SMADATA2PLUS_L1_HEADER_LEN > inv->buffer_len)
+			return false;
+		int length = inv->buffer[pos + 1] + inv->buffer[pos + 2] * 256;
+		if (!in_smadata2plus_level1_header_valid(inv->buffer + pos))
+		{
+			pos++;
+			continue;
+		}
+		if (pos + length > inv->buffer_len)
+			return false;
+		int cmd_code = inv->buffer[pos + 16] + inv->buffer[pos + 17] * 256;
+		/* the reader stops at an empty fragment too */
+		if (cmd_code != SMADATA2PLUS_L1_CMDCODE_FRAGMENT || length == SMADATA2PLUS_L1_HEADER_LEN)
+			return true;
+		pos += length;
+	}
+	return false;
+}
+
+/* Debug print l1 struct, output holds BUFSIZ chars */
 void in_smadata2plus_level1_packet_print(char *output,
 										 struct smadata2_l1_packet *p)
 {
 
 	/* for output */
-	char src_addr_hex[20], dest_addr_hex[20], content_hex[(p->length - SMADATA2PLUS_L1_HEADER_LEN) * 3];
+	char src_addr_hex[20], dest_addr_hex[20], content_hex[(p->length - SMADATA2PLUS_L1_HEADER_LEN) * 3 + 1];
 	buffer_hex_dump(src_addr_hex, p->src, 6);
 	buffer_hex_dump(dest_addr_hex, p->dest, 6);
 	buffer_hex_dump(content_hex, p->content,
 					p->length - SMADATA2PLUS_L1_HEADER_LEN);
 
-	sprintf(output, "length=%d cmdcode=%d src=%s dest=%s content=%s", p->length,
-			p->cmd_code, src_addr_hex, dest_addr_hex, content_hex);
+	snprintf(output, BUFSIZ, "length=%d cmdcode=%d src=%s dest=%s content=%s", p->length,
+			 p->cmd_code, src_addr_hex, dest_addr_hex, content_hex);
+}
+
+/* Forget a packet that failed, including fragments read before */
+static void in_smadata2plus_level1_reject(struct smadata2_l1_packet *p)
+{
+	p->cmd_code = 0;
+	p->length = SMADATA2PLUS_L1_HEADER_LEN;
 }
 
-/* Read l1 packet from bluetooth stream */
+/* Read l1 packet from bluetooth stream, with all its fragments. Returns
+ * the cmdcode, -1 for a packet with a broken header, an empty fragment or
+ * that doesn't fit, -2 when the link timed out or closed */
 int in_smadata2plus_level1_packet_read(struct bluetooth_inverter *inv,
 									   struct smadata2_l1_packet *p, struct smadata2_l2_packet *p2)
 {
@@ -432,120 +613,151 @@ int in_smadata2plus_level1_packet_read(struct bluetooth_inverter *inv,
 	/* Offset for fragments */
 	int offset = 0;
 
-	/* wait for start package */
-	while (in_bluetooth_get_byte(inv) != SMADATA2PLUS_STARTBYTE)
+	/* one frame per pass, until the last fragment */
+	for (;;)
 	{
-		usleep(500);
-	}
+		/* wait for start package, get_byte blocks when the buffer is empty */
+		int c;
+		while ((c = in_bluetooth_get_byte(inv)) != SMADATA2PLUS_STARTBYTE)
+		{
+			if (c < 0)
+				return -2;
+		}
 
-	/* Fetching Checksum */
-	unsigned char len1 = in_bluetooth_get_byte(inv);
-	unsigned char len2 = in_bluetooth_get_byte(inv);
-	p->checksum = in_bluetooth_get_byte(inv);
-	unsigned char checksumvalidate = SMADATA2PLUS_STARTBYTE ^ len1 ^ len2;
-	if (p->checksum != checksumvalidate)
-	{
-		WARN("[L1] Received packet with wrong Checksum");
-	}
+		/* Fetching Checksum */
+		unsigned char header[4] = {SMADATA2PLUS_STARTBYTE};
+		if (in_bluetooth_get_bytes(inv, header + 1, 3) < 0)
+			return -2;
+		p->checksum = header[3];
+		if (!in_smadata2plus_level1_header_valid(header))
+		{
+			/* The length can't be trusted, drop the packet so far */
+			WARN("[L1] Received packet with wrong Checksum or length");
+			inv->bad_checksum++;
+			in_smadata2plus_level1_reject(p);
+			return -1;
+		}
 
-	/* packet_len */
-	int content_len = (len1 + (len2 * 256)) - SMADATA2PLUS_L1_HEADER_LEN;
+		/* packet_len */
+		int content_len = (header[1] + (header[2] * 256)) - SMADATA2PLUS_L1_HEADER_LEN;
 
-	if (p->cmd_code == SMADATA2PLUS_L1_CMDCODE_FRAGMENT)
-	{
-		/* Fragment */
-		offset = p->length - SMADATA2PLUS_L1_HEADER_LEN;
-		p->length += content_len;
-	}
-	else
-	{
-		/* No Fragment */
-		offset = 0;
-		p->length = SMADATA2PLUS_L1_HEADER_LEN + content_len;
-	}
+		if (p->cmd_code == SMADATA2PLUS_L1_CMDCODE_FRAGMENT)
+		{
+			/* Fragment */
+			offset = p->length - SMADATA2PLUS_L1_HEADER_LEN;
+			p->length += content_len;
+		}
+		else
+		{
+			/* No Fragment */
+			offset = 0;
+			p->length = SMADATA2PLUS_L1_HEADER_LEN + content_len;
+		}
 
-	/* Fetching source + dest addresses */
-	in_bluetooth_get_bytes(inv, p->src, 6);
-	in_bluetooth_get_bytes(inv, p->dest, 6);
+		/* Fetching source + dest addresses and cmdcode */
+		unsigned char cmd_code[2];
+		if (in_bluetooth_get_bytes(inv, p->src, 6) < 0 || in_bluetooth_get_bytes(inv, p->dest, 6) < 0 ||
+			in_bluetooth_get_bytes(inv, cmd_code, 2) < 0)
+			return -2;
 
-	/* reverse byte order */
-	buffer_reverse(p->src, 6);
-	buffer_reverse(p->dest, 6);
+		/* reverse byte order */
+		buffer_reverse(p->src, 6);
+		buffer_reverse(p->dest, 6);
 
-	/* cmdcode */
-	p->cmd_code = in_bluetooth_get_byte(inv) + in_bluetooth_get_byte(inv) * 256;
+		p->cmd_code = cmd_code[0] + cmd_code[1] * 256;
 
-	/* getcontent */
-	in_bluetooth_get_bytes(inv, p->content + offset,
-						   content_len);
+		/* getcontent, a fragment that doesn't fit is skipped with the whole packet */
+		if (offset + content_len > (int)sizeof(p->content))
+		{
+			WARN("[L1] Fragmented packet longer than %d bytes", (int)sizeof(p->content));
+			in_smadata2plus_level1_reject(p);
+			return in_bluetooth_get_bytes(inv, NULL, content_len) < 0 ? -2 : -1;
+		}
+		if (in_bluetooth_get_bytes(inv, p->content + offset, content_len) < 0)
+			return -2;
 
-	/* Check if L1 packet is fragmented */
-	if (p->cmd_code == SMADATA2PLUS_L1_CMDCODE_FRAGMENT)
-	{
-		return in_smadata2plus_level1_packet_read(inv, p, p2);
+		/* Check if L1 packet is fragmented */
+		if (p->cmd_code != SMADATA2PLUS_L1_CMDCODE_FRAGMENT)
+			break;
+
+		/* every fragment grows the packet, which bounds their number */
+		if (content_len == 0)
+		{
+			WARN("[L1] Received empty fragment");
+			in_smadata2plus_level1_reject(p);
+			return -1;
+		}
 	}
-	else
-	{
 
-		/* Packet complete */
+	/* Packet complete */
 
-		/* Packet print */
-		char output[BUFSIZ];
-		in_smadata2plus_level1_packet_print(output, p);
-		DEBUG("[L1] Received packet with %s", output);
+	/* Packet print */
+	char output[BUFSIZ];
+	in_smadata2plus_level1_packet_print(output, p);
+	DEBUG("[L1] Received packet with %s", output);
 
-		/* Check if contains L2 packet */
-		if (p->length - SMADATA2PLUS_L1_HEADER_LEN > 4 && p->content[0] == SMADATA2PLUS_STARTBYTE && memcmp(p->content + 1, SMADATA2PLUS_L2_HEADER, 4) == 0)
-		{
+	/* Check if contains L2 packet */
+	if (p->length - SMADATA2PLUS_L1_HEADER_LEN > 4 && p->content[0] == SMADATA2PLUS_STARTBYTE && memcmp(p->content + 1, SMADATA2PLUS_L2_HEADER, 4) == 0)
+	{
 
-			/* Check if got L2 struct */
-			if (p2 != NULL)
-				in_smadata2plus_level2_packet_read(p->content,
-												   p->length - SMADATA2PLUS_L1_HEADER_LEN, p2);
+		/* Check if got L2 struct. On a bad FCS p2 holds an older
+		 * packet, so don't report the command code the caller waits for */
+		if (p2 != NULL && in_smadata2plus_level2_packet_read(p->content,
+															 p->length - SMADATA2PLUS_L1_HEADER_LEN, p2) < 0)
+		{
+			inv->bad_fcs++;
+			return -1;
 		}
-
-		return p->cmd_code;
 	}
+
+	return p->cmd_code;
 }
 
-/* Generate l1 stream from l1 packet struct */
+/* L1 header of the L2 requests : from the local address to all inverters.
+ * Built once per connection, the lengths and checksum are set per packet */
+void in_smadata2plus_level1_templates(struct bluetooth_inverter *inv)
+{
+	unsigned char *h = inv->l1_request;
+
+	h[0] = SMADATA2PLUS_STARTBYTE;
+	h[1] = h[2] = h[3] = 0;
+	memcpy(h + 4, inv->local_addr, 6);
+	buffer_reverse(h + 4, 6);
+	buffer_repeat(h + 10, 0xff, 6);
+	h[16] = SMADATA2PLUS_L1_CMDCODE_LEVEL2 & 0xff;
+	h[17] = SMADATA2PLUS_L1_CMDCODE_LEVEL2 >> 8;
+}
+
+/* Generate l1 stream from l1 packet struct. L2 requests take the header
+ * template of the session, see in_smadata2plus_level2_request */
 void in_smadata2plus_level1_packet_send(struct bluetooth_inverter *inv,
 										struct smadata2_l1_packet *p)
 {
 
 	unsigned char buffer[BUFSIZ];
-	int i = 0;
+	int i = SMADATA2PLUS_L1_HEADER_LEN;
 
-	/* Generate lengths and checksum */
-	int len2 = (p->length / 256);
-	int len1 = p->length - len2;
-	p->checksum = SMADATA2PLUS_STARTBYTE ^ len1 ^ len2;
+	if (p->cmd_code == SMADATA2PLUS_L1_CMDCODE_LEVEL2)
+	{
+		memcpy(buffer, inv->l1_request, SMADATA2PLUS_L1_HEADER_LEN);
+	}
+	else
+	{
+		/* Macs reversed in the buffer so p stays as it is */
+		buffer[0] = SMADATA2PLUS_STARTBYTE;
+		memcpy(buffer + 4, p->src, 6);
+		buffer_reverse(buffer + 4, 6);
+		memcpy(buffer + 10, p->dest, 6);
+		buffer_reverse(buffer + 10, 6);
+		buffer[16] = p->cmd_code & 0xff;
+		buffer[17] = p->cmd_code >> 8;
+	}
 
-	/* Packet print */
-	char output[BUFSIZ];
-	in_smadata2plus_level1_packet_print(output, p);
+	/* Lengths and checksum */
+	buffer[1] = p->length & 0xff;
+	buffer[2] = p->length >> 8;
+	buffer[3] = p->checksum = SMADATA2PLUS_STARTBYTE ^ buffer[1] ^ buffer[2];
 
-	/////DEBUG("[L1] Send packet with %s", output);
-
-	/* Reverse Macs */
-	buffer_reverse(p->src, 6);
-	buffer_reverse(p->dest, 6);
-
-	/* Command */
-	int cmd2 = (p->cmd_code / 256);
-	int cmd1 = p->cmd_code - cmd2;
-
-	/* Build Packet */
-	buffer[i++] = SMADATA2PLUS_STARTBYTE;
-	buffer[i++] = len1;
-	buffer[i++] = len2;
-	buffer[i++] = p->checksum;
-	memcpy(buffer + i, p->src, 6);
-	i += 6;
-	memcpy(buffer + i, p->dest, 6);
-	i += 6;
-	buffer[i++] = cmd1;
-	buffer[i++] = cmd2;
 	memcpy(buffer + i, p->content, p->length - SMADATA2PLUS_L1_HEADER_LEN);
 	i += p->length - SMADATA2PLUS_L1_HEADER_LEN;
 
@@ -597,18 +809,21 @@ int in_smadata2plus_level2_packet_gen(struct bluetooth_inverter *inv,
 	char unsigned null_addr[] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
 	char unsigned dummy_addr[] = {0x31, 0x32, 0x33, 0x34, 0x35, 0x36};
 
-	/** Validate Paket **/
+	/** Validate Paket, on copies of the addresses so p stays as it is **/
+	unsigned char dest[6], src[6];
+	memcpy(dest, p->dest, 6);
+	memcpy(src, p->src, 6);
 
 	/* Rewrite null destination to broadcast */
-	if (memcmp(p->dest, null_addr, 6) == 0)
+	if (memcmp(dest, null_addr, 6) == 0)
 	{
-		buffer_repeat(p->dest, 0xff, 6);
+		buffer_repeat(dest, 0xff, 6);
 	}
 
 	/* Rewrite null source to dummy_addr */
-	if (memcmp(p->src, null_addr, 6) == 0)
+	if (memcmp(src, null_addr, 6) == 0)
 	{
-		memcpy(p->src, dummy_addr, 6);
+		memcpy(src, dummy_addr, 6);
 	}
 
 	/* Packet print */
@@ -634,7 +849,7 @@ int in_smadata2plus_level2_packet_gen(struct bluetooth_inverter *inv,
 	buffer[len++] = p->ctrl2;
 
 	/* Destination */
-	memcpy(buffer + len, p->dest, 6);
+	memcpy(buffer + len, dest, 6);
 	/* reverse byte order */
 	buffer_reverse(buffer + len, 6);
 	len += 6;
@@ -644,7 +859,7 @@ int in_smadata2plus_level2_packet_gen(struct bluetooth_inverter *inv,
 	buffer[len++] = p->zero;
 
 	/* Source */
-	memcpy(buffer + len, p->src, 6);
+	memcpy(buffer + len, src, 6);
 	/* reverse byte order */
 	buffer_reverse(buffer + len, 6);
 	len += 6;
@@ -653,9 +868,11 @@ int in_smadata2plus_level2_packet_gen(struct bluetooth_inverter *inv,
 	buffer[len++] = 0x00;
 	buffer[len++] = p->c;
 
-	/* four zeros */
-	buffer_repeat(buffer + len, 0x00, 4);
-	len += 4;
+	/* error code and packets to follow, 0 in requests */
+	buffer[len++] = p->error & 0xff;
+	buffer[len++] = p->error >> 8;
+	buffer[len++] = p->fragment & 0xff;
+	buffer[len++] = p->fragment >> 8;
 
 	/* packetcount */
 	buffer[len++] = inv->l2_packet_send_count++;
@@ -673,11 +890,12 @@ int in_smadata2plus_level2_packet_gen(struct bluetooth_inverter *inv,
 	in_smadata2plus_level2_add_escapes(buffer, &len);
 
 	/* Adding checksum */
-	int checksum_len = 2;
+	int checksum_len = 3;
 	memcpy(buffer + len, checksum, 2);
-	/* Escaping checksum if needed */
-	in_smadata2plus_level2_add_escapes(buffer + len, &checksum_len);
-	len += checksum_len;
+	/* Escaping checksum if needed. add_escapes skips the first byte (the
+	 * start byte of a packet), so start one byte before the checksum */
+	in_smadata2plus_level2_add_escapes(buffer + len - 1, &checksum_len);
+	len += checksum_len - 1;
 
 	DEBUG("[L2] Escaped %d chars, checksum %02x:%02x", len-len_bef, checksum[0], checksum[1]);
 
@@ -693,21 +911,22 @@ void in_smadata2plus_level2_packet_print(char *output,
 {
 
 	/* for output */
-	char src_addr_hex[20], dest_addr_hex[20], content_hex[p->content_length * 3];
+	char src_addr_hex[20], dest_addr_hex[20], content_hex[p->content_length * 3 + 1];
 	buffer_hex_dump(content_hex, p->content, p->content_length);
 
 	buffer_hex_dump(src_addr_hex, p->src, 6);
 	buffer_hex_dump(dest_addr_hex, p->dest, 6);
 
-	sprintf(output,
-			"src=%s dest=%s ctrl1=%02x ctrl2=%02x archcd=%02x zero=%02x c=%02x content[%dbytes]=%s", src_addr_hex, dest_addr_hex,
-			p->ctrl1, p->ctrl2, p->archcd, p->zero, p->c, p->content_length,
-			content_hex);
+	snprintf(output, BUFSIZ,
+			 "src=%s dest=%s ctrl1=%02x ctrl2=%02x archcd=%02x zero=%02x c=%02x content[%dbytes]=%s", src_addr_hex, dest_addr_hex,
+			 p->ctrl1, p->ctrl2, p->archcd, p->zero, p->c, p->content_length,
+			 content_hex);
 }
 
-/* Read L2 packet from buffer into struct */
-void in_smadata2plus_level2_packet_read(unsigned char *buffer, int len,
-										struct smadata2_l2_packet *p)
+/* Read L2 packet from buffer into struct. Returns -1 and leaves p alone
+ * when the frame check sequence doesn't match */
+int in_smadata2plus_level2_packet_read(unsigned char *buffer, int len,
+									   struct smadata2_l2_packet *p)
 {
 
 	int pos = 0;
@@ -717,6 +936,13 @@ void in_smadata2plus_level2_packet_read(unsigned char *buffer, int len,
 	in_smadata2plus_level2_strip_escapes(buffer, &len);
 	int diff = len_bef - len;
 
+	/* Header, checksum and end byte at least */
+	if (len < SMADATA2PLUS_L2_MIN_LEN)
+	{
+		WARN("[L2] Received packet of %d bytes, too short", len);
+		return -1;
+	}
+
 	/* Remove checksum */
 	len -= 1;
 	unsigned char checksum[2], checksum_recv[2];
@@ -732,7 +958,8 @@ void in_smadata2plus_level2_packet_read(unsigned char *buffer, int len,
 	/* Compare checksums */
 	if (memcmp(checksum, checksum_recv, 2) != 0)
 	{
-		///////////////printf("[L2] Received packet with wrong Checksum");
+		WARN("[L2] Received packet with wrong Checksum");
+		return -1;
 	}
 	else
 	{
@@ -769,7 +996,9 @@ void in_smadata2plus_level2_packet_read(unsigned char *buffer, int len,
 		pos++;
 		p->c = buffer[pos++];
 
-		/* four zeros */
+		/* error code and packets to follow */
+		p->error = buffer[pos] + buffer[pos + 1] * 256;
+		p->fragment = buffer[pos + 2] + buffer[pos + 3] * 256;
 		pos += 4;
 
 		/* packetcount */
@@ -784,6 +1013,7 @@ void in_smadata2plus_level2_packet_read(unsigned char *buffer, int len,
 		in_smadata2plus_level2_packet_print(output, p);
 		///////////////DEBUG("[L2] Received packet with  %s", output);
 	}
+	return 0;
 }
 
 /* Calculate a new fcs given the current fcs and the new data. */
@@ -799,21 +1029,25 @@ u_int16_t in_smadata2plus_level2_pppfcs16(u_int16_t fcs, void *_cp, int len)
 /* Remove escape chars from buffer */
 void in_smadata2plus_level2_strip_escapes(unsigned char *buffer, int *len)
 {
-	int i, j;
+	int i = 1, j = 1;
 
-	for (i = 1; i < (*len); i++)
+	/* Start byte stays, the rest is copied down in one pass */
+	while (i < (*len))
 	{
 		if (buffer[i] == 0x7d)
 		{
-			/* Found escape character. Need to convert*/
-			buffer[i] = buffer[i + 1] ^ 0x20;
-
-			/* Short buffer */
-			for (j = i + 1; j < (*len) - 1; j++)
-				buffer[j] = buffer[j + 1];
-			(*len)--;
+			/* Found escape character. Need to convert, one at the end
+			 * has nothing to convert and is dropped */
+			if (i + 1 == (*len))
+				break;
+			buffer[j++] = buffer[i + 1] ^ 0x20;
+			i += 2;
 		}
+		else
+			buffer[j++] = buffer[i++];
 	}
+	if ((*len) > 0)
+		(*len) = j;
 }
 
 /* Generate checksum from buffer */
@@ -832,148 +1066,101 @@ void in_smadata2plus_level2_tryfcs16(unsigned char *buffer, int len,
 	cs[1] = ((trialfcs >> 8) & 0x00ff);
 }
 
-void in_smadata2plus_connect(struct bluetooth_inverter *inv)
-{
-
-	/* Intizalize packet structs */
-	struct smadata2_l1_packet recv_pl1 = {0};
-	struct smadata2_l2_packet recv_pl2 = {{0}};
-	struct smadata2_l1_packet sent_pl1 = {0};
-	struct smadata2_l2_packet sent_pl2 = {{0}};
+/** Request builders, shared by the blocking flow and the sessions **/
 
-	/* Wait for Broadcast request */
-	in_smadata2plus_level1_cmdcode_wait(inv, &recv_pl1, NULL,
-										SMADATA2PLUS_L1_CMDCODE_BROADCAST);
+/* Wrap p2 into an L1 packet to all inverters */
+void in_smadata2plus_level2_request(struct bluetooth_inverter *inv, struct smadata2_l1_packet *p1,
+									struct smadata2_l2_packet *p2)
+{
+	/* Header fields as in the template, the content is overwritten */
+	p1->cmd_code = SMADATA2PLUS_L1_CMDCODE_LEVEL2;
+	buffer_repeat(p1->dest, 0xff, 6);
+	memcpy(p1->src, inv->local_addr, 6);
+	/* Generate L2 Paket */
+	p1->length = in_smadata2plus_level2_packet_gen(inv, p1->content, p2);
+	p1->length += SMADATA2PLUS_L1_HEADER_LEN;
+}
 
+/* Answer to the broadcast of the inverter, carries its netid back */
+void in_smadata2plus_broadcast_reply(struct bluetooth_inverter *inv, struct smadata2_l1_packet *request,
+									 struct smadata2_l1_packet *reply)
+{
 	/* fetch netid from package */
-	unsigned char netid = recv_pl1.content[4];
+	unsigned char netid = request->content[4];
 
-	/* Answer broadcast */
-	sent_pl1.cmd_code = SMADATA2PLUS_L1_CMDCODE_BROADCAST;
+	in_smadata2plus_level1_clear(reply);
+	reply->cmd_code = SMADATA2PLUS_L1_CMDCODE_BROADCAST;
 	/* Set destination */
-	memcpy(sent_pl1.dest, recv_pl1.src, 6);
+	memcpy(reply->dest, request->src, 6);
 	/* Set my address */
-	in_bluetooth_get_my_address(inv, sent_pl1.src);
+	in_bluetooth_get_my_address(inv, reply->src);
 
-	int len = 0;
 	/* Copy content for Broadcast */
-	memcpy(sent_pl1.content, SMADATA2PLUS_L1_CONTENT_BROADCAST,
+	memcpy(reply->content, SMADATA2PLUS_L1_CONTENT_BROADCAST,
 		   sizeof(SMADATA2PLUS_L1_CONTENT_BROADCAST));
-	len += sizeof(SMADATA2PLUS_L1_CONTENT_BROADCAST);
 	/* Set netid */
-	sent_pl1.content[4] = netid;
+	reply->content[4] = netid;
 
 	/* Setting length of packet */
-	sent_pl1.length = SMADATA2PLUS_L1_HEADER_LEN + len;
-
-	/* Send Packet out */
-	in_smadata2plus_level1_packet_send(inv, &sent_pl1);
-
-	/* Wait for cmdcode 10 */
-	in_smadata2plus_level1_cmdcode_wait(inv, &recv_pl1, NULL,
-										SMADATA2PLUS_L1_CMDCODE_10);
-
-	/* Wait for cmdcode 5 */
-	in_smadata2plus_level1_cmdcode_wait(inv, &recv_pl1, NULL,
-										SMADATA2PLUS_L1_CMDCODE_5);
-
-	/** Sent first L2 packet*/
-	in_smadata2plus_level1_clear(&sent_pl1);
-	in_smadata2plus_level2_clear(&sent_pl2);
+	reply->length = SMADATA2PLUS_L1_HEADER_LEN + sizeof(SMADATA2PLUS_L1_CONTENT_BROADCAST);
+}
 
-	/* Set cmdcode */
-	sent_pl1.cmd_code = SMADATA2PLUS_L1_CMDCODE_LEVEL2;
-	/* Set destination */
-	buffer_repeat(sent_pl1.dest, 0xff, 6);
-	/* Set my address */
-	in_bluetooth_get_my_address(inv, sent_pl1.src);
-	/* Set Layer 2 */
-	sent_pl2.ctrl1 = 0x09;
-	sent_pl2.ctrl2 = 0xa0;
-	/* Set L2 Content */
+/* The two L2 packets after the broadcast, step 1 is answered with the
+ * inverter address */
+void in_smadata2plus_init_packet(int step, struct smadata2_l2_packet *p2)
+{
 	unsigned char content_packet_one[13] = {0x80, 0x00, 0x02, 0x00, 0x00, 0x00,
 											0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-	memcpy(sent_pl2.content, content_packet_one, sizeof(content_packet_one));
-	sent_pl2.content_length = sizeof(content_packet_one);
-	/* Generate L2 Paket */
-	memset(sent_pl1.content, 0, BUFSIZ);
-	sent_pl1.length = in_smadata2plus_level2_packet_gen(inv, sent_pl1.content,
-														&sent_pl2);
-	sent_pl1.length += SMADATA2PLUS_L1_HEADER_LEN;
-	/* Send Packet out */
-	in_smadata2plus_level1_packet_send(inv, &sent_pl1);
-
-	/* Wait for cmdcode 1 */
-	in_smadata2plus_level1_cmdcode_wait(inv, &recv_pl1, &recv_pl2,
-										SMADATA2PLUS_L1_CMDCODE_LEVEL2);
-
-	/* Read serial and model */
-	buffer_reverse(recv_pl2.src, 6);
-	memcpy(&inv->serial, recv_pl2.src + 2, 4);
-	in_smadata2plus_get_model(inv, recv_pl2.src);
-	buffer_reverse(recv_pl2.src, 6);
-
-	INFO("[Value] Inverter found serial=%d model=%s", inv->serial, inv->model->name);
-
-	/** Sent second L2 packet*/
-	in_smadata2plus_level1_clear(&sent_pl1);
-	in_smadata2plus_level2_clear(&sent_pl2);
-
-	/* Set cmdcode */
-	sent_pl1.cmd_code = SMADATA2PLUS_L1_CMDCODE_LEVEL2;
-	/* Set destination */
-	buffer_repeat(sent_pl1.dest, 0xff, 6);
-	/* Set my address */
-	in_bluetooth_get_my_address(inv, sent_pl1.src);
-	/* Set Layer 2 */
-	sent_pl2.ctrl1 = 0x08;
-	sent_pl2.ctrl2 = 0xa0;
-	sent_pl2.zero = 0x03;
-	sent_pl2.c = 0x03;
-	/* Set L2 Content */
-
 	unsigned char content_packet_two[] = {0x80, 0x0E, 0x01, 0xFD, 0xFF, 0xFF,
 										  0xFF, 0xFF, 0xFF};
-	memcpy(sent_pl2.content, content_packet_two, sizeof(content_packet_two));
-	sent_pl2.content_length = sizeof(content_packet_two);
-	/* Generate L2 Paket */
-	sent_pl1.length = in_smadata2plus_level2_packet_gen(inv, sent_pl1.content,
-														&sent_pl2);
-	sent_pl1.length += SMADATA2PLUS_L1_HEADER_LEN;
-	/* Send Packet out */
-	in_smadata2plus_level1_packet_send(inv, &sent_pl1);
+
+	in_smadata2plus_level2_clear(p2);
+	if (step == 1)
+	{
+		p2->ctrl1 = 0x09;
+		p2->ctrl2 = 0xa0;
+		memcpy(p2->content, content_packet_one, sizeof(content_packet_one));
+		p2->content_length = sizeof(content_packet_one);
+	}
+	else
+	{
+		p2->ctrl1 = 0x08;
+		p2->ctrl2 = 0xa0;
+		p2->zero = 0x03;
+		p2->c = 0x03;
+		memcpy(p2->content, content_packet_two, sizeof(content_packet_two));
+		p2->content_length = sizeof(content_packet_two);
+	}
 }
 
-void in_smadata2plus_login(struct bluetooth_inverter *inv)
+/* Read serial and model from the answer to init packet 1 */
+void in_smadata2plus_identify(struct bluetooth_inverter *inv, struct smadata2_l2_packet *reply)
 {
+	unsigned char src[6];
 
-	/* Intizalize packet structs */
-	struct smadata2_l1_packet recv_pl1 = {0};
-	struct smadata2_l2_packet recv_pl2 = {{0}};
-	struct smadata2_l1_packet sent_pl1 = {0};
-	struct smadata2_l2_packet sent_pl2 = {{0}};
+	memcpy(src, reply->src, 6);
+	buffer_reverse(src, 6);
+	memcpy(&inv->serial, src + 2, 4);
+	in_smadata2plus_get_model(inv, src);
 
-	/** Sent second L2 login packet*/
-	in_smadata2plus_level1_clear(&sent_pl1);
-	in_smadata2plus_level2_clear(&sent_pl2);
-	/* Set cmdcode */
-	sent_pl1.cmd_code = SMADATA2PLUS_L1_CMDCODE_LEVEL2;
-	/* Set destination */
-	buffer_repeat(sent_pl1.dest, 0xff, 6);
-	/* Set my address */
-	in_bluetooth_get_my_address(inv, sent_pl1.src);
+	INFO("[Value] Inverter found serial=%d model=%s", inv->serial, inv->model->name);
+}
+
+void in_smadata2plus_login_packet(struct bluetooth_inverter *inv, struct smadata2_l2_packet *p2)
+{
+	in_smadata2plus_level2_clear(p2);
 	/* Set Layer 2 */
-	sent_pl2.ctrl1 = 0x0e;
-	sent_pl2.ctrl2 = 0xa0;
-	sent_pl2.zero = 0x01;
-	sent_pl2.c = 0x01;
+	p2->ctrl1 = 0x0e;
+	p2->ctrl2 = 0xa0;
+	p2->zero = 0x01;
+	p2->c = 0x01;
 	/* Set L2 Content */
 	unsigned char content_packet_login[21] = {0x80, 0x0C, 0x04, 0xFD, 0xFF,
 											  0x07, 0x00, 0x00, 0x00, 0x84, 0x03, 0x00, 0x00, 0xaa, 0xaa, 0xbb,
 											  0xbb, 0x00, 0x00, 0x00, 0x00};
-	memcpy(sent_pl2.content, content_packet_login,
+	memcpy(p2->content, content_packet_login,
 		   sizeof(content_packet_login));
-	sent_pl2.content_length = sizeof(content_packet_login);
+	p2->content_length = sizeof(content_packet_login);
 	/* Adding Password */
 	int i = 0, j = 0;
 	unsigned char passwd_char;
@@ -982,179 +1169,820 @@ void in_smadata2plus_login(struct bluetooth_inverter *inv)
 
 		/* As soon as first null byte write only null bytes */
 		if (inv->password[j] == 0x00)
-			sent_pl2.content[sent_pl2.content_length] = 0x00 + 0x88;
+			p2->content[p2->content_length] = 0x00 + 0x88;
 		else
 		{
 			passwd_char = inv->password[j];
-			sent_pl2.content[sent_pl2.content_length] = ((passwd_char + 0x88) % 0xff);
+			p2->content[p2->content_length] = ((passwd_char + 0x88) % 0xff);
 			j++;
 		}
-		sent_pl2.content_length++;
+		p2->content_length++;
 	}
+}
 
-	/* Generate L2 Paket */
-	sent_pl1.length = in_smadata2plus_level2_packet_gen(inv, sent_pl1.content,
-														&sent_pl2);
-	sent_pl1.length += SMADATA2PLUS_L1_HEADER_LEN;
-	/* Send Packet out */
+static_assert(sizeof(SMADATA2PLUS_QUERIES) / sizeof(struct smadata2_query) <= SMADATA2_MAX_QUERIES,
+			  "query timings don't fit the session");
+
+unsigned int in_smadata2plus_query_count()
+{
+	return sizeof(SMADATA2PLUS_QUERIES) / sizeof(struct smadata2_query);
+}
+
+const struct smadata2_query *in_smadata2plus_query(unsigned int pos)
+{
+	return pos < in_smadata2plus_query_count() ? &SMADATA2PLUS_QUERIES[pos] : NULL;
+}
+
+const char *in_smadata2plus_query_name(unsigned int pos)
+{
+	return pos < in_smadata2plus_query_count() ? SMADATA2PLUS_QUERIES[pos].q_name : NULL;
+}
+
+/* Monotonic msec, for the session timings */
+int64_t in_smadata2plus_millis()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Next query to send in this cycle starting at *pos, NULL after the last */
+const struct smadata2_query *in_smadata2plus_next_query(unsigned int *pos, unsigned int cycle,
+														 const struct smadata2_model *model)
+{
+	while (*pos < sizeof(SMADATA2PLUS_QUERIES) / sizeof(struct smadata2_query))
+	{
+		const struct smadata2_query *query = &SMADATA2PLUS_QUERIES[(*pos)++];
+		if (query->q_every > 1 && cycle % query->q_every != (unsigned int)query->q_phase)
+			continue;
+		if (model != NULL && !(model->queries & (1u << (*pos - 1))))
+			continue;
+		return query;
+	}
+	return NULL;
+}
+
+void in_smadata2plus_query_packet(const struct smadata2_query *query, struct smadata2_l2_packet *p2)
+{
+	in_smadata2plus_level2_clear(p2);
+	/* Set Layer 2 */
+	p2->ctrl1 = query->q_ctrl1;
+	p2->ctrl2 = query->q_ctrl2;
+	p2->archcd = query->q_archcd;
+	p2->zero = query->q_zero;
+	p2->c = query->q_c;
+	/* Set L2 Content */
+	memcpy(p2->content, query->q_content, query->q_content_length);
+	p2->content_length = query->q_content_length;
+}
+
+
+/* L2 part of a query request. It is the same for every session but for the
+ * packet counter, so it is built once : the escaped bytes before and after
+ * the counter, and the frame check sequence up to the counter */
+struct smadata2_query_frame
+{
+	unsigned char head[64];
+	int head_len;
+	unsigned char tail[2 * sizeof(((struct smadata2_query *)0)->q_content)];
+	int tail_len;
+	u_int16_t fcs;
+};
+
+/* Copy len bytes to out with escapes, returns the length written */
+static int in_smadata2plus_level2_escape(unsigned char *out, const unsigned char *in, int len)
+{
+	int n = 0;
+
+	for (int i = 0; i < len; i++)
+	{
+		switch (in[i])
+		{
+		case 0x7d:
+		case 0x7e:
+		case 0x11:
+		case 0x12:
+		case 0x13:
+			out[n++] = 0x7d;
+			out[n++] = in[i] ^ 0x20;
+			break;
+		default:
+			out[n++] = in[i];
+		}
+	}
+	return n;
+}
+
+/* Lay out every query with level2_packet_gen once and split it at the
+ * counter */
+static vector<struct smadata2_query_frame> in_smadata2plus_build_query_frames()
+{
+	static struct bluetooth_inverter inv;
+	static struct smadata2_l2_packet p2;
+	static unsigned char buffer[BUFSIZ];
+	/* start byte, header, ctrl, destination, archcd, source, c and zeros */
+	const int counter_pos = 1 + sizeof(SMADATA2PLUS_L2_HEADER) + 2 + 6 + 2 + 6 + 2 + 4;
+	vector<struct smadata2_query_frame> frames(in_smadata2plus_query_count());
+
+	for (unsigned int i = 0; i < frames.size(); i++)
+	{
+		struct smadata2_query_frame &f = frames[i];
+		const struct smadata2_query *query = &SMADATA2PLUS_QUERIES[i];
+
+		in_smadata2plus_query_packet(query, &p2);
+		int len = in_smadata2plus_level2_packet_gen(&inv, buffer, &p2);
+		in_smadata2plus_level2_strip_escapes(buffer, &len);
+
+		f.head[0] = SMADATA2PLUS_STARTBYTE;
+		f.head_len = 1 + in_smadata2plus_level2_escape(f.head + 1, buffer + 1, counter_pos - 1);
+		f.fcs = in_smadata2plus_level2_pppfcs16(SMADATA2PLUS_L2_INIT_FCS16, buffer + 1, counter_pos - 1);
+		f.tail_len = in_smadata2plus_level2_escape(f.tail, query->q_content, query->q_content_length);
+	}
+	return frames;
+}
+
+/* Ready to send L1 frame of a query, the packet counter and frame check
+ * sequence are the only bytes done per request. Returns the length */
+int in_smadata2plus_query_frame(struct bluetooth_inverter *inv, const struct smadata2_query *query,
+								unsigned char *frame)
+{
+	static const vector<struct smadata2_query_frame> frames = in_smadata2plus_build_query_frames();
+	const struct smadata2_query_frame &f = frames[query - SMADATA2PLUS_QUERIES];
+	unsigned char counter = inv->l2_packet_send_count++;
+	int len = SMADATA2PLUS_L1_HEADER_LEN;
+
+	/* FCS from the cached header on */
+	u_int16_t fcs = in_smadata2plus_level2_pppfcs16(f.fcs, &counter, 1);
+	fcs = in_smadata2plus_level2_pppfcs16(fcs, (void *)query->q_content, query->q_content_length);
+	fcs ^= 0xffff;
+	unsigned char checksum[2] = {(unsigned char)(fcs & 0xff), (unsigned char)(fcs >> 8)};
+
+	memcpy(frame, inv->l1_request, SMADATA2PLUS_L1_HEADER_LEN);
+	memcpy(frame + len, f.head, f.head_len);
+	len += f.head_len;
+	len += in_smadata2plus_level2_escape(frame + len, &counter, 1);
+	memcpy(frame + len, f.tail, f.tail_len);
+	len += f.tail_len;
+	len += in_smadata2plus_level2_escape(frame + len, checksum, 2);
+	frame[len++] = SMADATA2PLUS_STARTBYTE;
+
+	frame[1] = len & 0xff;
+	frame[2] = len >> 8;
+	frame[3] = SMADATA2PLUS_STARTBYTE ^ frame[1] ^ frame[2];
+	return len;
+}
+
+/* Send a query in one write */
+void in_smadata2plus_query_send(struct bluetooth_inverter *inv, const struct smadata2_query *query)
+{
+	unsigned char frame[SMADATA2PLUS_L1_HEADER_LEN + sizeof(((struct smadata2_query_frame *)0)->head) +
+						sizeof(((struct smadata2_query_frame *)0)->tail) + 8];
+
+	in_bluetooth_write(inv, frame, in_smadata2plus_query_frame(inv, query, frame));
+}
+
+/* Handshake up to the identification, -1 when the inverter didn't answer */
+int in_smadata2plus_connect(struct bluetooth_inverter *inv)
+{
+
+	/* Intizalize packet structs */
+	struct smadata2_l1_packet recv_pl1 = {0};
+	struct smadata2_l2_packet recv_pl2 = {{0}};
+	struct smadata2_l1_packet sent_pl1 = {0};
+	struct smadata2_l2_packet sent_pl2 = {{0}};
+
+	/* Wait for Broadcast request */
+	if (in_smadata2plus_level1_cmdcode_wait(inv, &recv_pl1, NULL, SMADATA2PLUS_L1_CMDCODE_BROADCAST) < 0)
+		return -1;
+
+	/* Answer broadcast */
+	in_smadata2plus_broadcast_reply(inv, &recv_pl1, &sent_pl1);
+	in_smadata2plus_level1_packet_send(inv, &sent_pl1);
+
+	/* Wait for cmdcode 10 */
+	if (in_smadata2plus_level1_cmdcode_wait(inv, &recv_pl1, NULL, SMADATA2PLUS_L1_CMDCODE_10) < 0)
+		return -1;
+
+	/* Wait for cmdcode 5 */
+	if (in_smadata2plus_level1_cmdcode_wait(inv, &recv_pl1, NULL, SMADATA2PLUS_L1_CMDCODE_5) < 0)
+		return -1;
+
+	/** Sent first L2 packet*/
+	in_smadata2plus_init_packet(1, &sent_pl2);
+	in_smadata2plus_level2_request(inv, &sent_pl1, &sent_pl2);
+	in_smadata2plus_level1_packet_send(inv, &sent_pl1);
+
+	/* Wait for cmdcode 1 */
+	if (in_smadata2plus_level1_cmdcode_wait(inv, &recv_pl1, &recv_pl2, SMADATA2PLUS_L1_CMDCODE_LEVEL2) < 0)
+		return -1;
+
+	/* Read serial and model */
+	in_smadata2plus_identify(inv, &recv_pl2);
+
+	/** Sent second L2 packet*/
+	in_smadata2plus_init_packet(2, &sent_pl2);
+	in_smadata2plus_level2_request(inv, &sent_pl1, &sent_pl2);
+	in_smadata2plus_level1_packet_send(inv, &sent_pl1);
+	return 0;
+}
+
+/* -1 when the inverter didn't answer */
+int in_smadata2plus_login(struct bluetooth_inverter *inv)
+{
+
+	/* Intizalize packet structs */
+	struct smadata2_l1_packet recv_pl1 = {0};
+	struct smadata2_l2_packet recv_pl2 = {{0}};
+	struct smadata2_l1_packet sent_pl1 = {0};
+	struct smadata2_l2_packet sent_pl2 = {{0}};
+
+	/** Sent second L2 login packet*/
+	in_smadata2plus_login_packet(inv, &sent_pl2);
+	in_smadata2plus_level2_request(inv, &sent_pl1, &sent_pl2);
 	in_smadata2plus_level1_packet_send(inv, &sent_pl1);
 
 	/* Wait for cmdcode 1 */
-	in_smadata2plus_level1_cmdcode_wait(inv, &recv_pl1, &recv_pl2,
-										SMADATA2PLUS_L1_CMDCODE_LEVEL2);
+	if (in_smadata2plus_level1_cmdcode_wait(inv, &recv_pl1, &recv_pl2, SMADATA2PLUS_L1_CMDCODE_LEVEL2) < 0)
+		return -1;
+	return 0;
+}
+
+/* Check for the NaN markers, on 32 or 64 bits depending on the value length */
+static bool in_smadata2plus_value_is_nan(struct smadata2_l2_packet *p2, struct smadata2_value *value)
+{
+	if (value->r_value_len > 4)
+	{
+		unsigned long long raw64 = 0;
+		memcpy(&raw64, p2->content + value->r_value_pos, 8);
+		return raw64 == SMADATA2PLUS_NAN_S64 || raw64 == SMADATA2PLUS_NAN_U64;
+	}
+
+	/* Values are transferred as 4 bytes even if only 3 are used */
+	if (p2->content_length < value->r_value_pos + 4)
+		return false;
+	u_int32_t raw32;
+	memcpy(&raw32, p2->content + value->r_value_pos, 4);
+	return raw32 == SMADATA2PLUS_NAN_S32 || raw32 == SMADATA2PLUS_NAN_U32;
+}
+
+/* Position of the record of value->lri in a response, -1 if it isn't there.
+ * The response holds records first..last, all of the same size */
+static int in_smadata2plus_find_record(struct smadata2_l2_packet *p2, struct smadata2_value *value)
+{
+	u_int32_t first, last, code;
+
+	if (p2->content_length < SMADATA2PLUS_SPOT_RECORD_POS)
+		return -1;
+	memcpy(&first, p2->content + 4, 4);
+	memcpy(&last, p2->content + 8, 4);
+	/* more records than bytes is a broken response */
+	if (last < first || last - first >= (u_int32_t)p2->content_length)
+		return -1;
+	int size = 4 * (p2->ctrl1 - 9) / (int)(last - first + 1);
+	if (size < 12)
+		return -1;
+
+	for (int pos = SMADATA2PLUS_SPOT_RECORD_POS; pos + size <= p2->content_length; pos += size)
+	{
+		memcpy(&code, p2->content + pos, 4);
+		if ((code & SMADATA2PLUS_LRI_MASK) == value->lri &&
+			(value->lri_class == 0 || (code & SMADATA2PLUS_LRI_CLASS_MASK) == value->lri_class))
+			return pos;
+	}
+	return -1;
+}
+
+/* A status value is a list of tags, the one with bit 24 set is active */
+static bool in_smadata2plus_status_value(struct smadata2_l2_packet *p2, struct smadata2_value *value,
+										 long long *status)
+{
+	u_int32_t tag;
+
+	for (int i = 0; i < SMADATA2PLUS_STATUS_TAGS; i++)
+	{
+		int pos = value->r_value_pos + 4 * i;
+		if (pos + 4 > p2->content_length)
+			break;
+		memcpy(&tag, p2->content + pos, 4);
+		if (tag == SMADATA2PLUS_STATUS_END)
+			break;
+		if ((tag >> 24) == 1)
+		{
+			*status = tag & 0x00ffffff;
+			return true;
+		}
+	}
+	return false;
 }
 
-void in_smadata2plus_parse_values(struct smadata2_l1_packet *p1, struct smadata2_l2_packet *p2, struct smadata2_query *query, vector<vec_data> &data_vector)
+void in_smadata2plus_parse_values(struct smadata2_l1_packet *p1, struct smadata2_l2_packet *p2, const struct smadata2_query *query,
+								  vector<vec_data> &data_vector, struct smadata2_stats *stats)
 {
 
-	struct smadata2_value *value;
+	struct smadata2_value value;
 
 	int max = 0;
 
+	/* check if matches */
+	if ((query->r_ctrl1 != 0 && p2->ctrl1 != query->r_ctrl1) || p2->ctrl2 != query->r_ctrl2)
+		return;
+
 	for (int value_pos = 0; value_pos < query->value_count; ++value_pos)
 	{
-		vec_data vec_data_temp = {{0}};
+		value = query->values[value_pos];
 
-		value = &(query->values[value_pos]);
+		/* Records looked up by lri : lri, timestamp, value */
+		if (value.lri)
+		{
+			int pos = in_smadata2plus_find_record(p2, &value);
+			if (pos < 0)
+			{
+				DEBUG("[Value] %s not in response", SMADATA2PLUS_REGISTERS[value.id].name);
+				continue;
+			}
+			value.r_timestamp_pos = pos + 4;
+			value.r_value_pos = pos + 8;
+		}
 
 		/* Search for last position in content */
-		if ((value->r_value_pos + value->r_value_len) > value->r_timestamp_pos + 4)
+		if ((value.r_value_pos + value.r_value_len) > value.r_timestamp_pos + 4)
 		{
-			max = (value->r_value_pos + value->r_value_len);
+			max = (value.r_value_pos + value.r_value_len);
 		}
 		else
 		{
-			max = value->r_timestamp_pos + 4;
+			max = value.r_timestamp_pos + 4;
 		}
+		if (p2->content_length < max)
+			continue;
 
-		/* check if matches */
-		if (p2->ctrl1 == query->r_ctrl1 && p2->ctrl2 == query->r_ctrl2 && p2->content_length >= max)
-		{
-
-			/* copy time stamp */
-			memcpy(&value->timestamp, p2->content + value->r_timestamp_pos, 4);
-			/* copy value */
-			memcpy(&value->value, p2->content + value->r_value_pos, value->r_value_len);
+		vec_data vec_data_temp = {value.id, 0, 0};
+		/* copy time stamp */
+		memcpy(&vec_data_temp.timestamp, p2->content + value.r_timestamp_pos, 4);
 
-			vec_data_temp.name = value->name;
-			vec_data_temp.units = value->unit;
-			if ((float)((int)value->factor) == value->factor)
-			{
-				/* Ganzzahl */
-				/// REMOVE printf("[Value] timestamp=%d %s=%ld%s\n", value->timestamp, value->name, value->value, value->unit);
-				vec_data_temp.value = float(value->value);
-			}
-			else
+		if (value.r_value_len == SMADATA2PLUS_VALUE_STATUS)
+		{
+			if (!in_smadata2plus_status_value(p2, &value, &vec_data_temp.value))
 			{
-				/* Float */
-				double value_double = ((double)value->value) * ((double)value->factor);
-
-				/* Decide how many after decimals */
-				/* int after_dec_point = 0;
-				if (value->factor == 0.1)
-					after_dec_point = 1;
-				else if (value->factor == 0.01)
-					after_dec_point = 2;
-				else if (value->factor == 0.001)
-					after_dec_point = 3;
-				else
-					after_dec_point = 3;*/
-
-				/// REMOVE printf("[Value] timestamp=%d %s=%.*lf%s\n", value->timestamp, value->name, after_dec_point, value_double, value->unit);
-				vec_data_temp.value = float(value_double);
+				if (stats)
+					stats[value.id].nan++;
+				continue;
 			}
-
 			data_vector.push_back(vec_data_temp);
+			continue;
 		}
+
+		/* Skip SMA NaN markers, these are checked on the full word */
+		if (in_smadata2plus_value_is_nan(p2, &value))
+		{
+			if (stats)
+				stats[value.id].nan++;
+			DEBUG("[Value] %s not available", SMADATA2PLUS_REGISTERS[value.id].name);
+			continue;
+		}
+
+		/* copy value */
+		memcpy(&vec_data_temp.value, p2->content + value.r_value_pos, value.r_value_len);
+		/* 32 bit lri values are signed, e.g. temperatures */
+		if (value.lri && value.r_value_len == 4)
+			vec_data_temp.value = (int32_t)vec_data_temp.value;
+
+		data_vector.push_back(vec_data_temp);
 	}
 }
 
-/* Get model */
-void in_smadata2plus_get_model(struct bluetooth_inverter *inv, unsigned char *model_code)
+static bool in_smadata2plus_model_has(const struct smadata2_model *model, int id);
+
+/* Drop the queries of which the model has none of the registers, e.g. the
+ * second DC input of a single string model */
+static void in_smadata2plus_profile_queries(struct smadata2_model *model)
+{
+	for (unsigned int q = 0; q < in_smadata2plus_query_count(); ++q)
+	{
+		const struct smadata2_query *query = &SMADATA2PLUS_QUERIES[q];
+		bool used = false;
+		for (int v = 0; v < query->value_count; ++v)
+			used |= in_smadata2plus_model_has(model, query->values[v].id);
+		if (!used)
+			model->queries &= ~(1u << q);
+	}
+}
+
+static unordered_map<unsigned short, const struct smadata2_model *> in_smadata2plus_index_models(
+	vector<struct smadata2_model> &models, vector<struct smadata2_model> &shared)
 {
-	unsigned int model_pos;
-	struct smadata2_model *model;
+	unordered_map<unsigned short, const struct smadata2_model *> index;
+	unordered_map<unsigned short, size_t> profile;
 
-	for (model_pos = 0;
-		 model_pos < (sizeof(SMADATA2MODELS) / sizeof(struct smadata2_model));
-		 ++model_pos)
+	/* the shared profiles are complete before index points into them */
+	shared.clear();
+	for (size_t i = 0; i < models.size(); ++i)
 	{
+		in_smadata2plus_profile_queries(&models[i]);
+		auto first = find_if(models.begin(), models.begin() + i, [&](const struct smadata2_model &m)
+							 { return m.susyid == models[i].susyid; });
+		if (first == models.begin() + i)
+			continue;
+		if (profile.count(models[i].susyid) == 0)
+		{
+			profile[models[i].susyid] = shared.size();
+			shared.push_back(*first);
+			snprintf(shared.back().name, sizeof(shared.back().name), "device type %04x", models[i].susyid);
+		}
+		struct smadata2_model &union_of = shared[profile[models[i].susyid]];
+		union_of.max_power = max(union_of.max_power, models[i].max_power);
+		union_of.phases = max(union_of.phases, models[i].phases);
+		union_of.strings = max(union_of.strings, models[i].strings);
+		union_of.queries |= models[i].queries;
+	}
 
-		model = &SMADATA2MODELS[model_pos];
+	for (size_t i = 0; i < models.size(); ++i)
+		index[models[i].susyid] = &models[i];
+	for (auto &it : profile)
+		index[it.first] = &shared[it.second];
+	return index;
+}
+
+/* Query positions from a list of query names separated by ',', "-" for
+ * none. ~0 when a name is unknown */
+static unsigned int in_smadata2plus_query_mask(char *names)
+{
+	unsigned int mask = 0;
+	if (strcmp(names, "-") == 0)
+		return mask;
+	for (char *name = strtok(names, ","); name != NULL; name = strtok(NULL, ","))
+	{
+		unsigned int q = 0;
+		while (q < in_smadata2plus_query_count() && strcmp(SMADATA2PLUS_QUERIES[q].q_name, name) != 0)
+			++q;
+		if (q == in_smadata2plus_query_count())
+			return ~0u;
+		mask |= 1u << q;
+	}
+	return mask;
+}
+
+/* Load the model table, one model per line :
+ *   <susyid> <max power> <phases> <strings> <skipped queries> <name>
+ * '#' starts a comment. Replaces the built in table, returns the number of
+ * models or -1 when the file can't be read. Not thread safe, call it before
+ * any session starts */
+int in_smadata2plus_load_models(const char *path)
+{
+	char line[256];
+	char skip[128];
+	vector<struct smadata2_model> models;
+	int line_no = 0;
+
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+	{
+		WARN("[Model] cannot read %s, using %u built in models", path, (unsigned)SMADATA2MODELS.size());
+		return -1;
+	}
 
-		if (memcmp(model->code, model_code, 2) == 0)
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		struct smadata2_model model = {0};
+		unsigned int susyid, skipped = ~0u;
+		int name_pos = 0;
+
+		line_no++;
+		line[strcspn(line, "#\r\n")] = 0;
+		if (line[strspn(line, " \t")] == 0)
+			continue;
+		if (sscanf(line, "%x %d %d %d %127s %n", &susyid, &model.max_power, &model.phases, &model.strings, skip,
+				   &name_pos) == 5)
+			skipped = in_smadata2plus_query_mask(skip);
+		if (name_pos == 0 || susyid > 0xffff || skipped == ~0u)
 		{
-			/* Set model ptr */
-			inv->model = model;
+			WARN("[Model] %s:%d malformed, ignored", path, line_no);
+			continue;
 		}
+		model.susyid = susyid;
+		model.queries = SMADATA2_ALL_QUERIES & ~skipped;
+		strncpy(model.name, line + name_pos, sizeof(model.name) - 1);
+		models.push_back(model);
+	}
+	fclose(f);
+
+	SMADATA2MODELS = models;
+	SMADATA2MODEL_INDEX = in_smadata2plus_index_models(SMADATA2MODELS, SMADATA2MODEL_SHARED);
+	INFO("[Model] %u models from %s", (unsigned)SMADATA2MODELS.size(), path);
+	return SMADATA2MODELS.size();
+}
+
+/* Get model, by the device type code in the first two bytes of the address */
+void in_smadata2plus_get_model(struct bluetooth_inverter *inv, unsigned char *model_code)
+{
+	unsigned short susyid = model_code[0] + model_code[1] * 256;
+
+	auto it = SMADATA2MODEL_INDEX.find(susyid);
+	if (it == SMADATA2MODEL_INDEX.end())
+	{
+		WARN("[Model] unknown device type %04x, using default limits", susyid);
+		inv->model = &SMADATA2MODEL_UNKNOWN;
+		return;
+	}
+	inv->model = it->second;
+}
+
+/* Pick the model of a shared device type code by the nominal power the
+ * inverter reports : the smallest model that reaches it, a feed-in limit
+ * can keep it below the model's own */
+void in_smadata2plus_refine_model(struct bluetooth_inverter *inv, const vector<vec_data> &data_vector)
+{
+	double nominal = 0;
+	const struct smadata2_model *best = NULL;
+
+	if (inv->model < SMADATA2MODEL_SHARED.data() || inv->model >= SMADATA2MODEL_SHARED.data() + SMADATA2MODEL_SHARED.size())
+		return;
+	for (auto &data : data_vector)
+	{
+		if (data.id == SMADATA2PLUS_REG_POWER_AC_MAX_L1 || data.id == SMADATA2PLUS_REG_POWER_AC_MAX_L2 ||
+			data.id == SMADATA2PLUS_REG_POWER_AC_MAX_L3)
+			nominal += in_smadata2plus_value(data);
 	}
+	if (nominal <= 0)
+		return;
+	for (auto &model : SMADATA2MODELS)
+	{
+		if (model.susyid == inv->model->susyid && model.max_power >= nominal &&
+			(best == NULL || model.max_power < best->max_power))
+			best = &model;
+	}
+	if (best == NULL)
+		return;
+	DEBUG("[Model] %s at %.0f W nominal", best->name, nominal);
+	inv->model = best;
 }
 
-void in_smadata2plus_get_values(struct bluetooth_inverter *inv, vector<vec_data> &data_vector)
+/* Query the spot values, -1 when a response didn't come */
+int in_smadata2plus_get_values(struct bluetooth_inverter *inv, vector<vec_data> &data_vector,
+							   unsigned int cycle)
 {
 
 	/* Packet Structs */
 	struct smadata2_l1_packet recv_pl1 = {0};
 	struct smadata2_l2_packet recv_pl2 = {{0}};
-	struct smadata2_l1_packet sent_pl1 = {0};
-	struct smadata2_l2_packet sent_pl2 = {{0}};
 
-	struct smadata2_query *value;
+	const struct smadata2_query *value;
+	unsigned int value_pos = 0;
 
-	for (unsigned int value_pos = 0; value_pos < (sizeof(SMADATA2PLUS_QUERIES) / sizeof(struct smadata2_query)); ++value_pos)
+	for (int i = 0; i < SMADATA2_MAX_QUERIES; i++)
+		inv->query_ms[i] = -1;
+	while ((value = in_smadata2plus_next_query(&value_pos, cycle, inv->model)) != NULL)
 	{
-
-		value = &SMADATA2PLUS_QUERIES[value_pos];
-
-		in_smadata2plus_level1_clear(&sent_pl1);
-		in_smadata2plus_level2_clear(&sent_pl2);
-
-		/* Set cmdcode */
-		sent_pl1.cmd_code = SMADATA2PLUS_L1_CMDCODE_LEVEL2;
-		/* Set destination */
-		buffer_repeat(sent_pl1.dest, 0xff, 6);
-		/* Set my address */
-		in_bluetooth_get_my_address(inv, sent_pl1.src);
-		/* Set Layer 2 */
-		sent_pl2.ctrl1 = value->q_ctrl1;
-		sent_pl2.ctrl2 = value->q_ctrl2;
-		sent_pl2.archcd = value->q_archcd;
-		sent_pl2.zero = value->q_zero;
-		sent_pl2.c = value->q_c;
-		/* Set L2 Content */
-		memcpy(sent_pl2.content, value->q_content, value->q_content_length);
-		sent_pl2.content_length = value->q_content_length;
-		/* Generate L2 Paket */
-		sent_pl1.length = in_smadata2plus_level2_packet_gen(inv,
-															sent_pl1.content, &sent_pl2);
-		sent_pl1.length += SMADATA2PLUS_L1_HEADER_LEN;
+		int64_t sent = in_smadata2plus_millis();
+		int64_t traced = inv->trace ? FlightRecorder::now() : 0;
 		/* Send Packet out */
-		in_smadata2plus_level1_packet_send(inv, &sent_pl1);
+		in_smadata2plus_query_send(inv, value);
 
 		/* Wait for answer */
-		in_smadata2plus_level1_cmdcode_wait(inv, &recv_pl1, &recv_pl2, SMADATA2PLUS_L1_CMDCODE_LEVEL2);
+		if (in_smadata2plus_level1_cmdcode_wait(inv, &recv_pl1, &recv_pl2, SMADATA2PLUS_L1_CMDCODE_LEVEL2) < 0)
+			return -1;
+		inv->query_ms[value_pos - 1] = in_smadata2plus_millis() - sent;
+		if (inv->trace)
+			inv->trace->add(value->q_name, traced, FlightRecorder::now());
 
 		/* Parse L2 Content */
-		in_smadata2plus_parse_values(&recv_pl1, &recv_pl2, value, data_vector);
+		in_smadata2plus_parse_values(&recv_pl1, &recv_pl2, value, data_vector, inv->stats);
+	}
+
+	in_smadata2plus_refine_model(inv, data_vector);
+	in_smadata2plus_validate_values(data_vector, inv->model, inv->stats);
+	return 0;
+}
+
+/* L2 request of an archive or event log query for from..to */
+void in_smadata2plus_archive_packet(unsigned int command, time_t from, time_t to, struct smadata2_l2_packet *p2)
+{
+	u_int32_t words[3] = {command, (u_int32_t)from, (u_int32_t)to};
+
+	in_smadata2plus_level2_clear(p2);
+	/* Set Layer 2 */
+	p2->ctrl1 = 0x09;
+	p2->ctrl2 = 0xe0;
+	/* Set L2 Content : command, from, to */
+	p2->content[0] = 0x80;
+	memcpy(p2->content + 1, words, sizeof(words));
+	p2->content_length = 1 + sizeof(words);
+}
+
+/* Record length of the response to an archive or event log query */
+int in_smadata2plus_archive_record_len(unsigned int command)
+{
+	if (command == SMADATA2PLUS_EVENTS_USER || command == SMADATA2PLUS_EVENTS_INSTALLER)
+		return SMADATA2PLUS_EVENT_RECORD_LEN;
+	return SMADATA2PLUS_ARCHIVE_RECORD_LEN;
+}
+
+/* Append the records of one L2 packet of an archive response to raw. The
+ * response is spread over several packets, fragment counts down to 0 on
+ * the last one. Returns the number of records, -1 on an error response */
+int in_smadata2plus_archive_collect(unsigned int command, struct smadata2_l2_packet *p2,
+									vector<unsigned char> &raw)
+{
+	int record_len = in_smadata2plus_archive_record_len(command);
+	int count = 0;
+
+	if (p2->error != 0)
+	{
+		WARN("[Archive] %08x failed with error %d", command, p2->error);
+		return -1;
+	}
+	for (int pos = SMADATA2PLUS_ARCHIVE_RECORD_POS; pos + record_len <= p2->content_length; pos += record_len)
+	{
+		raw.insert(raw.end(), p2->content + pos, p2->content + pos + record_len);
+		count++;
+	}
+	return count;
+}
+
+/* Send an archive query for from..to and collect the records of the
+ * response. Returns the number of records, -1 on an error response or a
+ * lost link */
+static int in_smadata2plus_archive_query(struct bluetooth_inverter *inv, unsigned int command,
+										 time_t from, time_t to, vector<unsigned char> &raw)
+{
+	struct smadata2_l1_packet recv_pl1 = {0};
+	struct smadata2_l2_packet recv_pl2 = {{0}};
+	struct smadata2_l1_packet sent_pl1 = {0};
+	struct smadata2_l2_packet sent_pl2 = {{0}};
+	int count = 0;
+
+	in_smadata2plus_archive_packet(command, from, to, &sent_pl2);
+	in_smadata2plus_level2_request(inv, &sent_pl1, &sent_pl2);
+	/* Send Packet out */
+	in_smadata2plus_level1_packet_send(inv, &sent_pl1);
+
+	do
+	{
+		recv_pl2.content_length = 0;
+		if (in_smadata2plus_level1_cmdcode_wait(inv, &recv_pl1, &recv_pl2, SMADATA2PLUS_L1_CMDCODE_LEVEL2) < 0)
+			return -1;
+		int records = in_smadata2plus_archive_collect(command, &recv_pl2, raw);
+		if (records < 0)
+			return -1;
+		count += records;
+	} while (recv_pl2.fragment != 0);
+
+	DEBUG("[Archive] %08x from %ld to %ld : %d records", command, (long)from, (long)to, count);
+	return count;
+}
+
+/* Decode the archived total yield records of raw */
+void in_smadata2plus_archive_records(const vector<unsigned char> &raw, vector<smadata2_archive_record> &records)
+{
+	for (size_t i = 0; i + SMADATA2PLUS_ARCHIVE_RECORD_LEN <= raw.size(); i += SMADATA2PLUS_ARCHIVE_RECORD_LEN)
+	{
+		const unsigned char *p = &raw[i];
+		smadata2_archive_record record;
+		memcpy(&record.timestamp, p, 4);
+		memcpy(&record.value, p + 4, 8);
+		if (record.timestamp == 0 || (unsigned long long)record.value == SMADATA2PLUS_NAN_U64 ||
+			(unsigned long long)record.value == SMADATA2PLUS_NAN_S64)
+			continue;
+		records.push_back(record);
+	}
+}
+
+/* Decode the event log entries of raw. Entries are 48 bytes :
+ * time, entry, susyid, serial, code, flags, group, unknown, tag, counter,
+ * time of change, parameter, new value, old value */
+void in_smadata2plus_event_records(const vector<unsigned char> &raw, vector<smadata2_event_record> &events)
+{
+	for (size_t i = 0; i + SMADATA2PLUS_EVENT_RECORD_LEN <= raw.size(); i += SMADATA2PLUS_EVENT_RECORD_LEN)
+	{
+		const unsigned char *p = &raw[i];
+		smadata2_event_record event;
+		memcpy(&event.timestamp, p, 4);
+		memcpy(&event.entry, p + 4, 2);
+		memcpy(&event.susyid, p + 6, 2);
+		memcpy(&event.serial, p + 8, 4);
+		memcpy(&event.code, p + 12, 2);
+		memcpy(&event.flags, p + 14, 2);
+		memcpy(&event.group, p + 16, 4);
+		memcpy(&event.tag, p + 24, 4);
+		memcpy(&event.parameter, p + 36, 4);
+		memcpy(&event.new_value, p + 40, 4);
+		memcpy(&event.old_value, p + 44, 4);
+		if (event.timestamp == 0)
+			continue;
+		events.push_back(event);
 	}
 }
 
+/* Read archived total yield between from and to */
+int in_smadata2plus_get_archive(struct bluetooth_inverter *inv, unsigned int command,
+								time_t from, time_t to, vector<smadata2_archive_record> &records)
+{
+	vector<unsigned char> raw;
+	int count = in_smadata2plus_archive_query(inv, command, from, to, raw);
+	in_smadata2plus_archive_records(raw, records);
+	return count;
+}
+
+/* Read the event log between from and to */
+int in_smadata2plus_get_events(struct bluetooth_inverter *inv, unsigned int command,
+							   time_t from, time_t to, vector<smadata2_event_record> &events)
+{
+	vector<unsigned char> raw;
+	int count = in_smadata2plus_archive_query(inv, command, from, to, raw);
+	in_smadata2plus_event_records(raw, events);
+	return count;
+}
+
+/* False for the registers of a phase or DC input the model doesn't have */
+static bool in_smadata2plus_model_has(const struct smadata2_model *model, int id)
+{
+	for (size_t i = 0; i < sizeof(SMADATA2PLUS_REGISTER_PROFILE) / sizeof(SMADATA2PLUS_REGISTER_PROFILE[0]); ++i)
+	{
+		if (SMADATA2PLUS_REGISTER_PROFILE[i].id == id)
+			return SMADATA2PLUS_REGISTER_PROFILE[i].phase <= model->phases &&
+				   SMADATA2PLUS_REGISTER_PROFILE[i].string <= model->strings;
+	}
+	return true;
+}
+
+/* AC power can't be much above the nominal power of the model */
+static float in_smadata2plus_model_max(const struct smadata2_model *model, int id)
+{
+	float max = SMADATA2PLUS_REGISTERS[id].max;
+	if (model->max_power == 0)
+		return max;
+	if (id == SMADATA2PLUS_REG_POWER_AC)
+		return model->max_power * 1.1;
+	if (id == SMADATA2PLUS_REG_POWER_AC_L1 || id == SMADATA2PLUS_REG_POWER_AC_L2 || id == SMADATA2PLUS_REG_POWER_AC_L3)
+		return model->max_power * 1.1 / model->phases;
+	return max;
+}
+
+/* Drop values outside the limits of their register, or of the model when
+ * it is known */
+void in_smadata2plus_validate_values(vector<vec_data> &data_vector, const struct smadata2_model *model,
+									 struct smadata2_stats *stats)
+{
+	size_t out = 0;
+
+	if (model == NULL)
+		model = &SMADATA2MODEL_UNKNOWN;
+
+	for (size_t i = 0; i < data_vector.size(); ++i)
+	{
+		int id = data_vector[i].id;
+		if (!in_smadata2plus_model_has(model, id))
+			continue;
+		float v = in_smadata2plus_value(data_vector[i]);
+		bool valid = (v >= SMADATA2PLUS_REGISTERS[id].min) & (v <= in_smadata2plus_model_max(model, id));
+
+		if (!valid && stats)
+			WARN("[Value] %s=%f out of range, rejected %u times", SMADATA2PLUS_REGISTERS[id].name, v,
+				 ++stats[id].out_of_range);
+		else if (!valid)
+			WARN("[Value] %s=%f out of range", SMADATA2PLUS_REGISTERS[id].name, v);
+		else if (out != i)
+			data_vector[out] = data_vector[i];
+		out += valid;
+	}
+	data_vector.resize(out);
+}
+
+/* Find register id by name, -1 if unknown */
+int in_smadata2plus_register_id(const char *name)
+{
+	for (int id = 0; id < SMADATA2PLUS_REG_COUNT; ++id)
+	{
+		if (strcmp(SMADATA2PLUS_REGISTERS[id].name, name) == 0)
+			return id;
+	}
+	return -1;
+}
+
+/* Scaled value of a sample */
+double in_smadata2plus_value(const struct vec_data &data)
+{
+	return (double)data.value * SMADATA2PLUS_REGISTERS[data.id].factor;
+}
+
 void buffer_hex_dump(char *output, unsigned char *buffer, int len)
 {
 
-	char hex[14];
+	static const char digits[] = "0123456789abcdef";
 
+	/* "xx:" per byte, the last colon becomes the terminator : output
+	 * needs 3 * len bytes, at least 1 */
 	output[0] = '\0';
 
 	for (int i = 0; i < len; ++i)
 	{
-
-		sprintf(hex, "%02x:", buffer[i]);
-		strncat(output, hex, 3);
+		output[3 * i] = digits[buffer[i] >> 4];
+		output[3 * i + 1] = digits[buffer[i] & 0x0f];
+		output[3 * i + 2] = ':';
 	}
 
-	// remove last colon
-	output[strlen(output) - 1] = '\0';
+	if (len > 0)
+		output[3 * len - 1] = '\0';
 }
 
 void buffer_reverse(unsigned char *buffer, int len)
@@ -22,8 +22,11 @@
 #ifndef OPENSUNNY_IN_SMADATA2PLUS_H_
 #define OPENSUNNY_IN_SMADATA2PLUS_H_
 
+#include <stdint.h>
 #include <stdio.h>
+#include <time.h>
 #include <vector>
+#include <unordered_map>
 #include "in_bluetooth.h"
 #include <Log.h>
 
@@ -37,24 +40,115 @@
 #define SMADATA2PLUS_L1_CMDCODE_10 10  			// 0x000a
 #define SMADATA2PLUS_L1_CMDCODE_12 12  			// 0x000c
 
+#define SMADATA2PLUS_WAIT_TIMEOUT 5000			// msec for a response in blocking sessions
+
 #define SMADATA2PLUS_L2_INIT_FCS16 0xffff		// Initial FCS value
+#define SMADATA2PLUS_L2_MIN_LEN 32				// unescaped header, FCS and end byte
 
 #define SMADATA2PLUS_MAX_VALUES 64
 
+/* SMA markers for a value that is not available (e.g. DC side at night) */
+#define SMADATA2PLUS_NAN_S32 0x80000000UL
+#define SMADATA2PLUS_NAN_U32 0xFFFFFFFFUL
+#define SMADATA2PLUS_NAN_S64 0x8000000000000000ULL
+#define SMADATA2PLUS_NAN_U64 0xFFFFFFFFFFFFFFFFULL
+
+/* Archive queries, command words of the request */
+#define SMADATA2PLUS_ARCHIVE_DAY 0x70000200		/* 5 minute total yield */
+#define SMADATA2PLUS_ARCHIVE_MONTH 0x70200200	/* daily total yield */
+#define SMADATA2PLUS_ARCHIVE_RECORD_LEN 12
+#define SMADATA2PLUS_ARCHIVE_RECORD_POS 12
+#define SMADATA2PLUS_EVENTS_USER 0x70100200
+#define SMADATA2PLUS_EVENTS_INSTALLER 0x70120200
+#define SMADATA2PLUS_EVENT_RECORD_LEN 48
+
+/* Spot value records of a response : lri, timestamp, value */
+#define SMADATA2PLUS_SPOT_RECORD_POS 12
+#define SMADATA2PLUS_LRI_MASK 0x00ffff00
+#define SMADATA2PLUS_LRI_CLASS_MASK 0x000000ff
+/* r_value_len of a status value, a list of tags of which one is set */
+#define SMADATA2PLUS_VALUE_STATUS 0
+#define SMADATA2PLUS_STATUS_TAGS 8
+#define SMADATA2PLUS_STATUS_END 0x00fffffe
+
+/* Register ids, index into SMADATA2PLUS_REGISTERS and the session stats */
+enum smadata2_register {
+	SMADATA2PLUS_REG_POWER_AC = 0,
+	SMADATA2PLUS_REG_YIELD_TOTAL,
+	SMADATA2PLUS_REG_POWER_DC_1,
+	SMADATA2PLUS_REG_POWER_DC_2,
+	SMADATA2PLUS_REG_VOLTAGE_DC_1,
+	SMADATA2PLUS_REG_VOLTAGE_DC_2,
+	SMADATA2PLUS_REG_POWER_AC_MAX_L1,
+	SMADATA2PLUS_REG_POWER_AC_MAX_L2,
+	SMADATA2PLUS_REG_POWER_AC_MAX_L3,
+	SMADATA2PLUS_REG_POWER_AC_L1,
+	SMADATA2PLUS_REG_POWER_AC_L2,
+	SMADATA2PLUS_REG_POWER_AC_L3,
+	SMADATA2PLUS_REG_VOLTAGE_AC_L1,
+	SMADATA2PLUS_REG_VOLTAGE_AC_L2,
+	SMADATA2PLUS_REG_VOLTAGE_AC_L3,
+	SMADATA2PLUS_REG_CURRENT_AC_L1,
+	SMADATA2PLUS_REG_CURRENT_AC_L2,
+	SMADATA2PLUS_REG_CURRENT_AC_L3,
+	SMADATA2PLUS_REG_CURRENT_DC_1,
+	SMADATA2PLUS_REG_CURRENT_DC_2,
+	SMADATA2PLUS_REG_FREQUENCY,
+	SMADATA2PLUS_REG_YIELD_DAY,
+	SMADATA2PLUS_REG_OPERATING_TIME,
+	SMADATA2PLUS_REG_FEED_IN_TIME,
+	SMADATA2PLUS_REG_TEMPERATURE,
+	SMADATA2PLUS_REG_STATUS,
+	SMADATA2PLUS_REG_GRID_RELAY,
+	/* archive data, see in_smadata2plus_get_archive */
+	SMADATA2PLUS_REG_YIELD_5MIN,
+	SMADATA2PLUS_REG_YIELD_DAILY,
+	/* derived from the power registers, see energy.cpp */
+	SMADATA2PLUS_REG_ENERGY_AC_DAY,
+	SMADATA2PLUS_REG_ENERGY_AC_TOTAL,
+	SMADATA2PLUS_REG_ENERGY_AC_L1_DAY,
+	SMADATA2PLUS_REG_ENERGY_AC_L2_DAY,
+	SMADATA2PLUS_REG_ENERGY_AC_L3_DAY,
+	SMADATA2PLUS_REG_ENERGY_DC_1_DAY,
+	SMADATA2PLUS_REG_ENERGY_DC_2_DAY,
+	SMADATA2PLUS_REG_COUNT
+};
+
+/* Register description, min and max are the plausible range after scaling */
+struct smadata2_register_def {
+	const char *name;
+	const char *unit;
+	double factor;
+	float min;
+	float max;
+	const char *cls;	/* power, energy, voltage, current, limit, frequency, time, temperature, status */
+};
+
+/* Rejected values per register */
+struct smadata2_stats {
+	unsigned int nan;
+	unsigned int out_of_range;
+};
+
+extern const struct smadata2_register_def SMADATA2PLUS_REGISTERS[SMADATA2PLUS_REG_COUNT];
+
 ////#include "in_smadata2plus_structs.h"
 
 
 void in_smadata2plus_level1_clear(struct smadata2_l1_packet *p);
+void in_smadata2plus_level2_clear(struct smadata2_l2_packet *p);
 
-void in_smadata2plus_level1_cmdcode_wait(struct bluetooth_inverter * inv,
+int in_smadata2plus_level1_cmdcode_wait(struct bluetooth_inverter * inv,
 		struct smadata2_l1_packet *p, struct smadata2_l2_packet * p2 , int cmdcode);
 
+const char *in_smadata2plus_wait_name(int cmdcode);
 void in_smadata2plus_level1_packet_print(char * output,
 		struct smadata2_l1_packet *p);
 
 int in_smadata2plus_level1_packet_read(struct bluetooth_inverter *inv,
 		struct smadata2_l1_packet *p,struct smadata2_l2_packet *p2);
 
+void in_smadata2plus_level1_templates(struct bluetooth_inverter *inv);
 void in_smadata2plus_level1_packet_send(struct bluetooth_inverter *inv,
 		struct smadata2_l1_packet *p);
 
@@ -63,7 +157,7 @@ void in_smadata2plus_level2_tryfcs16(unsigned char * buffer, int len, unsigned c
 void in_smadata2plus_level2_packet_print(char * output,
 		struct smadata2_l2_packet *p);
 
-void in_smadata2plus_level2_packet_read(unsigned char *buffer, int len,
+int in_smadata2plus_level2_packet_read(unsigned char *buffer, int len,
 		struct smadata2_l2_packet *p);
 
 int in_smadata2plus_level2_packet_gen(struct bluetooth_inverter *inv,
@@ -74,14 +168,58 @@ void in_smadata2plus_level2_add_escapes(unsigned char *buffer, int *len);
 
 void in_smadata2plus_level2_strip_escapes(unsigned char *buffer, int *len);
 
-void in_smadata2plus_connect(struct bluetooth_inverter * inv);
+bool in_smadata2plus_level1_complete(struct bluetooth_inverter *inv);
+void in_smadata2plus_level2_request(struct bluetooth_inverter *inv, struct smadata2_l1_packet *p1,
+		struct smadata2_l2_packet *p2);
+void in_smadata2plus_broadcast_reply(struct bluetooth_inverter *inv, struct smadata2_l1_packet *request,
+		struct smadata2_l1_packet *reply);
+void in_smadata2plus_init_packet(int step, struct smadata2_l2_packet *p2);
+void in_smadata2plus_identify(struct bluetooth_inverter *inv, struct smadata2_l2_packet *reply);
+void in_smadata2plus_login_packet(struct bluetooth_inverter *inv, struct smadata2_l2_packet *p2);
+unsigned int in_smadata2plus_query_count();
+const struct smadata2_query *in_smadata2plus_query(unsigned int pos);
+const char *in_smadata2plus_query_name(unsigned int pos);
+int64_t in_smadata2plus_millis();
+const struct smadata2_query *in_smadata2plus_next_query(unsigned int *pos, unsigned int cycle,
+		const struct smadata2_model *model = NULL);
+void in_smadata2plus_query_packet(const struct smadata2_query *query, struct smadata2_l2_packet *p2);
+int in_smadata2plus_query_frame(struct bluetooth_inverter *inv, const struct smadata2_query *query,
+		unsigned char *frame);
+void in_smadata2plus_query_send(struct bluetooth_inverter *inv, const struct smadata2_query *query);
+void in_smadata2plus_parse_values(struct smadata2_l1_packet *p1, struct smadata2_l2_packet *p2,
+		const struct smadata2_query *query, vector <vec_data>& data_vector, struct smadata2_stats *stats);
+
+int in_smadata2plus_connect(struct bluetooth_inverter * inv);
+
+int in_smadata2plus_login(struct bluetooth_inverter * inv);
+
+
+int in_smadata2plus_load_models(const char *path);
 
-void in_smadata2plus_login(struct bluetooth_inverter * inv);
+void in_smadata2plus_get_model(struct bluetooth_inverter * inv,unsigned char *model_code) ;
 
+void in_smadata2plus_refine_model(struct bluetooth_inverter * inv, const vector <vec_data>& data_vector);
 
-void in_smadata2plus_get_model(struct bluetooth_inverter * inv,unsigned char *model_code) ;
+int in_smadata2plus_get_values(struct bluetooth_inverter * inv, vector <vec_data>& data_vector,
+		unsigned int cycle = 0);
+
+void in_smadata2plus_validate_values(vector <vec_data>& data_vector,
+		const struct smadata2_model *model = NULL, struct smadata2_stats *stats = NULL);
+
+void in_smadata2plus_archive_packet(unsigned int command, time_t from, time_t to, struct smadata2_l2_packet *p2);
+int in_smadata2plus_archive_record_len(unsigned int command);
+int in_smadata2plus_archive_collect(unsigned int command, struct smadata2_l2_packet *p2,
+		vector <unsigned char>& raw);
+void in_smadata2plus_archive_records(const vector <unsigned char>& raw, vector <smadata2_archive_record>& records);
+void in_smadata2plus_event_records(const vector <unsigned char>& raw, vector <smadata2_event_record>& events);
+int in_smadata2plus_get_archive(struct bluetooth_inverter * inv, unsigned int command,
+		time_t from, time_t to, vector <smadata2_archive_record>& records);
+int in_smadata2plus_get_events(struct bluetooth_inverter * inv, unsigned int command,
+		time_t from, time_t to, vector <smadata2_event_record>& events);
+
+int in_smadata2plus_register_id(const char *name);
 
-void in_smadata2plus_get_values(struct bluetooth_inverter * inv, vector <vec_data>& data_vector);
+double in_smadata2plus_value(const struct vec_data &data);
 
 void buffer_hex_dump(char * output, unsigned char * buffer, int len);
 
@@ -0,0 +1,289 @@
+/*
+ * Metrics
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <Log.h>
+#include "metrics.h"
+
+/* 1, 1.5, 2, 3, 4, 6 ... 49152, 65536 msec */
+struct bucket_bounds
+{
+    double le[Histogram::BUCKETS];
+    bucket_bounds()
+    {
+        for (int i = 0; i < Histogram::BUCKETS; i++)
+            le[i] = (i % 2 ? 1.5 : 1.0) * (double)(1u << (i / 2));
+    }
+};
+
+static const bucket_bounds BOUNDS;
+
+static void appendValue(std::string &out, double value)
+{
+    char tmp[32];
+    snprintf(tmp, sizeof(tmp), "%.9g", value);
+    out += tmp;
+}
+
+static void appendSample(std::string &out, const std::string &name, const char *suffix,
+                         const std::string &labels, const std::string &extra, double value)
+{
+    out += name;
+    out += suffix;
+    if (!labels.empty() || !extra.empty())
+    {
+        out += '{';
+        out += labels;
+        if (!labels.empty() && !extra.empty())
+            out += ',';
+        out += extra;
+        out += '}';
+    }
+    out += ' ';
+    appendValue(out, value);
+    out += '\n';
+}
+
+void Counter::render(std::string &out, const std::string &name, const std::string &labels) const
+{
+    appendSample(out, name, "", labels, "", (double)value());
+}
+
+void Gauge::render(std::string &out, const std::string &name, const std::string &labels) const
+{
+    appendSample(out, name, "", labels, "", value());
+}
+
+Histogram::Histogram() : _count(0), _sumUs(0)
+{
+    for (auto &bucket : _buckets)
+        bucket.store(0, std::memory_order_relaxed);
+}
+
+void Histogram::record(double ms)
+{
+    if (ms < 0.0)
+        ms = 0.0;
+    int i = std::lower_bound(BOUNDS.le, BOUNDS.le + BUCKETS, ms) - BOUNDS.le;
+    _buckets[i].fetch_add(1, std::memory_order_relaxed);
+    _count.fetch_add(1, std::memory_order_relaxed);
+    _sumUs.fetch_add((uint64_t)(ms * 1000.0), std::memory_order_relaxed);
+}
+
+/* Cumulative buckets, the count is the sum of the buckets so a render
+ * racing a record stays consistent */
+void Histogram::render(std::string &out, const std::string &name, const std::string &labels) const
+{
+    uint64_t cumulative = 0;
+    char le[40];
+    for (int i = 0; i < BUCKETS; i++)
+    {
+        cumulative += _buckets[i].load(std::memory_order_relaxed);
+        snprintf(le, sizeof(le), "le=\"%g\"", BOUNDS.le[i] / 1000.0);
+        appendSample(out, name, "_bucket", labels, le, (double)cumulative);
+    }
+    cumulative += _buckets[BUCKETS].load(std::memory_order_relaxed);
+    appendSample(out, name, "_bucket", labels, "le=\"+Inf\"", (double)cumulative);
+    appendSample(out, name, "_sum", labels, "", _sumUs.load(std::memory_order_relaxed) / 1000000.0);
+    appendSample(out, name, "_count", labels, "", (double)cumulative);
+}
+
+namespace
+{
+class Probe : public Metric
+{
+public:
+    Probe(std::function<double()> read) : _read(read) {}
+    void render(std::string &out, const std::string &name, const std::string &labels) const
+    {
+        appendSample(out, name, "", labels, "", _read());
+    }
+
+private:
+    std::function<double()> _read;
+};
+}
+
+/* Same name and labels give the same metric */
+template <typename T>
+T &MetricsRegistry::add(const std::string &name, const char *type, const std::string &help,
+                        const std::string &labels)
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    family &f = _families[name];
+    if (f.type.empty())
+    {
+        f.type = type;
+        f.help = help;
+    }
+    std::unique_ptr<Metric> &m = f.series[labels];
+    if (!m)
+        m.reset(new T());
+    return static_cast<T &>(*m);
+}
+
+Counter &MetricsRegistry::counter(const std::string &name, const std::string &help, const std::string &labels)
+{
+    return add<Counter>(name, "counter", help, labels);
+}
+
+Gauge &MetricsRegistry::gauge(const std::string &name, const std::string &help, const std::string &labels)
+{
+    return add<Gauge>(name, "gauge", help, labels);
+}
+
+Histogram &MetricsRegistry::histogram(const std::string &name, const std::string &help, const std::string &labels)
+{
+    return add<Histogram>(name, "histogram", help, labels);
+}
+
+void MetricsRegistry::probe(const std::string &name, const char *type, const std::string &help,
+                            const std::string &labels, std::function<double()> read)
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    family &f = _families[name];
+    f.type = type;
+    f.help = help;
+    f.series[labels].reset(new Probe(read));
+}
+
+std::string MetricsRegistry::render() const
+{
+    std::string out;
+    std::lock_guard<std::mutex> guard(_lock);
+    for (auto &kv : _families)
+    {
+        out += "# HELP " + kv.first + " " + kv.second.help + "\n";
+        out += "# TYPE " + kv.first + " " + kv.second.type + "\n";
+        for (auto &series : kv.second.series)
+            series.second->render(out, kv.first, series.first);
+    }
+    return out;
+}
+
+/* name="value" with the value escaped */
+std::string MetricsRegistry::label(const char *name, const std::string &value)
+{
+    std::string out = name;
+    out += "=\"";
+    for (char c : value)
+    {
+        if (c == '\\' || c == '"')
+            out += '\\';
+        if (c == '\n')
+        {
+            out += "\\n";
+            continue;
+        }
+        out += c;
+    }
+    out += '"';
+    return out;
+}
+
+MetricsServer::MetricsServer(MetricsRegistry &registry)
+    : _registry(registry), _listen(-1), _stop(false) {}
+
+MetricsServer::~MetricsServer()
+{
+    _stop = true;
+    if (_thread.joinable())
+        _thread.join();
+    if (_listen >= 0)
+        close(_listen);
+}
+
+bool MetricsServer::start(JsonObject cfg)
+{
+    if (cfg.isNull() || !(cfg["enabled"] | true))
+        return false;
+    std::string bind = cfg["bind"] | "127.0.0.1";
+    int port = cfg["port"] | 9464;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, bind.c_str(), &addr.sin_addr) != 1)
+    {
+        WARN("[Metrics] invalid bind address %s", bind.c_str());
+        return false;
+    }
+    _listen = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    if (_listen >= 0)
+        setsockopt(_listen, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (_listen < 0 || ::bind(_listen, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(_listen, 4) < 0)
+    {
+        WARN("[Metrics] cannot listen on %s:%d: %s", bind.c_str(), port, strerror(errno));
+        return false;
+    }
+    INFO("[Metrics] serving http://%s:%d/metrics", bind.c_str(), port);
+    _thread = std::thread(&MetricsServer::run, this);
+    return true;
+}
+
+void MetricsServer::run()
+{
+    while (!_stop)
+    {
+        struct pollfd pfd = {_listen, POLLIN, 0};
+        if (poll(&pfd, 1, 500) <= 0)
+            continue;
+        int fd = accept(_listen, NULL, NULL);
+        if (fd < 0)
+            continue;
+        serve(fd);
+        close(fd);
+    }
+}
+
+/* One request per connection, only GET /metrics */
+void MetricsServer::serve(int fd)
+{
+    struct timeval tv = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    char request[1024];
+    int len = recv(fd, request, sizeof(request) - 1, 0);
+    if (len <= 0)
+        return;
+    request[len] = 0;
+
+    std::string body;
+    const char *status;
+    if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET /metrics?", 13) == 0)
+    {
+        status = "200 OK";
+        body = _registry.render();
+    }
+    else
+    {
+        status = "404 Not Found";
+        body = "not found\n";
+    }
+    char header[160];
+    int hlen = snprintf(header, sizeof(header),
+                        "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                        "Content-Length: %u\r\nConnection: close\r\n\r\n",
+                        status, (unsigned)body.size());
+    std::string response(header, hlen);
+    response += body;
+    size_t sent = 0;
+    while (sent < response.size())
+    {
+        ssize_t n = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+            break;
+        sent += n;
+    }
+}
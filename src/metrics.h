@@ -0,0 +1,123 @@
+/*
+ * Metrics
+ *
+ * A registry of counters, gauges and histograms rendered in the Prometheus
+ * text format, and a small HTTP server that serves it on /metrics.
+ *
+ * Registering takes a lock, updating a registered metric doesn't : counts
+ * are atomics, so the polling, publisher and decode threads update them
+ * while the server thread renders. Histograms use fixed log-linear buckets
+ * (two per power of two, 1 ms to 65 s) like HDR histograms, so recording
+ * is a binary search and an increment.
+ */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <functional>
+#include <limero.h>
+
+class Metric
+{
+public:
+    virtual ~Metric() {}
+    virtual void render(std::string &out, const std::string &name, const std::string &labels) const = 0;
+};
+
+class Counter : public Metric
+{
+public:
+    Counter() : _value(0) {}
+    void add(uint64_t n = 1) { _value.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const { return _value.load(std::memory_order_relaxed); }
+    void render(std::string &out, const std::string &name, const std::string &labels) const;
+
+private:
+    std::atomic<uint64_t> _value;
+};
+
+class Gauge : public Metric
+{
+public:
+    Gauge() : _value(0.0) {}
+    void set(double value) { _value.store(value, std::memory_order_relaxed); }
+    double value() const { return _value.load(std::memory_order_relaxed); }
+    void render(std::string &out, const std::string &name, const std::string &labels) const;
+
+private:
+    std::atomic<double> _value;
+};
+
+/* Values in msec, rendered in seconds */
+class Histogram : public Metric
+{
+public:
+    static const int BUCKETS = 33;
+
+    Histogram();
+    void record(double ms);
+    uint64_t count() const { return _count.load(std::memory_order_relaxed); }
+    void render(std::string &out, const std::string &name, const std::string &labels) const;
+
+private:
+    std::atomic<uint64_t> _buckets[BUCKETS + 1]; // last one is +Inf
+    std::atomic<uint64_t> _count;
+    std::atomic<uint64_t> _sumUs;
+};
+
+class MetricsRegistry
+{
+public:
+    Counter &counter(const std::string &name, const std::string &help, const std::string &labels = "");
+    Gauge &gauge(const std::string &name, const std::string &help, const std::string &labels = "");
+    Histogram &histogram(const std::string &name, const std::string &help, const std::string &labels = "");
+    /* value read when rendering, for counts kept elsewhere */
+    void probe(const std::string &name, const char *type, const std::string &help,
+               const std::string &labels, std::function<double()> read);
+    std::string render() const;
+
+    static std::string label(const char *name, const std::string &value);
+
+private:
+    struct family
+    {
+        std::string type;
+        std::string help;
+        std::map<std::string, std::unique_ptr<Metric>> series; // by labels
+    };
+
+    template <typename T>
+    T &add(const std::string &name, const char *type, const std::string &help, const std::string &labels);
+
+    mutable std::mutex _lock;
+    std::map<std::string, family> _families;
+};
+
+/*
+ *   "metrics": { "enabled": true, "bind": "127.0.0.1", "port": 9464 }
+ */
+class MetricsServer
+{
+public:
+    MetricsServer(MetricsRegistry &registry);
+    ~MetricsServer();
+    bool start(JsonObject cfg);
+
+private:
+    void run();
+    void serve(int fd);
+
+    MetricsRegistry &_registry;
+    int _listen;
+    std::atomic<bool> _stop;
+    std::thread _thread;
+};
+
+#endif /* METRICS_H_ */
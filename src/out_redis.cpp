@@ -0,0 +1,505 @@
+/*
+ * Redis sink
+ */
+
+#include <sys/time.h>
+#include <string.h>
+#include <sstream>
+#include <algorithm>
+#include "out_redis.h"
+#include "in_smadata2plus.h"
+
+RedisSink::RedisSink(JsonObject cfg)
+    : _ctx(NULL), _groupState(SERIES_NEW), _pending(0), _errors(0)
+{
+    _host = cfg["host"] | "localhost";
+    _port = cfg["port"] | 6379;
+    _timeout = cfg["timeout"] | 2000;
+    std::string mode = cfg["mode"] | "timeseries";
+    _timeSeries = mode == "timeseries" || mode == "both";
+    _stream = mode == "stream" || mode == "both";
+    _streamKey = RespBuffer::encode(cfg["stream"] | "sma:values");
+    _maxLen = std::to_string(cfg["maxlen"] | 100000);
+    _group = cfg["group"] | "";
+    if (!_timeSeries && !_stream)
+    {
+        WARN("[Redis] unknown mode '%s', using timeseries", mode.c_str());
+        _timeSeries = true;
+    }
+    compaction(cfg["compaction"].as<JsonObject>());
+}
+
+/* 900000 -> "15m" */
+static std::string bucketName(uint32_t msec)
+{
+    if (msec % 86400000 == 0)
+        return std::to_string(msec / 86400000) + "d";
+    if (msec % 3600000 == 0)
+        return std::to_string(msec / 3600000) + "h";
+    if (msec % 60000 == 0)
+        return std::to_string(msec / 60000) + "m";
+    if (msec % 1000 == 0)
+        return std::to_string(msec / 1000) + "s";
+    return std::to_string(msec) + "ms";
+}
+
+/*
+ *   "compaction": {
+ *       "retention": 604800000,
+ *       "classes": {
+ *           "power": [ { "aggregation": "avg", "bucket": 900000, "retention": 7776000000 }, ... ]
+ *       }
+ *   }
+ */
+void RedisSink::compaction(JsonObject cfg)
+{
+    _retention = cfg["retention"] | 0.0; /* may not fit 32 bits */
+    _rules.assign(SMADATA2PLUS_REG_COUNT, std::vector<compaction_rule>());
+    for (auto cls : cfg["classes"].as<JsonObject>())
+    {
+        std::vector<compaction_rule> rules;
+        for (auto r : cls.value().as<JsonArray>())
+        {
+            compaction_rule rule;
+            rule.aggregation = r["aggregation"] | "avg";
+            rule.bucket = r["bucket"] | 60000;
+            rule.retention = r["retention"] | 0.0;
+            rule.suffix = rule.aggregation + "_" + bucketName(rule.bucket);
+            rules.push_back(rule);
+            INFO("[Redis] compaction %s : %s retention=%llu ms", cls.key().c_str(),
+                 rule.suffix.c_str(), (unsigned long long)rule.retention);
+        }
+        for (int id = 0; id < SMADATA2PLUS_REG_COUNT; id++)
+        {
+            if (strcmp(SMADATA2PLUS_REGISTERS[id].cls, cls.key().c_str()) == 0)
+                _rules[id] = rules;
+        }
+    }
+}
+
+/* TS.CREATE <key> RETENTION <msec> LABELS ... */
+void RedisSink::create(const std::string &key, uint64_t retention, const std::string &labels)
+{
+    std::istringstream words(labels);
+    std::vector<std::string> list;
+    std::string word;
+    while (words >> word)
+        list.push_back(word);
+
+    _out.array(5 + list.size());
+    _out.bulk("TS.CREATE", 9);
+    _out.bulk(key);
+    _out.bulk("RETENTION", 9);
+    _out.bulk((long long)retention);
+    _out.bulk("LABELS", 6);
+    for (auto &w : list)
+        _out.bulk(w);
+    _creates.push_back({_pending, key, retention});
+    _pending++;
+}
+
+std::vector<char> &RedisSink::prepared(const SeriesCatalog &catalog)
+{
+    std::vector<char> &series = _prepared[catalog.serial()];
+    if (series.empty())
+        series.assign(SMADATA2PLUS_REG_COUNT * SERIES_STAT_COUNT, SERIES_NEW);
+    return series;
+}
+
+/* Create the series and its compactions the first time it is written.
+ * After a restart these fail with "already exists", which is expected.
+ * TS.ADD creates a missing series itself, TS.MADD doesn't : force it.
+ * Statistic series get the retention but no compactions. */
+void RedisSink::prepare(const SeriesCatalog &catalog, int id, bool force, int stat)
+{
+    int series = id * SERIES_STAT_COUNT + stat;
+    char &state = prepared(catalog)[series];
+    if (!force && _retention == 0 && (stat != SERIES_VALUE || _rules[id].empty()))
+    {
+        state = SERIES_READY;
+        return;
+    }
+
+    state = SERIES_QUEUED;
+    size_t first = _pending;
+    if (stat != SERIES_VALUE)
+    {
+        create(catalog.key(id, stat), _retention,
+               catalog.labels(id) + " statistic " + SERIES_STAT_NAMES[stat]);
+        _setups.push_back({first, _pending, catalog.serial(), series, true});
+        return;
+    }
+    create(catalog.key(id), _retention, catalog.labels(id));
+    for (auto &rule : _rules[id])
+    {
+        std::string dest = catalog.key(id) + ":" + rule.suffix;
+        create(dest, rule.retention, catalog.labels(id) + " compaction " + rule.suffix);
+        _out.array(6);
+        _out.bulk("TS.CREATERULE", 13);
+        _out.bulk(catalog.key(id));
+        _out.bulk(dest);
+        _out.bulk("AGGREGATION", 11);
+        _out.bulk(rule.aggregation);
+        _out.bulk((long long)rule.bucket);
+        _pending++;
+    }
+    _setups.push_back({first, _pending, catalog.serial(), series, true});
+}
+
+RedisSink::~RedisSink()
+{
+    disconnect();
+}
+
+bool RedisSink::connect()
+{
+    struct timeval tv = {(time_t)(_timeout / 1000), (suseconds_t)((_timeout % 1000) * 1000)};
+    _ctx = redisConnectWithTimeout(_host.c_str(), _port, tv);
+    if (_ctx == NULL || _ctx->err)
+    {
+        WARN("[Redis] Connection to %s:%d failed: %s", _host.c_str(), _port,
+             _ctx ? _ctx->errstr : "no context");
+        disconnect();
+        return false;
+    }
+    redisSetTimeout(_ctx, tv);
+    INFO("[Redis] Connected to %s:%d", _host.c_str(), _port);
+    return true;
+}
+
+void RedisSink::disconnect()
+{
+    if (_ctx)
+        redisFree(_ctx);
+    _ctx = NULL;
+}
+
+void RedisSink::publish(const SeriesCatalog &catalog, const std::vector<vec_data> &data)
+{
+    if (_timeSeries)
+        timeSeries(catalog, data);
+    if (_stream)
+        stream(catalog, data);
+}
+
+void RedisSink::value(const SeriesCatalog &catalog, const vec_data &sample)
+{
+    int decimals = catalog.decimals(sample.id);
+    if (decimals >= 0)
+        _out.bulkFixed(sample.value, decimals);
+    else
+        _out.bulkDouble(in_smadata2plus_value(sample));
+}
+
+/* TS.ADD <key> * <value> LABELS ... for every sample */
+void RedisSink::timeSeries(const SeriesCatalog &catalog, const std::vector<vec_data> &data)
+{
+    std::vector<char> &series = prepared(catalog);
+    for (auto &sample : data)
+    {
+        if (series[sample.id * SERIES_STAT_COUNT] == SERIES_NEW)
+            prepare(catalog, sample.id);
+        _out.raw(catalog.tsAddHead(sample.id));
+        _out.bulk("*", 1);
+        value(catalog, sample);
+        _out.raw(catalog.tsAddTail(sample.id));
+        _pending++;
+    }
+}
+
+/* XGROUP CREATE <stream> <group> $ MKSTREAM, before the first entry. A
+ * BUSYGROUP reply when it exists already is expected */
+void RedisSink::group()
+{
+    if (_group.empty() || _groupState != SERIES_NEW)
+        return;
+    _groupState = SERIES_QUEUED;
+    _setups.push_back({_pending, _pending + 1, "", -1, true});
+    _out.array(6);
+    _out.bulk("XGROUP", 6);
+    _out.bulk("CREATE", 6);
+    _out.raw(_streamKey);
+    _out.bulk(_group);
+    _out.bulk("$", 1);
+    _out.bulk("MKSTREAM", 8);
+    _pending++;
+}
+
+/* XADD <stream> MAXLEN ~ <n> * serial <s> time <t> <name> <value> ... , one entry per poll */
+void RedisSink::stream(const SeriesCatalog &catalog, const std::vector<vec_data> &data)
+{
+    if (data.empty())
+        return;
+
+    group();
+    _out.array(10 + 2 * data.size());
+    _out.bulk("XADD", 4);
+    _out.raw(_streamKey);
+    _out.bulk("MAXLEN", 6);
+    _out.bulk("~", 1);
+    _out.bulk(_maxLen);
+    _out.bulk("*", 1);
+    _out.bulk("serial", 6);
+    _out.bulk(catalog.serial());
+    _out.bulk("time", 4);
+    _out.bulk((long long)data[0].timestamp);
+    for (auto &sample : data)
+    {
+        _out.raw(catalog.field(sample.id));
+        value(catalog, sample);
+    }
+    _pending++;
+}
+
+/* Statistics of a closed window, stamped with the window start */
+void RedisSink::aggregates(const SeriesCatalog &catalog, const AggregateWindow &window)
+{
+    std::vector<char> &series = prepared(catalog);
+    size_t fields = 0;
+    for (int id = 0; id < SMADATA2PLUS_REG_COUNT; id++)
+    {
+        for (int stat = 0; stat < SERIES_STAT_COUNT; stat++)
+        {
+            if (!window.has(id, stat))
+                continue;
+            fields++;
+            if (!_timeSeries)
+                continue;
+            if (series[id * SERIES_STAT_COUNT + stat] == SERIES_NEW)
+                prepare(catalog, id, false, stat);
+            _out.raw(catalog.tsAddHead(id, stat));
+            _out.bulk((long long)window.start());
+            _out.bulkDouble(window.value(id, stat));
+            _out.raw(catalog.tsAddTail(id, stat));
+            _pending++;
+        }
+    }
+
+    if (!_stream || fields == 0)
+        return;
+    group();
+    _out.array(10 + 2 * fields);
+    _out.bulk("XADD", 4);
+    _out.raw(_streamKey);
+    _out.bulk("MAXLEN", 6);
+    _out.bulk("~", 1);
+    _out.bulk(_maxLen);
+    _out.bulk("*", 1);
+    _out.bulk("serial", 6);
+    _out.bulk(catalog.serial());
+    _out.bulk("time", 4);
+    _out.bulk((long long)(window.start() / 1000));
+    for (int id = 0; id < SMADATA2PLUS_REG_COUNT; id++)
+    {
+        for (int stat = 0; stat < SERIES_STAT_COUNT; stat++)
+        {
+            if (!window.has(id, stat))
+                continue;
+            _out.raw(catalog.field(id, stat));
+            _out.bulkDouble(window.value(id, stat));
+        }
+    }
+    _pending++;
+}
+
+/* Archive record in Wh */
+void RedisSink::value(const SeriesCatalog &catalog, int id, const smadata2_archive_record &record)
+{
+    int decimals = catalog.decimals(id);
+    if (decimals >= 0)
+        _out.bulkFixed(record.value, decimals);
+    else
+        _out.bulkDouble(record.value * SMADATA2PLUS_REGISTERS[id].factor);
+}
+
+/* TS.MADD <key> <t> <value> <key> <t> <value> ... , batch records per
+ * command. The stream gets an XADD entry per record, stamped with the
+ * record time */
+void RedisSink::bulkLoad(const SeriesCatalog &catalog, int id, const std::vector<smadata2_archive_record> &records,
+                         size_t batch)
+{
+    if (records.empty())
+        return;
+    if (batch == 0)
+        batch = records.size();
+
+    if (_timeSeries)
+    {
+        if (prepared(catalog)[id * SERIES_STAT_COUNT] == SERIES_NEW)
+            prepare(catalog, id, true);
+        for (size_t first = 0; first < records.size(); first += batch)
+        {
+            size_t count = std::min(batch, records.size() - first);
+            _out.array(1 + 3 * count);
+            _out.bulk("TS.MADD", 7);
+            for (size_t i = first; i < first + count; i++)
+            {
+                _out.bulk(catalog.key(id));
+                _out.bulk((long long)records[i].timestamp * 1000);
+                value(catalog, id, records[i]);
+            }
+            _pending++;
+        }
+    }
+
+    if (!_stream)
+        return;
+    group();
+    for (auto &record : records)
+    {
+        _out.array(12);
+        _out.bulk("XADD", 4);
+        _out.raw(_streamKey);
+        _out.bulk("MAXLEN", 6);
+        _out.bulk("~", 1);
+        _out.bulk(_maxLen);
+        _out.bulk("*", 1);
+        _out.bulk("serial", 6);
+        _out.bulk(catalog.serial());
+        _out.bulk("time", 4);
+        _out.bulk((long long)record.timestamp);
+        _out.raw(catalog.field(id));
+        value(catalog, id, record);
+        _pending++;
+    }
+}
+
+/* XADD sma:<serial>:events MAXLEN ~ <n> * time <t> entry <e> code <c> ... , one entry per event */
+void RedisSink::events(const SeriesCatalog &catalog, const std::vector<smadata2_event_record> &events)
+{
+    std::string key = "sma:" + catalog.serial() + ":events";
+    for (auto &event : events)
+    {
+        _out.array(24);
+        _out.bulk("XADD", 4);
+        _out.bulk(key);
+        _out.bulk("MAXLEN", 6);
+        _out.bulk("~", 1);
+        _out.bulk(_maxLen);
+        _out.bulk("*", 1);
+        _out.bulk("time", 4);
+        _out.bulk((long long)event.timestamp);
+        _out.bulk("entry", 5);
+        _out.bulk((long long)event.entry);
+        _out.bulk("code", 4);
+        _out.bulk((long long)event.code);
+        _out.bulk("flags", 5);
+        _out.bulk((long long)event.flags);
+        _out.bulk("group", 5);
+        _out.bulk((long long)event.group);
+        _out.bulk("tag", 3);
+        _out.bulk((long long)event.tag);
+        _out.bulk("parameter", 9);
+        _out.bulk((long long)event.parameter);
+        _out.bulk("new", 3);
+        _out.bulk((long long)event.new_value);
+        _out.bulk("old", 3);
+        _out.bulk((long long)event.old_value);
+        _pending++;
+    }
+}
+
+/* Error replies expected after a restart. Older RedisTimeSeries versions
+ * send them without the ERR prefix */
+static bool expected(const char *error, const char *message)
+{
+    if (strncmp(error, "ERR ", 4) == 0)
+        error += 4;
+    return strcmp(error, message) == 0;
+}
+
+static const char TSDB_KEY_EXISTS[] = "TSDB: key already exists";
+static const char TSDB_RULE_EXISTS[] = "TSDB: the destination key already has a src rule";
+static const char BUSYGROUP[] = "BUSYGROUP Consumer Group name already exists";
+
+/* Series whose commands all got a successful reply are ready, the others
+ * are prepared again on their next sample */
+void RedisSink::settle(size_t replies)
+{
+    for (auto &setup : _setups)
+    {
+        char state = setup.ok && setup.last <= replies ? SERIES_READY : SERIES_NEW;
+        if (setup.series < 0)
+            _groupState = state;
+        else
+            _prepared[setup.serial][setup.series] = state;
+    }
+    _setups.clear();
+    _creates.clear();
+}
+
+/* Send all buffered commands in one write and collect the replies.
+ * Returns false when a command was lost or failed. */
+bool RedisSink::flush()
+{
+    if (_pending == 0)
+        return true;
+    if (_ctx == NULL && !connect())
+    {
+        WARN("[Redis] %u commands dropped", (unsigned)_pending);
+        _errors += _pending;
+        settle(0);
+        _out.clear();
+        _pending = 0;
+        return false;
+    }
+
+    uint32_t errors = _errors;
+    std::vector<creation> existing;
+    size_t replies = 0, create = 0, setup = 0;
+    redisAppendFormattedCommand(_ctx, _out.data(), _out.size());
+    DEBUG("[Redis] Sending %u commands, %u bytes", (unsigned)_pending, (unsigned)_out.size());
+    for (; replies < _pending; replies++)
+    {
+        redisReply *reply;
+        if (redisGetReply(_ctx, (void **)&reply) != REDIS_OK)
+        {
+            WARN("[Redis] %s, %u replies lost", _ctx->errstr, (unsigned)(_pending - replies));
+            _errors += _pending - replies;
+            disconnect();
+            break;
+        }
+        bool created = create < _creates.size() && _creates[create].command == replies;
+        bool failed = false;
+        if (reply->type == REDIS_REPLY_ERROR && created && expected(reply->str, TSDB_KEY_EXISTS))
+        {
+            existing.push_back(_creates[create]);
+        }
+        else if (reply->type == REDIS_REPLY_ERROR &&
+                 (expected(reply->str, TSDB_RULE_EXISTS) || strcmp(reply->str, BUSYGROUP) == 0))
+        {
+            DEBUG("[Redis] %s", reply->str);
+        }
+        else if (reply->type == REDIS_REPLY_ERROR)
+        {
+            WARN("[Redis] %s", reply->str);
+            _errors++;
+            failed = true;
+        }
+        freeReplyObject(reply);
+
+        if (created)
+            create++;
+        while (setup < _setups.size() && _setups[setup].last <= replies)
+            setup++;
+        if (failed && setup < _setups.size() && _setups[setup].first <= replies)
+            _setups[setup].ok = false;
+    }
+    settle(replies);
+    _pending = 0;
+    _out.clear();
+
+    /* TS.ALTER <key> RETENTION <msec> : the configured retention also
+       applies to series created by an earlier run */
+    for (auto &series : existing)
+    {
+        _out.array(4);
+        _out.bulk("TS.ALTER", 8);
+        _out.bulk(series.key);
+        _out.bulk("RETENTION", 9);
+        _out.bulk((long long)series.retention);
+        _pending++;
+    }
+    flush();
+    return _errors == errors;
+}
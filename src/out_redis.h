@@ -0,0 +1,125 @@
+/*
+ * Redis sink
+ *
+ * Writes samples with a plain hiredis connection. Commands of a poll are
+ * RESP encoded into one buffer and pipelined, the replies are read back
+ * at flush.
+ *
+ * In "timeseries" mode every sample is a TS.ADD on its own key. In
+ * "stream" mode a poll becomes one XADD entry holding the serial and all
+ * registers as fields. All inverters share the stream redis.stream,
+ * trimmed with MAXLEN ~, so consumers read the whole plant with one
+ * XREADGROUP instead of scanning many series. The consumer group
+ * redis.group is created on the first entry.
+ *
+ * In timeseries mode the first sample of a series also creates it with
+ * its retention, plus the compaction series and TS.CREATERULE rules of
+ * its register class as configured under redis.compaction. A series that
+ * exists already gets the configured retention with TS.ALTER. The series
+ * counts as prepared once Redis accepted all of these, until then every
+ * poll retries.
+ *
+ * Archive records downloaded from the inverter are bulk loaded with
+ * TS.MADD, batch samples per command, and added to the stream in stream
+ * mode. Event log entries are added to the stream sma:<serial>:events in
+ * every mode.
+ */
+
+#ifndef OUT_REDIS_H_
+#define OUT_REDIS_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <hiredis.h>
+#include <limero.h>
+#include "in_bluetooth.h"
+#include "series.h"
+#include "resp.h"
+#include "aggregate.h"
+
+struct compaction_rule
+{
+    std::string aggregation; // avg, max, min, sum, last, ...
+    uint32_t bucket;         // msec
+    uint64_t retention;      // msec, 0 = keep forever
+    std::string suffix;      // avg_15m
+};
+
+/* Preparation of a series, by serial, register id and statistic */
+enum series_state
+{
+    SERIES_NEW = 0,
+    SERIES_QUEUED, // commands wait for flush
+    SERIES_READY
+};
+
+class RedisSink
+{
+public:
+    RedisSink(JsonObject cfg);
+    ~RedisSink();
+    bool connect();
+    void publish(const SeriesCatalog &catalog, const std::vector<vec_data> &data);
+    void timeSeries(const SeriesCatalog &catalog, const std::vector<vec_data> &data);
+    void stream(const SeriesCatalog &catalog, const std::vector<vec_data> &data);
+    void aggregates(const SeriesCatalog &catalog, const AggregateWindow &window);
+    void bulkLoad(const SeriesCatalog &catalog, int id, const std::vector<smadata2_archive_record> &records,
+                  size_t batch);
+    void events(const SeriesCatalog &catalog, const std::vector<smadata2_event_record> &events);
+    bool flush();
+    uint32_t errors() const { return _errors; }
+
+private:
+    void disconnect();
+    void value(const SeriesCatalog &catalog, const vec_data &sample);
+    void value(const SeriesCatalog &catalog, int id, const smadata2_archive_record &record);
+    void compaction(JsonObject cfg);
+    std::vector<char> &prepared(const SeriesCatalog &catalog);
+    void prepare(const SeriesCatalog &catalog, int id, bool force = false, int stat = SERIES_VALUE);
+    void group();
+    void create(const std::string &key, uint64_t retention, const std::string &labels);
+    void settle(size_t replies);
+
+    redisContext *_ctx;
+    std::string _host;
+    int _port;
+    uint32_t _timeout;
+    bool _timeSeries;
+    bool _stream;
+    std::string _streamKey; // RESP encoded
+    std::string _maxLen;
+    std::string _group;
+    char _groupState;       // series_state of the consumer group
+    uint64_t _retention;
+    std::vector<std::vector<compaction_rule>> _rules; // by register id
+    /* series_state by serial, then id * SERIES_STAT_COUNT + stat. Kept per
+       sink : the publisher and the archive download write from different
+       threads */
+    std::unordered_map<std::string, std::vector<char>> _prepared;
+    /* commands of a prepare() in the pipeline [first, last), series -1
+       for the consumer group */
+    struct setup
+    {
+        size_t first;
+        size_t last;
+        std::string serial;
+        int series; // index in _prepared
+        bool ok;
+    };
+    std::vector<setup> _setups;
+    /* TS.CREATE in the pipeline, altered when the key exists */
+    struct creation
+    {
+        size_t command;
+        std::string key;
+        uint64_t retention;
+    };
+    std::vector<creation> _creates;
+    RespBuffer _out;
+    size_t _pending;
+    uint32_t _errors;
+};
+
+#endif /* OUT_REDIS_H_ */
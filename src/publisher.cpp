@@ -0,0 +1,161 @@
+/*
+ * Publisher
+ */
+
+#include <sched.h>
+#include <chrono>
+#include <Log.h>
+#include "publisher.h"
+
+/*
+ *   "publisher": { "enabled": true, "capacity": 256, "policy": "drop",
+ *                  "block_timeout": 1000, "tick": 50 }
+ */
+publisher_config publisherConfig(JsonObject cfg)
+{
+    publisher_config config;
+    config.enabled = cfg["enabled"] | false;
+    config.capacity = cfg["capacity"] | 256;
+    std::string policy = cfg["policy"] | "drop";
+    config.block = policy == "block";
+    config.block_timeout = cfg["block_timeout"] | 1000;
+    config.tick = cfg["tick"] | 50;
+    return config;
+}
+
+Publisher::Publisher(Thread &thread, RedisSink &redis, const publisher_config &config)
+    : _config(config), _timer(thread, config.tick, true, "publisher"), _redis(redis),
+      _ring(config.capacity), _job(), _highWater(0),
+      _published(0), _failed(0), _dropped(0), _blocked(0), _reported(0), _flushMs(NULL)
+{
+    _timer >> [&](const TimerMsg &)
+    {
+        drain();
+    };
+}
+
+void Publisher::start()
+{
+    if (!_config.enabled)
+        return;
+    INFO("[Publisher] ring of %u polls, %s when full", (unsigned)_ring.capacity(),
+         _config.block ? "block" : "drop");
+    _timer.start();
+}
+
+void Publisher::metrics(MetricsRegistry &registry)
+{
+    _flushMs = &registry.histogram("sma_redis_flush_seconds", "Time to write a pipeline to Redis");
+    registry.probe("sma_publisher_queue_depth", "gauge", "Polls waiting in the publisher ring", "",
+                   [this]
+                   { return (double)depth(); });
+    registry.probe("sma_publisher_queue_high_water", "gauge", "Most polls ever waiting in the ring", "",
+                   [this]
+                   { return (double)highWater(); });
+    registry.probe("sma_publisher_published_total", "counter", "Polls written to Redis", "",
+                   [this]
+                   { return (double)published(); });
+    registry.probe("sma_publisher_failed_total", "counter", "Polls lost on a Redis error", "",
+                   [this]
+                   { return (double)failed(); });
+    registry.probe("sma_publisher_dropped_total", "counter", "Polls dropped on a full ring", "",
+                   [this]
+                   { return (double)dropped(); });
+    registry.probe("sma_publisher_blocked_total", "counter", "Polls that waited for room in the ring", "",
+                   [this]
+                   { return (double)blocked(); });
+}
+
+bool Publisher::samples(SeriesCatalog &catalog, const std::vector<vec_data> &data)
+{
+    publish_job job = {&catalog, false, data, AggregateWindow()};
+    return submit(job);
+}
+
+bool Publisher::aggregates(SeriesCatalog &catalog, const AggregateWindow &window)
+{
+    publish_job job = {&catalog, true, {}, window};
+    return submit(job);
+}
+
+/* Called from the polling thread */
+bool Publisher::submit(publish_job &job)
+{
+    if (!_config.enabled)
+    {
+        write(job);
+        if (flush())
+            _published++;
+        else
+            _failed++;
+        return true;
+    }
+
+    bool queued = _ring.push(job);
+    if (!queued && _config.block)
+    {
+        _blocked++;
+        uint64_t until = Sys::millis() + _config.block_timeout;
+        while (!(queued = _ring.push(job)) && Sys::millis() < until)
+            sched_yield();
+    }
+    if (!queued)
+    {
+        _dropped++;
+        return false;
+    }
+
+    size_t depth = _ring.size();
+    size_t high = _highWater.load(std::memory_order_relaxed);
+    while (depth > high && !_highWater.compare_exchange_weak(high, depth, std::memory_order_relaxed))
+        ;
+    return true;
+}
+
+void Publisher::write(publish_job &job)
+{
+    if (job.aggregates)
+        _redis.aggregates(*job.catalog, job.window);
+    else
+        _redis.publish(*job.catalog, job.samples);
+}
+
+bool Publisher::flush()
+{
+    auto start = std::chrono::steady_clock::now();
+    bool ok = _redis.flush();
+    if (_flushMs)
+        _flushMs->record(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    return ok;
+}
+
+/* Publisher thread : everything queued since the last tick goes out as one
+ * pipeline */
+void Publisher::drain()
+{
+    size_t count = 0;
+    while (_ring.pop(_job))
+    {
+        write(_job);
+        count++;
+    }
+    if (count == 0)
+        return;
+    if (flush())
+    {
+        _published += count;
+        DEBUG("[Publisher] wrote %u polls", (unsigned)count);
+    }
+    else
+    {
+        _failed += count;
+    }
+
+    uint32_t dropped = _dropped.load(std::memory_order_relaxed);
+    if (dropped != _reported)
+    {
+        WARN("[Publisher] %u polls dropped on a full ring (high water %u of %u, blocked %u)",
+             dropped - _reported, (unsigned)highWater(), (unsigned)_ring.capacity(), blocked());
+        _reported = dropped;
+    }
+}
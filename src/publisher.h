@@ -0,0 +1,84 @@
+/*
+ * Publisher
+ *
+ * Hands the samples of a poll from the polling thread to a thread of its
+ * own that writes them to Redis, through a bounded lock-free ring. A slow
+ * Redis then only fills the ring instead of delaying the next poll, and a
+ * hung inverter doesn't hold up what other inverters produced.
+ *
+ * When the ring is full the "drop" policy discards the new poll, "block"
+ * makes the poller wait up to block_timeout for room before dropping.
+ * Without a dedicated thread everything is written inline as before.
+ */
+
+#ifndef PUBLISHER_H_
+#define PUBLISHER_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+#include <limero.h>
+#include "in_bluetooth.h"
+#include "series.h"
+#include "aggregate.h"
+#include "out_redis.h"
+#include "ring.h"
+#include "metrics.h"
+
+struct publisher_config
+{
+    bool enabled;           // publish from a dedicated thread
+    size_t capacity;        // polls the ring holds
+    bool block;             // wait for room instead of dropping
+    uint32_t block_timeout; // msec
+    uint32_t tick;          // msec between drains of the ring
+};
+
+publisher_config publisherConfig(JsonObject cfg);
+
+/* One poll : raw samples, or the statistics of a closed window */
+struct publish_job
+{
+    SeriesCatalog *catalog;
+    bool aggregates;
+    std::vector<vec_data> samples;
+    AggregateWindow window;
+};
+
+class Publisher
+{
+public:
+    Publisher(Thread &thread, RedisSink &redis, const publisher_config &config);
+    void start();
+    void metrics(MetricsRegistry &registry);
+    bool samples(SeriesCatalog &catalog, const std::vector<vec_data> &data);
+    bool aggregates(SeriesCatalog &catalog, const AggregateWindow &window);
+
+    size_t depth() const { return _ring.size(); }
+    size_t highWater() const { return _highWater.load(std::memory_order_relaxed); }
+    uint32_t published() const { return _published.load(std::memory_order_relaxed); }
+    uint32_t failed() const { return _failed.load(std::memory_order_relaxed); }
+    uint32_t dropped() const { return _dropped.load(std::memory_order_relaxed); }
+    uint32_t blocked() const { return _blocked.load(std::memory_order_relaxed); }
+
+private:
+    bool submit(publish_job &job);
+    void write(publish_job &job);
+    bool flush();
+    void drain();
+
+    publisher_config _config;
+    TimerSource _timer;
+    RedisSink &_redis;
+    BoundedRing<publish_job> _ring;
+    publish_job _job; // drained job, its buffers are reused
+    std::atomic<size_t> _highWater;
+    std::atomic<uint32_t> _published;
+    std::atomic<uint32_t> _failed; // polls Redis didn't take
+    std::atomic<uint32_t> _dropped;
+    std::atomic<uint32_t> _blocked;
+    uint32_t _reported; // drops already warned about
+    Histogram *_flushMs;
+};
+
+#endif /* PUBLISHER_H_ */
@@ -0,0 +1,121 @@
+/*
+ * RESP encoder
+ */
+
+#include <math.h>
+#include "resp.h"
+
+RespBuffer::RespBuffer(size_t reserve)
+{
+    _buf.reserve(reserve);
+}
+
+/* Append a decimal integer */
+void RespBuffer::number(long long value)
+{
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    unsigned long long u = value < 0 ? 0ULL - (unsigned long long)value : value;
+    do
+    {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (value < 0)
+        *--p = '-';
+    _buf.append(p, tmp + sizeof(tmp) - p);
+}
+
+void RespBuffer::array(size_t count)
+{
+    _buf.push_back('*');
+    number(count);
+    _buf.append("\r\n", 2);
+}
+
+void RespBuffer::bulk(const char *s, size_t len)
+{
+    _buf.push_back('$');
+    number(len);
+    _buf.append("\r\n", 2);
+    _buf.append(s, len);
+    _buf.append("\r\n", 2);
+}
+
+void RespBuffer::bulk(long long value)
+{
+    char tmp[24];
+    size_t len = formatFixed(tmp, value, 0);
+    bulk(tmp, len);
+}
+
+/* raw=12345 decimals=2 gives "123.45" */
+void RespBuffer::bulkFixed(long long raw, int decimals)
+{
+    char tmp[32];
+    size_t len = formatFixed(tmp, raw, decimals);
+    bulk(tmp, len);
+}
+
+/* Computed values, 6 decimals is well below the resolution of any register */
+void RespBuffer::bulkDouble(double value)
+{
+    if (!isfinite(value) || fabs(value) > 9.0e12)
+    {
+        bulk("nan", 3);
+        return;
+    }
+    char tmp[32];
+    size_t len = formatFixed(tmp, llround(value * 1000000.0), 6);
+    /* strip trailing zeros */
+    while (tmp[len - 1] == '0')
+        len--;
+    if (tmp[len - 1] == '.')
+        len--;
+    bulk(tmp, len);
+}
+
+size_t RespBuffer::formatFixed(char *out, long long raw, int decimals)
+{
+    char tmp[32];
+    char *p = tmp + sizeof(tmp);
+    unsigned long long u = raw < 0 ? 0ULL - (unsigned long long)raw : raw;
+    for (int i = 0; i < decimals; i++)
+    {
+        *--p = '0' + u % 10;
+        u /= 10;
+    }
+    if (decimals)
+        *--p = '.';
+    do
+    {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (raw < 0)
+        *--p = '-';
+    size_t len = tmp + sizeof(tmp) - p;
+    for (size_t i = 0; i < len; i++)
+        out[i] = p[i];
+    return len;
+}
+
+/* Pre-encode a bulk string, for key and label fragments rendered once */
+std::string RespBuffer::encode(const std::string &s)
+{
+    RespBuffer b(s.size() + 16);
+    b.bulk(s);
+    return b._buf;
+}
+
+/* Number of decimals of a 10^-n factor, -1 for any other factor */
+int RespBuffer::decimals(double factor)
+{
+    double scale = 1.0;
+    for (int n = 0; n < 10; n++, scale *= 10.0)
+    {
+        if (fabs(factor * scale - 1.0) < 1e-6)
+            return n;
+    }
+    return -1;
+}
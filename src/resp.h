@@ -0,0 +1,43 @@
+/*
+ * RESP encoder
+ *
+ * Builds Redis protocol arrays directly into a reusable buffer, so a
+ * command doesn't have to be printed into a string and split again.
+ * Numbers are formatted without printf : sample values are integers with
+ * a power of ten factor, so they are written as fixed point.
+ */
+
+#ifndef RESP_H_
+#define RESP_H_
+
+#include <stddef.h>
+#include <string>
+
+class RespBuffer
+{
+public:
+    RespBuffer(size_t reserve = 16384);
+    void clear() { _buf.clear(); }
+    const char *data() const { return _buf.data(); }
+    size_t size() const { return _buf.size(); }
+    bool empty() const { return _buf.empty(); }
+
+    void array(size_t count);
+    void bulk(const char *s, size_t len);
+    void bulk(const std::string &s) { bulk(s.data(), s.size()); }
+    void bulk(long long value);
+    void bulkFixed(long long raw, int decimals);
+    void bulkDouble(double value);
+    void raw(const std::string &encoded) { _buf.append(encoded); }
+
+    static std::string encode(const std::string &s);
+    static int decimals(double factor);
+
+private:
+    void number(long long value);
+    static size_t formatFixed(char *out, long long raw, int decimals);
+
+    std::string _buf;
+};
+
+#endif /* RESP_H_ */
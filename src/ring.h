@@ -0,0 +1,115 @@
+/*
+ * Bounded lock-free ring
+ *
+ * Multi-producer multi-consumer queue of a fixed, power of two, number of
+ * cells (Vyukov). Every cell carries a sequence number that tells whether
+ * it is free for the producer of that lap or holds a value for the
+ * consumer, so push and pop only contend on one atomic index each and
+ * never take a lock. A full ring refuses the push, what to do then is up
+ * to the caller.
+ */
+
+#ifndef RING_H_
+#define RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <utility>
+
+template <typename T>
+class BoundedRing
+{
+public:
+    explicit BoundedRing(size_t capacity)
+    {
+        size_t size = 2;
+        while (size < capacity)
+            size <<= 1;
+        _mask = size - 1;
+        _cells.reset(new cell[size]);
+        for (size_t i = 0; i < size; i++)
+            _cells[i].sequence.store(i, std::memory_order_relaxed);
+        _tail.store(0, std::memory_order_relaxed);
+        _head.store(0, std::memory_order_relaxed);
+    }
+
+    size_t capacity() const { return _mask + 1; }
+
+    /* Number of values queued, exact only while nobody pushes or pops */
+    size_t size() const
+    {
+        size_t head = _head.load(std::memory_order_acquire);
+        size_t tail = _tail.load(std::memory_order_acquire);
+        return tail > head ? tail - head : 0;
+    }
+
+    /* False when the ring is full, value is left untouched then */
+    bool push(T &value)
+    {
+        size_t pos = _tail.load(std::memory_order_relaxed);
+        cell *c;
+        for (;;)
+        {
+            c = &_cells[pos & _mask];
+            size_t sequence = c->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+            if (diff == 0)
+            {
+                if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+                return false;
+            else
+                pos = _tail.load(std::memory_order_relaxed);
+        }
+        c->value = std::move(value);
+        c->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /* False when the ring is empty */
+    bool pop(T &value)
+    {
+        size_t pos = _head.load(std::memory_order_relaxed);
+        cell *c;
+        for (;;)
+        {
+            c = &_cells[pos & _mask];
+            size_t sequence = c->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+            if (diff == 0)
+            {
+                if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+                return false;
+            else
+                pos = _head.load(std::memory_order_relaxed);
+        }
+        value = std::move(c->value);
+        c->sequence.store(pos + _mask + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    struct cell
+    {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    BoundedRing(const BoundedRing &);
+    BoundedRing &operator=(const BoundedRing &);
+
+    /* producers and consumers on separate cache lines */
+    alignas(64) std::atomic<size_t> _tail;
+    alignas(64) std::atomic<size_t> _head;
+    size_t _mask;
+    std::unique_ptr<cell[]> _cells;
+};
+
+#endif /* RING_H_ */
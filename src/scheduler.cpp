@@ -0,0 +1,118 @@
+/*
+ * Poll scheduler
+ *
+ * The timer ticks at a fine resolution; every tick the slots whose due
+ * time has passed are polled. The start of a cycle is kept on a fixed grid
+ * (phase + n * period) so a late poll never shifts the following ones.
+ */
+
+#include "scheduler.h"
+
+PollScheduler::PollScheduler(Thread &thread, uint32_t period, uint32_t deadline,
+                             uint32_t jitter, uint32_t tick)
+    : _timer(thread, tick, true, "scheduler"), _period(period),
+      _deadline(deadline), _jitter(jitter), _random(Sys::millis())
+{
+    _timer >> [&](const TimerMsg &)
+    {
+        onTick();
+    };
+}
+
+void PollScheduler::add(const std::string &device)
+{
+    poll_slot slot = {device, 0, 0, 0, 0, 0, 0};
+    _slots.push_back(slot);
+}
+
+void PollScheduler::handler(std::function<bool(poll_slot &)> poll)
+{
+    _poll = poll;
+}
+
+/* Assign each device its phase and compute the first due times */
+void PollScheduler::start()
+{
+    if (_slots.empty())
+        return;
+    uint32_t width = _period / _slots.size();
+    if (_deadline == 0 || _deadline > _period)
+        _deadline = width;
+    /* a poll must start within its own slot and before its deadline */
+    uint32_t limit = _deadline < width ? _deadline : width;
+    if (_jitter >= limit)
+        _jitter = limit / 2;
+
+    uint64_t now = Sys::millis();
+    for (size_t i = 0; i < _slots.size(); i++)
+    {
+        poll_slot &slot = _slots[i];
+        slot.phase = i * width;
+        slot.base_due = now + slot.phase;
+        slot.next_due = slot.base_due + (_jitter ? _random() % _jitter : 0);
+        INFO("[Sched] %s phase=%llu ms period=%u ms deadline=%u ms", slot.device.c_str(),
+             (unsigned long long)slot.phase, _period, _deadline);
+    }
+    _timer.start();
+}
+
+/* Move slot to the next cycle on the grid that is still in the future */
+void PollScheduler::advance(poll_slot &slot, uint64_t now)
+{
+    slot.base_due += _period;
+    while (slot.base_due + _deadline <= now)
+    {
+        slot.base_due += _period;
+        slot.skipped++;
+    }
+    slot.next_due = slot.base_due + (_jitter ? _random() % _jitter : 0);
+}
+
+void PollScheduler::onTick()
+{
+    for (auto &slot : _slots)
+    {
+        uint64_t now = Sys::millis();
+        if (now < slot.next_due)
+            continue;
+
+        uint64_t deadline = slot.base_due + _deadline;
+        if (now >= deadline)
+        {
+            slot.skipped++;
+            WARN("[Sched] %s skipped, %llu ms past its deadline (skipped=%u missed=%u)", slot.device.c_str(),
+                 (unsigned long long)(now - deadline), slot.skipped, slot.missed);
+            advance(slot, now);
+            continue;
+        }
+
+        if (_poll && !_poll(slot))
+        {
+            slot.skipped++;
+            WARN("[Sched] %s skipped, previous poll still running (skipped=%u missed=%u)",
+                 slot.device.c_str(), slot.skipped, slot.missed);
+            advance(slot, now);
+            continue;
+        }
+        slot.polls++;
+        checkDeadline(slot, now, deadline);
+        advance(slot, Sys::millis());
+    }
+}
+
+void PollScheduler::finished(poll_slot &slot, uint64_t started, uint64_t deadline)
+{
+    checkDeadline(slot, started, deadline);
+}
+
+void PollScheduler::checkDeadline(poll_slot &slot, uint64_t started, uint64_t deadline)
+{
+    uint64_t done = Sys::millis();
+    if (done > deadline)
+    {
+        slot.missed++;
+        WARN("[Sched] %s missed deadline by %llu ms, poll took %llu ms (skipped=%u missed=%u)",
+             slot.device.c_str(), (unsigned long long)(done - deadline),
+             (unsigned long long)(done - started), slot.skipped, slot.missed);
+    }
+}
@@ -0,0 +1,62 @@
+/*
+ * Poll scheduler
+ *
+ * Spreads the configured devices evenly over the polling period so that
+ * Bluetooth traffic and Redis writes of different inverters don't coincide.
+ * Each device gets a fixed phase within the period plus a small random
+ * jitter per cycle. A poll that can't start within its deadline is skipped
+ * rather than queued, so sample spacing stays regular under load.
+ */
+
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <random>
+#include <functional>
+#include <limero.h>
+
+struct poll_slot
+{
+    std::string device;
+    uint64_t phase;    // offset within the period in msec
+    uint64_t base_due; // aligned start of the current cycle
+    uint64_t next_due; // base_due + jitter
+    uint32_t polls;    // polls executed
+    uint32_t skipped;  // polls dropped because they couldn't start in time
+                       // or the previous one was still running
+    uint32_t missed;   // polls that finished after their deadline
+};
+
+class PollScheduler
+{
+public:
+    PollScheduler(Thread &thread, uint32_t period, uint32_t deadline,
+                  uint32_t jitter, uint32_t tick);
+    void add(const std::string &device);
+    void start();
+    /* poll returns false when it didn't start the poll */
+    void handler(std::function<bool(poll_slot &)> poll);
+    /* A poll the handler left running ended, counted as missed when that
+     * is after deadline */
+    void finished(poll_slot &slot, uint64_t started, uint64_t deadline);
+    const std::vector<poll_slot> &slots() const { return _slots; }
+    uint32_t deadline() const { return _deadline; }
+
+private:
+    void onTick();
+    void advance(poll_slot &slot, uint64_t now);
+    void checkDeadline(poll_slot &slot, uint64_t started, uint64_t deadline);
+
+    TimerSource _timer;
+    uint32_t _period;
+    uint32_t _deadline;
+    uint32_t _jitter;
+    std::vector<poll_slot> _slots;
+    std::function<bool(poll_slot &)> _poll;
+    std::minstd_rand _random;
+};
+
+#endif /* SCHEDULER_H_ */
@@ -0,0 +1,98 @@
+/*
+ * Series catalog
+ */
+
+#include <unordered_map>
+#include <sstream>
+#include "series.h"
+#include "resp.h"
+
+static const std::unordered_map<std::string, std::string> inputToRedisLabels = {
+    {"power_ac", "input power acdc ac"},
+    {"voltage_ac_l1", "input voltage acdc ac line l1"},
+    {"voltage_ac_l2", "input voltage acdc ac line l2"},
+    {"voltage_ac_l3", "input voltage acdc ac line l3"},
+    {"power_ac_l1", "input power acdc ac line l1"},
+    {"power_ac_l2", "input power acdc ac line l2"},
+    {"power_ac_l3", "input power acdc ac line l3"},
+    {"voltage_dc_1", "input voltage acdc dc line l1"},
+    {"voltage_dc_2", "input voltage acdc dc line l2"},
+    {"voltage_dc_3", "input voltage acdc dc line l3"},
+    {"power_dc_1", "input power acdc dc line l1"},
+    {"power_dc_2", "input power acdc dc line l2"},
+    {"power_dc_3", "input power acdc dc line l3"},
+    {"current_ac_l1", "input current acdc ac line l1"},
+    {"current_ac_l2", "input current acdc ac line l2"},
+    {"current_ac_l3", "input current acdc ac line l3"},
+    {"power_ac_max_l1", "input maxPower acdc ac line l1"},
+    {"power_ac_max_l2", "input maxPower acdc ac line l2"},
+    {"power_ac_max_l3", "input maxPower acdc ac line l3"},
+    {"yield_total", "input totalPower acdc ac"},
+    {"current_dc_1", "input current acdc dc line l1"},
+    {"current_dc_2", "input current acdc dc line l2"},
+    {"frequency", "input frequency acdc ac"},
+    {"yield_day", "input dayPower acdc ac"},
+    {"operating_time", "input operatingTime"},
+    {"feed_in_time", "input feedInTime"},
+    {"temperature", "input temperature"},
+    {"status", "input status"},
+    {"grid_relay", "input gridRelay acdc ac"},
+    {"yield_5min", "input archiveTotal acdc ac interval 5m"},
+    {"yield_daily", "input archiveTotal acdc ac interval 1d"},
+    {"energy_ac_day", "input energyDay acdc ac"},
+    {"energy_ac_total", "input energyTotal acdc ac"},
+    {"energy_ac_l1_day", "input energyDay acdc ac line l1"},
+    {"energy_ac_l2_day", "input energyDay acdc ac line l2"},
+    {"energy_ac_l3_day", "input energyDay acdc ac line l3"},
+    {"energy_dc_1_day", "input energyDay acdc dc line l1"},
+    {"energy_dc_2_day", "input energyDay acdc dc line l2"}
+
+};
+
+const char *SERIES_STAT_NAMES[SERIES_STAT_COUNT] = {"value", "min", "max", "last", "integral"};
+
+void SeriesCatalog::intern(const std::string &serial)
+{
+    _serial = serial;
+    _names.clear();
+    _keys.clear();
+    _labels.clear();
+    _decimals.clear();
+    _tsAddHead.clear();
+    _tsAddTail.clear();
+    _fields.clear();
+    for (int id = 0; id < SMADATA2PLUS_REG_COUNT; id++)
+    {
+        std::string name = SMADATA2PLUS_REGISTERS[id].name;
+        auto r = inputToRedisLabels.find(name);
+        _names.push_back(name);
+        _labels.push_back(r == inputToRedisLabels.end() ? "input unknown" : r->second);
+        _decimals.push_back(RespBuffer::decimals(SMADATA2PLUS_REGISTERS[id].factor));
+
+        for (int stat = 0; stat < SERIES_STAT_COUNT; stat++)
+        {
+            std::string suffix = stat == SERIES_VALUE ? "" : std::string(":") + SERIES_STAT_NAMES[stat];
+            _keys.push_back("sma:" + serial + ":" + name + suffix);
+            _fields.push_back(RespBuffer::encode(name + suffix));
+
+            /* TS.ADD <key> <timestamp> <value> LABELS <label> <value> ... */
+            std::string labels = _labels.back();
+            if (stat != SERIES_VALUE)
+                labels += std::string(" statistic ") + SERIES_STAT_NAMES[stat];
+            std::istringstream words(labels);
+            std::string word, tail = RespBuffer::encode("LABELS");
+            size_t count = 5;
+            while (words >> word)
+            {
+                tail += RespBuffer::encode(word);
+                count++;
+            }
+            RespBuffer head(64);
+            head.array(count);
+            head.bulk("TS.ADD", 6);
+            head.bulk(_keys.back());
+            _tsAddHead.push_back(std::string(head.data(), head.size()));
+            _tsAddTail.push_back(tail);
+        }
+    }
+}
@@ -0,0 +1,61 @@
+/*
+ * Series catalog
+ *
+ * The Redis keys and labels of every register of one device are rendered
+ * once when the device serial is known, samples then only carry the
+ * register id.
+ *
+ * Besides the value series every register has statistic series
+ * (sma:<serial>:<name>:min ...) used when samples are aggregated locally.
+ */
+
+#ifndef SERIES_H_
+#define SERIES_H_
+
+#include <string>
+#include <vector>
+#include "in_bluetooth.h"
+#include "in_smadata2plus.h"
+
+/* Series of a register, SERIES_VALUE is the register itself and receives
+ * the average when aggregating */
+enum series_stat
+{
+    SERIES_VALUE = 0,
+    SERIES_MIN,
+    SERIES_MAX,
+    SERIES_LAST,
+    SERIES_INTEGRAL,
+    SERIES_STAT_COUNT
+};
+
+extern const char *SERIES_STAT_NAMES[SERIES_STAT_COUNT];
+
+class SeriesCatalog
+{
+public:
+    void intern(const std::string &serial);
+    bool empty() const { return _serial.empty(); }
+    const std::string &serial() const { return _serial; }
+    const std::string &name(int id) const { return _names[id]; }
+    const std::string &key(int id, int stat = SERIES_VALUE) const { return _keys[id * SERIES_STAT_COUNT + stat]; }
+    const std::string &labels(int id) const { return _labels[id]; }
+    int decimals(int id) const { return _decimals[id]; }
+    /* RESP encoded TS.ADD up to the timestamp, and the LABELS after the value */
+    const std::string &tsAddHead(int id, int stat = SERIES_VALUE) const { return _tsAddHead[id * SERIES_STAT_COUNT + stat]; }
+    const std::string &tsAddTail(int id, int stat = SERIES_VALUE) const { return _tsAddTail[id * SERIES_STAT_COUNT + stat]; }
+    /* RESP encoded field names for XADD */
+    const std::string &field(int id, int stat = SERIES_VALUE) const { return _fields[id * SERIES_STAT_COUNT + stat]; }
+
+private:
+    std::string _serial;
+    std::vector<std::string> _names;
+    std::vector<std::string> _keys;
+    std::vector<std::string> _labels;
+    std::vector<int> _decimals;
+    std::vector<std::string> _tsAddHead;
+    std::vector<std::string> _tsAddTail;
+    std::vector<std::string> _fields;
+};
+
+#endif /* SERIES_H_ */
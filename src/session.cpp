@@ -0,0 +1,603 @@
+/*
+ * Inverter sessions
+ */
+
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <future>
+#include <Log.h>
+#include "session.h"
+#include "in_smadata2plus.h"
+#include "workpool.h"
+#include "trace.h"
+
+namespace
+{
+/* Started suspended and destroyed by the loop once done */
+struct SessionTask
+{
+    struct promise_type
+    {
+        SessionTask get_return_object() { return {std::coroutine_handle<promise_type>::from_promise(*this)}; }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+    std::coroutine_handle<promise_type> handle;
+};
+}
+
+/* RFCOMM connects in progress on the adapter. Only the loop thread
+ * acquires, a session releases on whichever thread it runs */
+struct paging
+{
+    std::atomic<int> active{0};
+    int limit;      // 0 = no limit
+    int queued = 0; // sessions and jobs waiting for a page, loop thread only
+
+    bool acquire()
+    {
+        if (limit > 0 && active.load(std::memory_order_relaxed) >= limit)
+            return false;
+        active.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+};
+
+struct session
+{
+    struct bluetooth_inverter inv;
+    struct smadata2_l1_packet recv_pl1;
+    struct smadata2_l2_packet recv_pl2;
+    struct smadata2_l1_packet sent_pl1;
+    struct smadata2_l2_packet sent_pl2;
+    unsigned int cycle;
+    std::vector<vec_data> samples;
+    std::vector<session_download> downloads;
+    session_done done;
+    bool ok;
+    paging *adapter;
+    bool page; // holds a page of the adapter
+    /* what the suspended coroutine waits for */
+    std::coroutine_handle<> waiting;
+    short events;     // 0 for a page, POLLOUT while connecting, POLLIN for a response
+    int cmdcode;      // L1 command of the response
+    uint64_t deadline;
+    bool failed;
+    /* set while a decode worker owns the session */
+    std::atomic<bool> busy{false};
+    SessionTask task;
+};
+
+/* Consume buffered packets until one with the wanted command */
+static bool takeResponse(session &s)
+{
+    while (in_smadata2plus_level1_complete(&s.inv))
+    {
+        if (in_smadata2plus_level1_packet_read(&s.inv, &s.recv_pl1, &s.recv_pl2) == s.cmdcode)
+            return true;
+    }
+    return false;
+}
+
+/* co_await paged{s, deadline} : true once the adapter can page one more
+ * device, false when the deadline passed first. Local sockets aren't paged */
+struct paged
+{
+    session &s;
+    uint64_t deadline;
+
+    bool await_ready()
+    {
+        s.failed = false;
+        if (strncmp(s.inv.macaddr, "unix:", 5) == 0)
+            return true;
+        s.page = s.adapter->queued == 0 && s.adapter->acquire();
+        return s.page;
+    }
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        s.waiting = h;
+        s.events = 0;
+        s.deadline = deadline;
+        s.adapter->queued++;
+    }
+    bool await_resume()
+    {
+        s.waiting = nullptr;
+        return !s.failed;
+    }
+};
+
+/* Blocking request that pages a device outside a session */
+struct page_job
+{
+    std::function<void()> job;
+    std::function<void()> done;
+    std::future<void> running; // valid once it holds a page
+};
+
+/* co_await connected(s, deadline) : true once the socket is connected, the
+ * page is given back either way */
+struct connected
+{
+    session &s;
+    uint64_t deadline;
+    int state = -1;
+    int64_t started = 0;
+
+    bool await_ready()
+    {
+        if (s.inv.trace)
+            started = FlightRecorder::now();
+        state = in_bluetooth_connect_start(&s.inv);
+        return state <= 0;
+    }
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        s.waiting = h;
+        s.events = POLLOUT;
+        s.deadline = deadline;
+    }
+    bool await_resume()
+    {
+        s.waiting = nullptr;
+        if (state == 1)
+            state = !s.failed && in_bluetooth_connect_finish(&s.inv) == 0 ? 0 : -1;
+        if (s.page)
+            s.adapter->active.fetch_sub(1, std::memory_order_relaxed);
+        s.page = false;
+        if (s.inv.trace)
+            s.inv.trace->add("connect", started, FlightRecorder::now());
+        return state == 0;
+    }
+};
+
+/* co_await send(s, packet) : the packets are small enough for the socket
+ * buffer, so this never suspends */
+struct send
+{
+    session &s;
+    struct smadata2_l1_packet *packet;
+
+    bool await_ready() { return true; }
+    void await_suspend(std::coroutine_handle<>) {}
+    bool await_resume()
+    {
+        in_smadata2plus_level1_packet_send(&s.inv, packet);
+        return true;
+    }
+};
+
+/* co_await sendQuery{s, query} : as send, from the cached frame of the query */
+struct sendQuery
+{
+    session &s;
+    const struct smadata2_query *query;
+
+    bool await_ready() { return true; }
+    void await_suspend(std::coroutine_handle<>) {}
+    bool await_resume()
+    {
+        in_smadata2plus_query_send(&s.inv, query);
+        return true;
+    }
+};
+
+/* co_await response(s, cmdcode, deadline) : true when a packet with cmdcode
+ * arrived in time, it is in s.recv_pl1 and s.recv_pl2 */
+struct response
+{
+    session &s;
+    int cmdcode;
+    uint64_t deadline;
+    int64_t started = 0;
+
+    bool await_ready()
+    {
+        if (s.inv.trace)
+            started = FlightRecorder::now();
+        s.cmdcode = cmdcode;
+        s.failed = false;
+        return takeResponse(s);
+    }
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        s.waiting = h;
+        s.events = POLLIN;
+        s.deadline = deadline;
+    }
+    bool await_resume()
+    {
+        s.waiting = nullptr;
+        if (s.inv.trace)
+            s.inv.trace->add(in_smadata2plus_wait_name(cmdcode), started, FlightRecorder::now());
+        return !s.failed;
+    }
+};
+
+class SessionLoop::Impl
+{
+public:
+    Impl(Thread &thread, uint32_t tick, uint32_t timeout, size_t workers, uint32_t connectTimeout,
+         int maxConnects)
+        : _timer(thread, tick, true, "sessions"), _tick(tick), _timeout(timeout),
+          _connectTimeout(connectTimeout), _pool(workers ? new WorkPool(workers) : NULL)
+    {
+        _adapter.limit = maxConnects;
+        if (pipe2(_wake, O_NONBLOCK | O_CLOEXEC) < 0)
+        {
+            WARN("[Session] wakeup pipe failed: %s", strerror(errno));
+            _wake[0] = _wake[1] = -1;
+        }
+        _timer >> [&](const TimerMsg &)
+        {
+            onTick();
+        };
+    }
+
+    ~Impl()
+    {
+        _jobs.clear(); // waits for running jobs
+        _pool.reset();
+        for (auto &s : _sessions)
+        {
+            s->task.handle.destroy();
+            close(s->inv.socket_fd);
+        }
+        close(_wake[0]);
+        close(_wake[1]);
+    }
+
+    void start(const std::string &device, const std::string &password, unsigned int cycle,
+               struct smadata2_stats *stats, FlightRecorder *trace,
+               const std::vector<session_download> &downloads, session_done done)
+    {
+        std::unique_ptr<session> s(new session());
+        strncpy(s->inv.macaddr, device.c_str(), sizeof(s->inv.macaddr) - 1);
+        strncpy((char *)s->inv.password, password.c_str(), sizeof(s->inv.password) - 1);
+        s->inv.stats = stats;
+        s->inv.trace = trace;
+        s->inv.socket_fd = -1;
+        s->inv.connect_ms = s->inv.handshake_ms = -1;
+        for (int i = 0; i < SMADATA2_MAX_QUERIES; i++)
+            s->inv.query_ms[i] = -1;
+        s->adapter = &_adapter;
+        s->cycle = cycle;
+        s->done = done;
+        s->samples.reserve(SMADATA2PLUS_REG_COUNT);
+        s->downloads = downloads;
+        for (auto &d : s->downloads)
+            d.count = -1;
+        s->task = run(*s);
+        s->task.handle.resume();
+        _sessions.push_back(std::move(s));
+        if (_sessions.size() == 1 && _jobs.empty())
+            _timer.start();
+        reap();
+    }
+
+    void page(std::function<void()> job, std::function<void()> done)
+    {
+        _jobs.push_back(std::unique_ptr<page_job>(new page_job{job, done, {}}));
+        _adapter.queued++;
+        if (_jobs.size() == 1 && _sessions.empty())
+            _timer.start();
+    }
+
+    size_t active() const { return _sessions.size(); }
+
+private:
+    uint64_t deadline() const { return Sys::millis() + _timeout; }
+
+    SessionTask run(session &s)
+    {
+        struct bluetooth_inverter *inv = &s.inv;
+
+        if (!co_await paged{s, deadline()})
+            co_return;
+        int64_t started = in_smadata2plus_millis();
+        if (!co_await connected{s, Sys::millis() + _connectTimeout})
+            co_return;
+        inv->connect_ms = in_smadata2plus_millis() - started;
+        started += inv->connect_ms;
+
+        /* Wait for Broadcast request and answer it */
+        if (!co_await response{s, SMADATA2PLUS_L1_CMDCODE_BROADCAST, deadline()})
+            co_return;
+        in_smadata2plus_broadcast_reply(inv, &s.recv_pl1, &s.sent_pl1);
+        co_await send{s, &s.sent_pl1};
+        if (!co_await response{s, SMADATA2PLUS_L1_CMDCODE_10, deadline()})
+            co_return;
+        if (!co_await response{s, SMADATA2PLUS_L1_CMDCODE_5, deadline()})
+            co_return;
+
+        /* First L2 packet, answered with serial and model */
+        in_smadata2plus_init_packet(1, &s.sent_pl2);
+        in_smadata2plus_level2_request(inv, &s.sent_pl1, &s.sent_pl2);
+        co_await send{s, &s.sent_pl1};
+        if (!co_await response{s, SMADATA2PLUS_L1_CMDCODE_LEVEL2, deadline()})
+            co_return;
+        in_smadata2plus_identify(inv, &s.recv_pl2);
+        in_smadata2plus_init_packet(2, &s.sent_pl2);
+        in_smadata2plus_level2_request(inv, &s.sent_pl1, &s.sent_pl2);
+        co_await send{s, &s.sent_pl1};
+
+        /* Login */
+        in_smadata2plus_login_packet(inv, &s.sent_pl2);
+        in_smadata2plus_level2_request(inv, &s.sent_pl1, &s.sent_pl2);
+        co_await send{s, &s.sent_pl1};
+        if (!co_await response{s, SMADATA2PLUS_L1_CMDCODE_LEVEL2, deadline()})
+            co_return;
+        inv->handshake_ms = in_smadata2plus_millis() - started;
+
+        /* Spot values */
+        const struct smadata2_query *query;
+        unsigned int pos = 0;
+        while ((query = in_smadata2plus_next_query(&pos, s.cycle, inv->model)) != NULL)
+        {
+            int64_t sent = in_smadata2plus_millis();
+            int64_t traced = inv->trace ? FlightRecorder::now() : 0;
+            co_await sendQuery{s, query};
+            if (!co_await response{s, SMADATA2PLUS_L1_CMDCODE_LEVEL2, deadline()})
+                co_return;
+            inv->query_ms[pos - 1] = in_smadata2plus_millis() - sent;
+            if (inv->trace)
+                inv->trace->add(query->q_name, traced, FlightRecorder::now());
+            in_smadata2plus_parse_values(&s.recv_pl1, &s.recv_pl2, query, s.samples, inv->stats);
+        }
+        in_smadata2plus_refine_model(inv, s.samples);
+        in_smadata2plus_validate_values(s.samples, inv->model, inv->stats);
+        s.ok = true;
+
+        /* Archive and event log, a failed download leaves the values valid */
+        std::vector<unsigned char> raw;
+        for (auto &d : s.downloads)
+        {
+            int64_t traced = inv->trace ? FlightRecorder::now() : 0;
+            bool events = in_smadata2plus_archive_record_len(d.command) == SMADATA2PLUS_EVENT_RECORD_LEN;
+            in_smadata2plus_archive_packet(d.command, d.from, d.to, &s.sent_pl2);
+            in_smadata2plus_level2_request(inv, &s.sent_pl1, &s.sent_pl2);
+            co_await send{s, &s.sent_pl1};
+            raw.clear();
+            int count = 0;
+            do
+            {
+                s.recv_pl2.content_length = 0;
+                if (!co_await response{s, SMADATA2PLUS_L1_CMDCODE_LEVEL2, deadline()})
+                    co_return;
+                int records = in_smadata2plus_archive_collect(d.command, &s.recv_pl2, raw);
+                count = records < 0 ? -1 : count + records;
+            } while (count >= 0 && s.recv_pl2.fragment != 0);
+            if (count < 0)
+                continue;
+            if (events)
+                in_smadata2plus_event_records(raw, d.events);
+            else
+                in_smadata2plus_archive_records(raw, d.records);
+            d.count = count;
+            if (inv->trace)
+                inv->trace->add(events ? "events" : "archive", traced, FlightRecorder::now());
+        }
+    }
+
+    /* Waits on the sockets for up to one tick and resumes a session as soon
+     * as its response is complete, its connect finished or its deadline
+     * passed. Only reads the sockets and finds frame boundaries, decoding
+     * the frames and building the next request is left to step() */
+    void onTick()
+    {
+        std::vector<struct pollfd> fds;
+        std::vector<session *> waiting;
+        std::vector<session *> next; // to resume
+        uint64_t until = Sys::millis() + _tick;
+        for (;;)
+        {
+            /* the pipe first, a worker done with a step changes the set */
+            fds.assign(1, {_wake[0], POLLIN, 0});
+            waiting.clear();
+            next.clear();
+            bool busy = false;
+            uint64_t now = Sys::millis();
+            uint64_t due = until;
+            runJobs();
+            for (auto &s : _sessions)
+            {
+                if (s->busy.load(std::memory_order_acquire))
+                {
+                    busy = true;
+                    continue;
+                }
+                if (!s->waiting)
+                    continue;
+                if (s->events == 0)
+                {
+                    /* pages are handed out in start order */
+                    if (_adapter.acquire())
+                        s->page = true;
+                    else if (now >= s->deadline)
+                    {
+                        WARN("[Session] %s timeout waiting for a page", s->inv.macaddr);
+                        s->failed = true;
+                    }
+                    else
+                        continue;
+                    _adapter.queued--;
+                    next.push_back(s.get());
+                    continue;
+                }
+                fds.push_back({s->inv.socket_fd, s->events, 0});
+                waiting.push_back(s.get());
+                due = std::min(due, s->deadline);
+            }
+            /* pages and jobs are looked at again on the next tick */
+            if (waiting.empty() && next.empty() && !busy)
+                break;
+
+            int timeout = next.empty() && due > now ? (int)(due - now) : 0;
+            bool failed = poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR;
+            if (failed)
+                WARN("[Session] poll failed: %s", strerror(errno));
+            if (fds[0].revents)
+            {
+                char drain[64];
+                while (read(_wake[0], drain, sizeof(drain)) > 0)
+                    ;
+            }
+
+            now = Sys::millis();
+            for (size_t i = 0; i < waiting.size(); i++)
+            {
+                session &s = *waiting[i];
+                short revents = fds[i + 1].revents;
+                bool ready = false;
+                if (revents && s.events == POLLIN)
+                {
+                    if (in_bluetooth_receive(&s.inv) < 0)
+                        s.failed = ready = true;
+                    else
+                        ready = in_smadata2plus_level1_complete(&s.inv);
+                }
+                else if (revents)
+                {
+                    ready = true;
+                }
+                if (!ready && now >= s.deadline)
+                {
+                    WARN("[Session] %s timeout waiting for %s", s.inv.macaddr,
+                         s.events == POLLOUT ? "connect" : "response");
+                    s.failed = ready = true;
+                }
+                if (ready)
+                    next.push_back(&s);
+            }
+            for (session *s : next)
+            {
+                if (_pool)
+                {
+                    s->busy.store(true, std::memory_order_relaxed);
+                    _pool->submit([this, s]
+                                  {
+                                      step(*s);
+                                      wake();
+                                  });
+                }
+                else
+                {
+                    step(*s);
+                }
+            }
+            reap();
+            if (failed || Sys::millis() >= until)
+                break;
+        }
+    }
+
+    /* Decode what arrived and run the session up to its next wait, on a
+     * pool worker when there is one */
+    static void step(session &s)
+    {
+        if (s.failed || s.events != POLLIN || takeResponse(s))
+            s.waiting.resume();
+        s.busy.store(false, std::memory_order_release);
+    }
+
+    /* Interrupt the wait of onTick, a worker is done with a step */
+    void wake()
+    {
+        char c = 0;
+        if (_wake[1] >= 0 && write(_wake[1], &c, 1) < 0 && errno != EAGAIN)
+            WARN("[Session] wakeup failed: %s", strerror(errno));
+    }
+
+    /* Start the queued jobs the adapter has pages for, and finish the
+     * ones that ran */
+    void runJobs()
+    {
+        for (size_t i = 0; i < _jobs.size();)
+        {
+            page_job &j = *_jobs[i];
+            if (!j.running.valid())
+            {
+                if (!_adapter.acquire())
+                    break;
+                _adapter.queued--;
+                j.running = std::async(std::launch::async, j.job);
+            }
+            if (j.running.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            {
+                i++;
+                continue;
+            }
+            _adapter.active.fetch_sub(1, std::memory_order_relaxed);
+            std::unique_ptr<page_job> finished = std::move(_jobs[i]);
+            _jobs.erase(_jobs.begin() + i);
+            if (finished->done)
+                finished->done();
+        }
+    }
+
+    /* Hand the results of finished sessions to their callback */
+    void reap()
+    {
+        for (size_t i = 0; i < _sessions.size();)
+        {
+            session &s = *_sessions[i];
+            if (s.busy.load(std::memory_order_acquire) || !s.task.handle.done())
+            {
+                i++;
+                continue;
+            }
+            s.task.handle.destroy();
+            if (s.inv.socket_fd >= 0)
+                close(s.inv.socket_fd);
+            std::unique_ptr<session> finished = std::move(_sessions[i]);
+            _sessions.erase(_sessions.begin() + i);
+            if (finished->done)
+                finished->done(finished->ok, finished->samples, finished->downloads, finished->inv);
+        }
+        if (_sessions.empty() && _jobs.empty())
+            _timer.stop();
+    }
+
+    TimerSource _timer;
+    uint32_t _tick;
+    uint32_t _timeout;
+    uint32_t _connectTimeout;
+    paging _adapter;
+    std::vector<std::unique_ptr<session>> _sessions;
+    std::vector<std::unique_ptr<page_job>> _jobs;
+    std::unique_ptr<WorkPool> _pool;
+    int _wake[2]; // written by the workers after a step
+};
+
+SessionLoop::SessionLoop(Thread &thread, uint32_t tick, uint32_t timeout, size_t workers,
+                         uint32_t connectTimeout, int maxConnects)
+    : _impl(new Impl(thread, tick, timeout, workers, connectTimeout, maxConnects)) {}
+
+SessionLoop::~SessionLoop() {}
+
+void SessionLoop::start(const std::string &device, const std::string &password, unsigned int cycle,
+                        struct smadata2_stats *stats, FlightRecorder *trace,
+                        const std::vector<session_download> &downloads, session_done done)
+{
+    _impl->start(device, password, cycle, stats, trace, downloads, done);
+}
+
+void SessionLoop::page(std::function<void()> job, std::function<void()> done)
+{
+    _impl->page(job, done);
+}
+
+size_t SessionLoop::active() const
+{
+    return _impl->active();
+}
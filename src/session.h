@@ -0,0 +1,80 @@
+/*
+ * Inverter sessions
+ *
+ * The handshake, login, spot value queries and archive or event log
+ * downloads of an inverter as one coroutine, suspended on every response instead of blocking, so many
+ * inverters can be polled from one thread. A timer on a limero Thread
+ * drives the loop : every tick waits on the sockets for up to one tick
+ * and resumes a session as soon as its response is complete or its
+ * deadline passed, so a round trip doesn't wait for the next tick.
+ *
+ * With decode workers the loop thread only reads the sockets and finds
+ * frame boundaries : unescaping, checksums, value parsing and building
+ * the next request of a session run on a work-stealing pool, one step of
+ * a session at a time. A worker done with a step wakes the wait through a
+ * pipe. Archive and event log records are decoded in the step that reads
+ * the last packet of the response, so on a worker too.
+ *
+ * Connects don't block either. The adapter pages one device at a time, so
+ * only a few RFCOMM connects are started at once, the other sessions wait
+ * for their turn in start order, at most one response timeout. Blocking
+ * requests that page a device outside a session, like the name request,
+ * take their turn the same way on a thread of their own.
+ *
+ * Coroutines need C++20, this interface doesn't : session.cpp is the
+ * only file built with -std=c++20.
+ */
+
+#ifndef SESSION_H_
+#define SESSION_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <limero.h>
+#include "in_bluetooth.h"
+
+/* Archive or event log range read after the spot values. count is the
+ * number of records the inverter sent, -1 when the download failed or
+ * didn't run */
+struct session_download
+{
+    unsigned int command; // SMADATA2PLUS_ARCHIVE_* or SMADATA2PLUS_EVENTS_*
+    time_t from;
+    time_t to;
+    int count;
+    std::vector<smadata2_archive_record> records; // archive commands
+    std::vector<smadata2_event_record> events;    // event log commands
+};
+
+/* Called on the loop thread when a session ends, samples are validated.
+ * inv holds the timings and link errors of the session */
+typedef std::function<void(bool ok, std::vector<vec_data> &samples, std::vector<session_download> &downloads,
+                           const struct bluetooth_inverter &inv)>
+    session_done;
+
+class SessionLoop
+{
+public:
+    /* timeout for each response, connectTimeout for the connect. At most
+     * maxConnects RFCOMM connects page at once, 0 = no limit */
+    SessionLoop(Thread &thread, uint32_t tick, uint32_t timeout, size_t workers = 0,
+                uint32_t connectTimeout = 5000, int maxConnects = 1);
+    ~SessionLoop();
+    void start(const std::string &device, const std::string &password, unsigned int cycle,
+               struct smadata2_stats *stats, FlightRecorder *trace,
+               const std::vector<session_download> &downloads, session_done done);
+    /* Run job on a thread of its own once the adapter has a page for it,
+     * then done on the loop thread */
+    void page(std::function<void()> job, std::function<void()> done);
+    size_t active() const;
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> _impl;
+};
+
+#endif /* SESSION_H_ */
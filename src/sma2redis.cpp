@@ -11,9 +11,11 @@
 #include <limits.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <string>
+#include <memory>
 //#include <iostream>
 //#include <sstream>
 #include <iomanip>
@@ -27,38 +29,78 @@
 #include "in_smadata2plus.h"
 #include <limero.h>
 #include <hiredis.h>
-#include <Redis.h>
 #include <StringUtility.h>
 #include <ConfigFile.h>
+#include "scheduler.h"
+#include "filter.h"
+#include "series.h"
+#include "out_redis.h"
+#include "aggregate.h"
+#include "energy.h"
+#include "archive.h"
+#include "events.h"
+#include "session.h"
+#include "publisher.h"
+#include "metrics.h"
+#include "trace.h"
 
 Log logger;
 using namespace std;
 
 void process_data(vector<vec_data> data_vector, int debug, string &line, string &header);
-void dataToRedis(Redis &redis, vector<vec_data> &data_vector, std::string serial);
-std::unordered_map<std::string, std::string> inputToRedisLabels = {
-    {"power_ac", "input power acdc ac"},
-    {"voltage_ac_l1", "input voltage acdc ac line l1"},
-    {"voltage_ac_l2", "input voltage acdc ac line l2"},
-    {"voltage_ac_l3", "input voltage acdc ac line l3"},
-    {"power_ac_l1", "input power acdc ac line l1"},
-    {"power_ac_l2", "input power acdc ac line l2"},
-    {"power_ac_l3", "input power acdc ac line l3"},
-    {"voltage_dc_1", "input voltage acdc dc line l1"},
-    {"voltage_dc_2", "input voltage acdc dc line l2"},
-    {"voltage_dc_3", "input voltage acdc dc line l3"},
-    {"power_dc_1", "input power acdc dc line l1"},
-    {"power_dc_2", "input power acdc dc line l2"},
-    {"power_dc_3", "input power acdc dc line l3"},
-    {"current_ac_l1", "input current acdc ac line l1"},
-    {"current_ac_l2", "input current acdc ac line l2"},
-    {"current_ac_l3", "input current acdc ac line l3"},
-    {"power_ac_max_l1", "input maxPower acdc ac line l1"},
-    {"power_ac_max_l2", "input maxPower acdc ac line l2"},
-    {"power_ac_max_l3", "input maxPower acdc ac line l3"},
-    {"yield_total", "input totalPower acdc ac"}
-
+void pollDevice(Publisher &publisher, RedisSink &bulk, DeadbandFilter &filter,
+                const aggregate_config &aggregate, const std::string &device, uint64_t spareUntil);
+/* State kept per device between polls */
+struct device_context
+{
+    SeriesCatalog catalog;
+    std::vector<vec_data> samples;
+    AggregateWindow window;
+    EnergyIntegrator energy;
+    unsigned int polls; // selects the queries that take turns
+    bool inFlight = false; // a name request or coroutine session of the device is running
+    smadata2_stats stats[SMADATA2PLUS_REG_COUNT];
+    archive_cursor cursor;
+    uint64_t archiveDue;
+    std::vector<smadata2_archive_record> records;
+    uint64_t eventsDue;
+    std::vector<smadata2_event_record> events;
+    /* metrics of the device, registered once the serial is known */
+    Histogram *connectMs;
+    Histogram *handshakeMs;
+    Histogram *queryMs[SMADATA2_MAX_QUERIES];
+    Counter *badChecksum;
+    Counter *badFcs;
+    Counter *failures;
+    FlightRecorder *trace; // NULL when tracing is off
 };
+std::unordered_map<std::string, device_context> deviceContexts;
+uint32_t connectTimeout = 5000; // msec, also bounds the name lookup
+uint32_t energyMaxGap = 0; // 0 = no energy integration
+double energyTolerance = 50.0;
+std::string energyStateDir; // empty = day counters not persisted
+uint32_t energySaveInterval = 300;
+archive_config archive;
+ArchiveCursor archiveCursor;
+events_config eventLog;
+EventIndex eventIndex;
+MetricsRegistry metrics;
+Tracer tracer;
+
+device_context *prepareDevice(const std::string &device, const aggregate_config &aggregate);
+bool setupDevice(device_context &ctx, const std::string &device, const std::string &deviceName,
+                 const aggregate_config &aggregate);
+void publishSamples(Publisher &publisher, DeadbandFilter &filter, const aggregate_config &aggregate,
+                    device_context &ctx);
+void closeWindow(Publisher &publisher, device_context &ctx, uint64_t now);
+void registerMetrics(device_context &ctx);
+static void traceSpan(FlightRecorder *trace, const char *name, int64_t start);
+void recordSession(device_context &ctx, const struct bluetooth_inverter &inv, bool ok);
+void sessionFailed(device_context &ctx, const struct bluetooth_inverter &inv);
+void fetchArchive(RedisSink &redis, device_context &ctx, struct bluetooth_inverter *inv);
+void fetchEvents(RedisSink &redis, device_context &ctx, struct bluetooth_inverter *inv);
+void planDownloads(device_context &ctx, uint64_t spareUntil, std::vector<session_download> &downloads);
+void storeDownloads(RedisSink &redis, device_context &ctx, std::vector<session_download> &downloads);
 
 int main(int argc, char **argv)
 {
@@ -69,78 +111,496 @@ int main(int argc, char **argv)
     configurator(config, argc, argv);
     Thread workerThread("worker");
 
-    Redis redis(workerThread, config["redis"].as<JsonObject>());
+    in_smadata2plus_load_models(config["sma"]["models"] | "sma-models.txt");
+
+    RedisSink redis(config["redis"].as<JsonObject>());
     redis.connect();
+    publisher_config publishing = publisherConfig(config["publisher"].as<JsonObject>());
+    Thread publisherThread("publisher");
+    Publisher publisher(publishing.enabled ? publisherThread : workerThread, redis, publishing);
+    /* archive and event downloads wait for Redis to accept their records
+       before moving the cursor, next to a publisher thread they get a
+       connection of their own */
+    RedisSink bulkRedis(config["redis"].as<JsonObject>());
+    RedisSink &bulk = publishing.enabled ? bulkRedis : redis;
+    publisher.metrics(metrics);
+    MetricsServer metricsServer(metrics);
+    metricsServer.start(config["metrics"].as<JsonObject>());
+    tracer.config(config["trace"].as<JsonObject>());
+    signal(SIGUSR1, [](int)
+           { tracer.requestDump(); });
+    TimerSource traceTimer(workerThread, 1000, true, "trace");
+    traceTimer >> [&](const TimerMsg &)
+    {
+        tracer.poll();
+    };
+    traceTimer.start();
 
-    TimerSource clock(workerThread, 1 * 60 * 1000, true, "clock");
+    DeadbandFilter filter;
+    filter.config(config["filter"].as<JsonObject>());
+    aggregate_config aggregate = aggregateConfig(config["aggregate"].as<JsonObject>());
+    if (config["energy"]["enabled"] | false)
+    {
+        energyMaxGap = config["energy"]["max_gap"] | 600;
+        energyTolerance = config["energy"]["tolerance"] | 50.0;
+        energyStateDir = config["energy"]["state_dir"] | "";
+        energySaveInterval = config["energy"]["save_interval"] | 300;
+    }
+    /* windows also close while their inverter is silent, e.g. after dusk */
+    TimerSource windowTimer(workerThread, 1000, true, "window");
+    windowTimer >> [&](const TimerMsg &)
+    {
+        uint64_t now = time(NULL) * 1000ULL;
+        for (auto &kv : deviceContexts)
+        {
+            if (!kv.second.catalog.empty())
+                closeWindow(publisher, kv.second, now);
+        }
+    };
+    if (aggregate.window)
+        windowTimer.start();
+    archive = archiveConfig(config["archive"].as<JsonObject>());
+    archiveCursor.dir(archive.cursor_dir);
+    eventLog = eventsConfig(config["events"].as<JsonObject>());
+    eventIndex.capacity(eventLog.capacity);
+
+    PollScheduler scheduler(workerThread,
+                            config["sma"]["period"] | 60000,
+                            config["sma"]["deadline"] | 0,
+                            config["sma"]["jitter"] | 1000,
+                            config["sma"]["tick"] | 250);
 
-    std::vector<std::string> devices;
     for (auto dev : config["sma"]["devices"].as<JsonArray>())
     {
-        devices.push_back(dev.as<std::string>());
+        scheduler.add(dev.as<std::string>());
     }
 
-    redis.response() >> [&](const Json &resp)
+    /* "blocking" polls one inverter after the other, "coroutine" keeps the
+       sessions of all inverters in flight on the worker thread */
+    std::string sessions = config["sma"]["sessions"] | "blocking";
+    connectTimeout = config["sma"]["connect_timeout"] | 5000;
+    SessionLoop loop(workerThread, config["sma"]["tick"] | 250, config["sma"]["timeout"] | 5000,
+                     config["sma"]["workers"] | 0, connectTimeout, config["sma"]["max_connects"] | 1);
+    /* declared here, the scheduler and page callbacks call it long after
+       the branch below. The poll of slot ends with the session, a deadline
+       missed is reported then */
+    auto session = [&](device_context *ctx, poll_slot *slot, uint64_t started, uint64_t deadline)
     {
-        std::string result;
-        serializeJson(resp, result);
-        INFO("Redis response: %s", result.c_str());
+        /* archive and event downloads only start in the first half of the slot */
+        std::vector<session_download> downloads;
+        planDownloads(*ctx, deadline - scheduler.deadline() / 2, downloads);
+        loop.start(slot->device, "0000", ctx->polls++, ctx->stats, ctx->trace, downloads,
+                   [&, ctx, slot, started, deadline](bool ok, std::vector<vec_data> &samples,
+                                                     std::vector<session_download> &downloads,
+                                                     const struct bluetooth_inverter &inv)
+                   {
+                       ctx->inFlight = false;
+                       scheduler.finished(*slot, started, deadline);
+                       if (!ok)
+                       {
+                           sessionFailed(*ctx, inv);
+                           return;
+                       }
+                       recordSession(*ctx, inv, true);
+                       ctx->samples.swap(samples);
+                       storeDownloads(bulk, *ctx, downloads);
+                       publishSamples(publisher, filter, aggregate, *ctx);
+                   });
     };
-
-    clock >> [&](const TimerMsg &)
+    if (sessions == "coroutine")
     {
-        for (auto device : devices)
-        {
-            INFO("Connecting to device: %s", device.c_str());
-            std::string deviceName = get_bt_name(device);
-            INFO("Device name: %s", deviceName.c_str());
-            if (deviceName.empty())
-            {
-                INFO("Device not found: %s", device.c_str());
-                continue;
-            };
-            std::string serial = get_serial(deviceName);
-            INFO("Serial: %s", serial.c_str());
-
-            // Inizialize Bluetooth Inverter
-            vector<vec_data> data_vector;
-
-            struct bluetooth_inverter inv = {{0}};
-            strcpy(inv.macaddr, device.c_str()); /// Change to strncpy
-            memcpy(inv.password, "0000", 5);
-            in_bluetooth_connect(&inv);
-            in_smadata2plus_connect(&inv);
-            in_smadata2plus_login(&inv);
-            in_smadata2plus_get_values(&inv, data_vector);
-            close(inv.socket_fd);
-            dataToRedis(redis, data_vector, serial);
-        }
-    };
+        scheduler.handler([&](poll_slot &slot)
+                          {
+                              device_context *ctx = &deviceContexts[slot.device];
+                              if (ctx->inFlight)
+                                  return false;
+                              ctx->inFlight = true;
+                              poll_slot *polled = &slot;
+                              uint64_t started = Sys::millis();
+                              uint64_t deadline = slot.base_due + scheduler.deadline();
+                              if (!ctx->catalog.empty())
+                              {
+                                  session(ctx, polled, started, deadline);
+                                  return true;
+                              }
+                              /* the name request pages the device too : off the
+                                 loop thread and within max_connects */
+                              std::string device = slot.device;
+                              auto name = std::make_shared<std::string>();
+                              loop.page([device, name]
+                                        { *name = get_bt_name(device, connectTimeout); },
+                                        [&, ctx, polled, started, deadline, device, name]
+                                        {
+                                            if (setupDevice(*ctx, device, *name, aggregate))
+                                            {
+                                                session(ctx, polled, started, deadline);
+                                                return;
+                                            }
+                                            ctx->inFlight = false;
+                                            scheduler.finished(*polled, started, deadline);
+                                        });
+                              return true;
+                          });
+    }
+    else
+    {
+        /* archive and event downloads only run in the first half of the slot */
+        scheduler.handler([&](poll_slot &slot)
+                          {
+                              pollDevice(publisher, bulk, filter, aggregate, slot.device,
+                                         slot.base_due + scheduler.deadline() / 2);
+                              return true;
+                          });
+    }
+    scheduler.start();
+    publisher.start();
+    if (publishing.enabled)
+        publisherThread.start();
     workerThread.run();
     return 0;
 }
 
+/* Context of a device, set up on its first poll. NULL if the device isn't
+ * reachable */
+device_context *prepareDevice(const std::string &device, const aggregate_config &aggregate)
+{
+    INFO("Connecting to device: %s", device.c_str());
+    device_context &ctx = deviceContexts[device];
+    if (ctx.catalog.empty() && !setupDevice(ctx, device, get_bt_name(device, connectTimeout), aggregate))
+        return NULL;
+    return &ctx;
+}
+
+/* Set up the context of a device once its name is known, false if the
+ * name request got no answer */
+bool setupDevice(device_context &ctx, const std::string &device, const std::string &deviceName,
+                 const aggregate_config &aggregate)
+{
+    INFO("Device name: %s", deviceName.c_str());
+    if (deviceName.empty())
+    {
+        INFO("Device not found: %s", device.c_str());
+        return false;
+    };
+    std::string serial = get_serial(deviceName);
+    INFO("Serial: %s", serial.c_str());
+    ctx.catalog.intern(serial);
+    registerMetrics(ctx);
+    ctx.trace = tracer.recorder(serial);
+    ctx.samples.reserve(SMADATA2PLUS_REG_COUNT);
+    ctx.energy.config(energyMaxGap, energyTolerance);
+    if (energyMaxGap && !energyStateDir.empty())
+        ctx.energy.persist(energyStateDir + "/" + serial + ".energy", energySaveInterval);
+    if (aggregate.window)
+        ctx.window.init(aggregate, time(NULL) * 1000ULL);
+    ctx.cursor = archiveCursor.load(serial);
+    ctx.archiveDue = 0;
+    ctx.eventsDue = 0;
+    ctx.polls = 0;
+    return true;
+}
+
+void pollDevice(Publisher &publisher, RedisSink &bulk, DeadbandFilter &filter,
+                const aggregate_config &aggregate, const std::string &device, uint64_t spareUntil)
+{
+    device_context *pctx = prepareDevice(device, aggregate);
+    if (!pctx)
+        return;
+    device_context &ctx = *pctx;
+
+    // Inizialize Bluetooth Inverter
+    ctx.samples.clear();
+
+    struct bluetooth_inverter inv = {{0}};
+    strcpy(inv.macaddr, device.c_str()); /// Change to strncpy
+    memcpy(inv.password, "0000", 5);
+    inv.stats = ctx.stats;
+    inv.trace = ctx.trace;
+    int64_t started = in_smadata2plus_millis();
+    int64_t traced = FlightRecorder::now();
+    int connected = in_bluetooth_connect(&inv, connectTimeout);
+    inv.connect_ms = in_smadata2plus_millis() - started;
+    traceSpan(inv.trace, "connect", traced);
+    if (connected < 0)
+    {
+        sessionFailed(ctx, inv);
+        return;
+    }
+    traced = FlightRecorder::now();
+    if (in_smadata2plus_connect(&inv) < 0 || in_smadata2plus_login(&inv) < 0)
+    {
+        close(inv.socket_fd);
+        sessionFailed(ctx, inv);
+        return;
+    }
+    inv.handshake_ms = in_smadata2plus_millis() - started - inv.connect_ms;
+    traceSpan(inv.trace, "handshake", traced);
+    if (in_smadata2plus_get_values(&inv, ctx.samples, ctx.polls++) < 0)
+    {
+        close(inv.socket_fd);
+        sessionFailed(ctx, inv);
+        return;
+    }
+    recordSession(ctx, inv, true);
+    /* at most one background download per poll, after the spot values */
+    if (archive.enabled && Sys::millis() >= ctx.archiveDue && Sys::millis() < spareUntil)
+    {
+        traced = FlightRecorder::now();
+        fetchArchive(bulk, ctx, &inv);
+        traceSpan(inv.trace, "archive", traced);
+        ctx.archiveDue = Sys::millis() + archive.interval;
+    }
+    else if (eventLog.enabled && Sys::millis() >= ctx.eventsDue && Sys::millis() < spareUntil)
+    {
+        traced = FlightRecorder::now();
+        fetchEvents(bulk, ctx, &inv);
+        traceSpan(inv.trace, "events", traced);
+        ctx.eventsDue = Sys::millis() + eventLog.interval;
+    }
+    close(inv.socket_fd);
+    publishSamples(publisher, filter, aggregate, ctx);
+}
+
+static void traceSpan(FlightRecorder *trace, const char *name, int64_t start)
+{
+    if (trace)
+        trace->add(name, start, FlightRecorder::now());
+}
+
+void registerMetrics(device_context &ctx)
+{
+    std::string device = MetricsRegistry::label("device", ctx.catalog.serial());
+    ctx.connectMs = &metrics.histogram("sma_connect_seconds", "Bluetooth connect time", device);
+    ctx.handshakeMs = &metrics.histogram("sma_handshake_seconds", "Handshake and login time", device);
+    for (unsigned int i = 0; i < SMADATA2_MAX_QUERIES; i++)
+    {
+        const char *query = in_smadata2plus_query_name(i);
+        ctx.queryMs[i] = query ? &metrics.histogram("sma_query_seconds", "Round trip of a spot value query",
+                                                    device + "," + MetricsRegistry::label("query", query))
+                               : NULL;
+    }
+    ctx.badChecksum = &metrics.counter("sma_frames_bad_checksum_total", "L1 frames with a wrong header checksum", device);
+    ctx.badFcs = &metrics.counter("sma_frames_bad_fcs_total", "L2 frames with a wrong frame check sequence", device);
+    ctx.failures = &metrics.counter("sma_session_failures_total", "Sessions that timed out or lost the link", device);
+}
+
+void recordSession(device_context &ctx, const struct bluetooth_inverter &inv, bool ok)
+{
+    if (inv.connect_ms >= 0)
+        ctx.connectMs->record(inv.connect_ms);
+    if (inv.handshake_ms >= 0)
+        ctx.handshakeMs->record(inv.handshake_ms);
+    for (int i = 0; i < SMADATA2_MAX_QUERIES; i++)
+    {
+        if (ctx.queryMs[i] && inv.query_ms[i] >= 0)
+            ctx.queryMs[i]->record(inv.query_ms[i]);
+    }
+    ctx.badChecksum->add(inv.bad_checksum);
+    ctx.badFcs->add(inv.bad_fcs);
+    if (!ok)
+        ctx.failures->add();
+}
 
+/* Count a session that timed out or lost the link and dump its trace */
+void sessionFailed(device_context &ctx, const struct bluetooth_inverter &inv)
+{
+    WARN("Session with %s failed", ctx.catalog.serial().c_str());
+    recordSession(ctx, inv, false);
+    if (ctx.trace)
+        ctx.trace->dump("failed");
+}
 
-void dataToRedis(Redis &redis, std::vector<vec_data> &data, std::string serial)
+/* Energy, aggregation or send-on-change of the samples of one poll */
+void publishSamples(Publisher &publisher, DeadbandFilter &filter, const aggregate_config &aggregate,
+                    device_context &ctx)
 {
+    if (energyMaxGap)
+        ctx.energy.update(ctx.samples);
 
-    for (auto &iter : data)
+    if (aggregate.window)
     {
-        auto r = inputToRedisLabels.find(iter.name);
-        std::string labels = "input unknown";
-        if (r != inputToRedisLabels.end())
+        closeWindow(publisher, ctx, time(NULL) * 1000ULL);
+        ctx.window.add(ctx.samples);
+        return;
+    }
+    filter.apply(ctx.catalog.serial(), ctx.samples, Sys::millis());
+    publisher.samples(ctx.catalog, ctx.samples);
+}
+
+/* Publish the statistics of a window that has ended and start the next */
+void closeWindow(Publisher &publisher, device_context &ctx, uint64_t now)
+{
+    if (!ctx.window.due(now))
+        return;
+    if (!ctx.window.empty())
+        publisher.aggregates(ctx.catalog, ctx.window);
+    ctx.window.reset(now);
+}
+
+/* First second of an archive download : after the cursor, within max_days */
+static time_t archiveFrom(int cursor, time_t now)
+{
+    time_t from = now - (time_t)archive.max_days * 86400;
+    return cursor >= from ? cursor + 1 : from;
+}
+
+/* First second of an event log download. The second of the cursor is read
+ * again, it can hold more entries */
+static time_t eventsFrom(const device_context &ctx, time_t now)
+{
+    time_t from = now - (time_t)eventLog.max_days * 86400;
+    return ctx.cursor.events >= from ? ctx.cursor.events : from;
+}
+
+/* Load the downloaded archive records in ctx.records newer than the cursor
+ * and move the cursor only once Redis accepted them */
+static bool storeArchive(RedisSink &redis, device_context &ctx, int id, int &cursor)
+{
+    /* the inverter may answer with the record just before from */
+    size_t out = 0;
+    for (auto &record : ctx.records)
+    {
+        if (record.timestamp > cursor)
+            ctx.records[out++] = record;
+    }
+    ctx.records.resize(out);
+    if (ctx.records.empty())
+        return true;
+
+    redis.bulkLoad(ctx.catalog, id, ctx.records, archive.batch);
+    if (!redis.flush())
+        return false;
+    for (auto &record : ctx.records)
+    {
+        if (record.timestamp > cursor)
+            cursor = record.timestamp;
+    }
+    INFO("[Archive] %s %s : %u records up to %d", ctx.catalog.serial().c_str(),
+         ctx.catalog.name(id).c_str(), (unsigned)ctx.records.size(), cursor);
+    return true;
+}
+
+/* Download the archive records newer than the cursor and load them */
+static bool loadArchive(RedisSink &redis, device_context &ctx, struct bluetooth_inverter *inv,
+                        unsigned int command, int id, int &cursor)
+{
+    time_t now = time(NULL);
+    ctx.records.clear();
+    if (in_smadata2plus_get_archive(inv, command, archiveFrom(cursor, now), now, ctx.records) < 0)
+        return false;
+    return storeArchive(redis, ctx, id, cursor);
+}
+
+/* Keep the archive cursors that moved */
+static void moveArchiveCursor(device_context &ctx, const archive_cursor &cursor)
+{
+    if (cursor.day == ctx.cursor.day && cursor.month == ctx.cursor.month)
+        return;
+    ctx.cursor.day = cursor.day;
+    ctx.cursor.month = cursor.month;
+    archiveCursor.save(ctx.catalog.serial(), ctx.cursor);
+}
+
+void fetchArchive(RedisSink &redis, device_context &ctx, struct bluetooth_inverter *inv)
+{
+    archive_cursor cursor = ctx.cursor;
+    loadArchive(redis, ctx, inv, SMADATA2PLUS_ARCHIVE_DAY, SMADATA2PLUS_REG_YIELD_5MIN, cursor.day);
+    loadArchive(redis, ctx, inv, SMADATA2PLUS_ARCHIVE_MONTH, SMADATA2PLUS_REG_YIELD_DAILY, cursor.month);
+    moveArchiveCursor(ctx, cursor);
+}
+
+/* True for an event logged after the one the cursor points at */
+static bool eventAfter(const smadata2_event_record &event, const archive_cursor &cursor)
+{
+    return event.timestamp > cursor.events || (event.timestamp == cursor.events && event.entry > cursor.entry);
+}
+
+/* Publish and index the downloaded event log entries in ctx.events newer
+ * than the cursor */
+static void storeEvents(RedisSink &redis, device_context &ctx)
+{
+    size_t out = 0;
+    for (auto &event : ctx.events)
+    {
+        if (eventAfter(event, ctx.cursor))
+            ctx.events[out++] = event;
+    }
+    ctx.events.resize(out);
+    if (ctx.events.empty())
+        return;
+
+    redis.events(ctx.catalog, ctx.events);
+    if (!redis.flush())
+        return;
+    archive_cursor cursor = ctx.cursor;
+    for (auto &event : ctx.events)
+    {
+        eventIndex.add(ctx.catalog.serial(), event);
+        if (eventAfter(event, cursor))
+        {
+            cursor.events = event.timestamp;
+            cursor.entry = event.entry;
+        }
+        INFO("[Events] %s entry %u code %u tag %u at %d, seen %u times, %u on all inverters",
+             ctx.catalog.serial().c_str(), event.entry, event.code, event.tag, event.timestamp,
+             (unsigned)eventIndex.count(ctx.catalog.serial(), event.code), (unsigned)eventIndex.count(event.code));
+    }
+    archiveCursor.save(ctx.catalog.serial(), cursor);
+    ctx.cursor = cursor;
+}
+
+/* Read the event log entries newer than the cursor, publish and index them */
+void fetchEvents(RedisSink &redis, device_context &ctx, struct bluetooth_inverter *inv)
+{
+    time_t now = time(NULL);
+    ctx.events.clear();
+    if (in_smadata2plus_get_events(inv, SMADATA2PLUS_EVENTS_USER, eventsFrom(ctx, now), now, ctx.events) < 0)
+        return;
+    storeEvents(redis, ctx);
+}
+
+/* The downloads of a coroutine session, at most one per poll as in
+ * pollDevice */
+void planDownloads(device_context &ctx, uint64_t spareUntil, std::vector<session_download> &downloads)
+{
+    time_t now = time(NULL);
+    if (archive.enabled && Sys::millis() >= ctx.archiveDue && Sys::millis() < spareUntil)
+    {
+        downloads.push_back({SMADATA2PLUS_ARCHIVE_DAY, archiveFrom(ctx.cursor.day, now), now, -1, {}, {}});
+        downloads.push_back({SMADATA2PLUS_ARCHIVE_MONTH, archiveFrom(ctx.cursor.month, now), now, -1, {}, {}});
+        ctx.archiveDue = Sys::millis() + archive.interval;
+    }
+    else if (eventLog.enabled && Sys::millis() >= ctx.eventsDue && Sys::millis() < spareUntil)
+    {
+        downloads.push_back({SMADATA2PLUS_EVENTS_USER, eventsFrom(ctx, now), now, -1, {}, {}});
+        ctx.eventsDue = Sys::millis() + eventLog.interval;
+    }
+}
+
+/* Load what the downloads of a coroutine session read, as fetchArchive and
+ * fetchEvents do */
+void storeDownloads(RedisSink &redis, device_context &ctx, std::vector<session_download> &downloads)
+{
+    archive_cursor cursor = ctx.cursor;
+    for (auto &d : downloads)
+    {
+        if (d.count < 0)
+            continue;
+        if (d.command == SMADATA2PLUS_EVENTS_USER)
+        {
+            ctx.events.swap(d.events);
+            storeEvents(redis, ctx);
+        }
+        else if (d.command == SMADATA2PLUS_ARCHIVE_DAY)
+        {
+            ctx.records.swap(d.records);
+            storeArchive(redis, ctx, SMADATA2PLUS_REG_YIELD_5MIN, cursor.day);
+        }
+        else if (d.command == SMADATA2PLUS_ARCHIVE_MONTH)
         {
-            labels = r->second;
+            ctx.records.swap(d.records);
+            storeArchive(redis, ctx, SMADATA2PLUS_REG_YIELD_DAILY, cursor.month);
         }
-        if ((iter.name.rfind("voltage", 0) == 0 ||
-             iter.name.rfind("current", 0) == 0 ||
-             iter.name.rfind("power_ac_l3", 0) == 0) &&
-            iter.value > 16700.0)
-            iter.value = 0.0;
-        std::string cmd =
-            stringFormat("TS.ADD sma:%s:%s * %f LABELS %s ", serial.c_str(), iter.name.c_str(), iter.value, labels.c_str());
-        INFO("Redis.command => %s", cmd.c_str());
-        redis.command().on(cmd);
     }
+    moveArchiveCursor(ctx, cursor);
 }
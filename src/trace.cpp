@@ -0,0 +1,124 @@
+/*
+ * Session tracing
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <Log.h>
+#include "trace.h"
+
+FlightRecorder::FlightRecorder(const std::string &device, size_t capacity)
+    : _device(device), _ring(capacity ? capacity : 1), _next(0), _count(0) {}
+
+int64_t FlightRecorder::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void FlightRecorder::add(const char *name, int64_t start, int64_t end)
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    _ring[_next] = {name, start, end};
+    _next = (_next + 1) % _ring.size();
+    if (_count < _ring.size())
+        _count++;
+}
+
+/* Oldest first */
+std::vector<trace_span> FlightRecorder::spans() const
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    std::vector<trace_span> out;
+    out.reserve(_count);
+    size_t first = (_next + _ring.size() - _count) % _ring.size();
+    for (size_t i = 0; i < _count; i++)
+        out.push_back(_ring[(first + i) % _ring.size()]);
+    return out;
+}
+
+void FlightRecorder::dump(const char *reason) const
+{
+    std::vector<trace_span> spans = this->spans();
+    if (spans.empty())
+        return;
+    int64_t origin = spans.front().start;
+    WARN("[Trace] %s %s, last %u phases :", _device.c_str(), reason, (unsigned)spans.size());
+    for (auto &span : spans)
+    {
+        WARN("[Trace] %s %+10.3f ms %-16s %10.3f ms", _device.c_str(), (span.start - origin) / 1000.0,
+             span.name, (span.end - span.start) / 1000.0);
+    }
+}
+
+/* Complete ("X") events of this recorder on track tid */
+void FlightRecorder::chrome(std::string &out, int tid) const
+{
+    char event[256];
+    snprintf(event, sizeof(event),
+             "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+             tid, _device.c_str());
+    out += event;
+    for (auto &span : spans())
+    {
+        snprintf(event, sizeof(event),
+                 ",\n{\"name\":\"%s\",\"cat\":\"sma\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%lld,\"dur\":%lld}",
+                 span.name, tid, (long long)span.start, (long long)(span.end - span.start));
+        out += event;
+    }
+}
+
+Tracer::Tracer() : _enabled(false), _capacity(256), _dumpRequested(false) {}
+
+void Tracer::config(JsonObject cfg)
+{
+    if (cfg.isNull())
+        return;
+    _enabled = cfg["enabled"] | true;
+    _capacity = cfg["capacity"] | 256;
+    _file = cfg["file"] | "/tmp/sma2redis-trace.json";
+    if (_enabled)
+        INFO("[Trace] %u phases per device, SIGUSR1 writes %s", (unsigned)_capacity, _file.c_str());
+}
+
+/* NULL when tracing is off, protocol code then skips recording */
+FlightRecorder *Tracer::recorder(const std::string &device)
+{
+    if (!_enabled)
+        return NULL;
+    std::lock_guard<std::mutex> guard(_lock);
+    std::unique_ptr<FlightRecorder> &recorder = _recorders[device];
+    if (!recorder)
+        recorder.reset(new FlightRecorder(device, _capacity));
+    return recorder.get();
+}
+
+/* Handles a dump requested from a signal handler, on a normal thread */
+void Tracer::poll()
+{
+    if (!_dumpRequested.exchange(false))
+        return;
+    std::lock_guard<std::mutex> guard(_lock);
+    for (auto &kv : _recorders)
+        kv.second->dump("on request");
+    if (!_file.empty())
+    {
+        std::string out = "{\"traceEvents\":[\n";
+        int tid = 1;
+        for (auto &kv : _recorders)
+        {
+            if (tid > 1)
+                out += ",\n";
+            kv.second->chrome(out, tid++);
+        }
+        out += "\n]}\n";
+        FILE *f = fopen(_file.c_str(), "w");
+        if (f == NULL || fwrite(out.data(), 1, out.size(), f) != out.size())
+            WARN("[Trace] cannot write %s", _file.c_str());
+        else
+            INFO("[Trace] wrote %s", _file.c_str());
+        if (f)
+            fclose(f);
+    }
+}
@@ -0,0 +1,75 @@
+/*
+ * Session tracing
+ *
+ * Every device gets a flight recorder : a fixed ring of the last protocol
+ * phases (connect, each wait for a command code, login, each query) with
+ * their start and end time. Recording a span is a clock read and a copy
+ * into the ring, nothing is formatted until the ring is dumped.
+ *
+ * A recorder is dumped to the log when its session fails or times out,
+ * and all of them on SIGUSR1, which also writes a Chrome trace JSON file
+ * (chrome://tracing, Perfetto) with one track per device.
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <limero.h>
+
+struct trace_span
+{
+    const char *name; // static string
+    int64_t start;    // usec, monotonic
+    int64_t end;
+};
+
+class FlightRecorder
+{
+public:
+    FlightRecorder(const std::string &device, size_t capacity);
+    void add(const char *name, int64_t start, int64_t end);
+    void dump(const char *reason) const;
+    void chrome(std::string &out, int tid) const;
+    const std::string &device() const { return _device; }
+
+    static int64_t now();
+
+private:
+    std::vector<trace_span> spans() const;
+
+    std::string _device;
+    mutable std::mutex _lock; // the writer of a session changes threads
+    std::vector<trace_span> _ring;
+    size_t _next;
+    size_t _count;
+};
+
+/*
+ *   "trace": { "enabled": true, "capacity": 256, "file": "/tmp/sma2redis-trace.json" }
+ */
+class Tracer
+{
+public:
+    Tracer();
+    void config(JsonObject cfg);
+    FlightRecorder *recorder(const std::string &device);
+    void requestDump() { _dumpRequested = true; }
+    void poll();
+
+private:
+    bool _enabled;
+    size_t _capacity;
+    std::string _file;
+    std::atomic<bool> _dumpRequested;
+    mutable std::mutex _lock;
+    std::map<std::string, std::unique_ptr<FlightRecorder>> _recorders;
+};
+
+#endif /* TRACE_H_ */
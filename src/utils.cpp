@@ -299,8 +299,9 @@ bool convert_long(string incoming, long *outgoing)
     }
 }
 
-/* Get the name of a bluetooth device. If bt_address is empty, print all available devices  */
-std::string get_bt_name(string bt_address)
+/* Get the name of a bluetooth device. If bt_address is empty, print all available devices.
+ * timeout in msec for the name request of a device, 0 = as long as the adapter takes */
+std::string get_bt_name(string bt_address, int timeout)
 {
     inquiry_info *ii = NULL;
     int max_rsp, num_rsp;
@@ -349,12 +350,14 @@ std::string get_bt_name(string bt_address)
     else
     {
         str2ba(bt_address.c_str(), &dst_addr);
-        if (hci_read_remote_name(sock, &dst_addr, sizeof(name), name, 0) < 0)
+        if (hci_read_remote_name(sock, &dst_addr, sizeof(name), name, timeout) < 0)
         {
+            close(sock);
             return "";
         }
         else
         {
+            close(sock);
             return name;
         }
     }
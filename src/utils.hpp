@@ -44,7 +44,7 @@ bool check_pid_file();
 void remove_pid_file();
 string trim_whitespace(string raw_string);
 bool convert_long(string incoming, long *outgoing);
-std::string get_bt_name(string bt_address);
+std::string get_bt_name(string bt_address, int timeout = 0);
 string get_serial(string device_name);
 
 #endif /* UTILS_HPP_INCLUDED */
@@ -0,0 +1,92 @@
+/*
+ * Work-stealing pool
+ */
+
+#include "workpool.h"
+
+WorkPool::WorkPool(size_t workers)
+    : _pending(0), _next(0), _stop(false), _executed(0), _stolen(0)
+{
+    for (size_t i = 0; i < workers; i++)
+        _queues.emplace_back(new queue());
+    for (size_t i = 0; i < workers; i++)
+        _threads.emplace_back(&WorkPool::run, this, i);
+}
+
+/* Runs what is still queued, then stops the workers */
+WorkPool::~WorkPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(_idleLock);
+        _stop = true;
+    }
+    _idle.notify_all();
+    for (auto &thread : _threads)
+        thread.join();
+}
+
+/* _pending counts the task before it can be taken, a worker's decrement
+ * never runs ahead of it */
+void WorkPool::submit(task t)
+{
+    queue &q = *_queues[_next++ % _queues.size()];
+    {
+        std::lock_guard<std::mutex> guard(_idleLock);
+        _pending++;
+    }
+    {
+        std::lock_guard<std::mutex> guard(q.lock);
+        q.tasks.push_back(std::move(t));
+    }
+    _idle.notify_one();
+}
+
+/* Newest task of our own deque, else the oldest one of another worker */
+bool WorkPool::take(size_t self, task &t)
+{
+    {
+        queue &own = *_queues[self];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.tasks.empty())
+        {
+            t = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            _pending--;
+            return true;
+        }
+    }
+    for (size_t i = 1; i < _queues.size(); i++)
+    {
+        queue &victim = *_queues[(self + i) % _queues.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.tasks.empty())
+        {
+            t = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            _pending--;
+            _stolen++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkPool::run(size_t self)
+{
+    task t;
+    for (;;)
+    {
+        if (take(self, t))
+        {
+            t();
+            t = nullptr;
+            _executed++;
+            continue;
+        }
+        std::unique_lock<std::mutex> idle(_idleLock);
+        if (_stop && _pending == 0)
+            break;
+        _idle.wait(idle, [&]
+                   { return _stop || _pending > 0; });
+    }
+}
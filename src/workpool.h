@@ -0,0 +1,57 @@
+/*
+ * Work-stealing pool
+ *
+ * A few worker threads, each with a deque of its own. Tasks are handed
+ * out round robin, a worker takes the newest task of its own deque and
+ * when that is empty steals the oldest of another one, so a burst of
+ * large responses of one inverter still spreads over all cores.
+ */
+
+#ifndef WORKPOOL_H_
+#define WORKPOOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <functional>
+
+class WorkPool
+{
+public:
+    typedef std::function<void()> task;
+
+    WorkPool(size_t workers);
+    ~WorkPool();
+    size_t workers() const { return _threads.size(); }
+    void submit(task t);
+    uint32_t executed() const { return _executed.load(std::memory_order_relaxed); }
+    uint32_t stolen() const { return _stolen.load(std::memory_order_relaxed); }
+
+private:
+    struct queue
+    {
+        std::mutex lock;
+        std::deque<task> tasks;
+    };
+
+    void run(size_t self);
+    bool take(size_t self, task &t);
+
+    std::vector<std::unique_ptr<queue>> _queues;
+    std::vector<std::thread> _threads;
+    std::mutex _idleLock;
+    std::condition_variable _idle;
+    std::atomic<size_t> _pending;
+    std::atomic<size_t> _next;
+    std::atomic<bool> _stop;
+    std::atomic<uint32_t> _executed;
+    std::atomic<uint32_t> _stolen;
+};
+
+#endif /* WORKPOOL_H_ */